@@ -0,0 +1,566 @@
+#include "Bvh.h"
+
+#include <glm/gtc/matrix_transform.hpp>
+#include <xmmintrin.h>
+#include <stdio.h>
+#include <algorithm>
+#include <cfloat>
+#include <chrono>
+#include <cmath>
+#include <numeric>
+#include <random>
+
+Aabb::Aabb() : mMin(FLT_MAX), mMax(-FLT_MAX)
+{
+}
+
+void Aabb::Grow(const glm::vec3& p)
+{
+   mMin = glm::min(mMin, p);
+   mMax = glm::max(mMax, p);
+}
+
+void Aabb::Grow(const Aabb& b)
+{
+   mMin = glm::min(mMin, b.mMin);
+   mMax = glm::max(mMax, b.mMax);
+}
+
+float Aabb::Area() const
+{
+   const glm::vec3 d = glm::max(mMax - mMin, glm::vec3(0.0f));
+   return d.x * d.y + d.y * d.z + d.z * d.x;
+}
+
+//Beyond this depth nodes are split at the middle of their range, which bounds the depth of any tree
+//to SahDepth + log2(primitives) and keeps the traversal stack small
+static const int SahDepth = 48;
+static const int StackSize = 128;
+
+static Aabb range_bounds(const std::vector<Aabb>& boxes, const std::vector<int>& order, int first, int count)
+{
+   Aabb bounds;
+   for (int i = first; i < first + count; i++)
+   {
+      bounds.Grow(boxes[order[i]]);
+   }
+   return bounds;
+}
+
+//Binned SAH build over boxes. Reorders order so that each leaf covers order[mFirst, mFirst + mCount).
+//Children are stored after their parents, so iterating backwards visits children first.
+static void build_nodes(const std::vector<Aabb>& boxes, int max_leaf, std::vector<BvhNode>& nodes, std::vector<int>& order)
+{
+   const int n = int(boxes.size());
+   order.resize(n);
+   std::iota(order.begin(), order.end(), 0);
+   nodes.clear();
+   if (n == 0) return;
+
+   std::vector<glm::vec3> centers(n);
+   for (int i = 0; i < n; i++)
+   {
+      centers[i] = 0.5f * (boxes[i].mMin + boxes[i].mMax);
+   }
+   nodes.reserve(2 * (n / max_leaf + 1));
+   nodes.push_back({ range_bounds(boxes, order, 0, n), 0, n });
+
+   const int Bins = 16;
+   struct Task
+   {
+      int node;
+      int depth;
+   };
+   std::vector<Task> tasks(1, Task{ 0, 0 });
+   while (tasks.empty() == false)
+   {
+      const Task task = tasks.back();
+      tasks.pop_back();
+      const int first = nodes[task.node].mFirst;
+      const int count = nodes[task.node].mCount;
+      if (count <= max_leaf) continue;
+
+      Aabb center_bounds;
+      for (int i = first; i < first + count; i++)
+      {
+         center_bounds.Grow(centers[order[i]]);
+      }
+
+      //Cost of a child is its area times the leaves its primitives need at least
+      int best_axis = -1, best_bin = 0;
+      float best_cost = FLT_MAX;
+      for (int axis = 0; axis < 3 && task.depth < SahDepth; axis++)
+      {
+         const float lo = center_bounds.mMin[axis];
+         const float extent = center_bounds.mMax[axis] - lo;
+         if (extent <= 0.0f) continue;
+         const float scale = Bins / extent;
+
+         Aabb bin_bounds[Bins];
+         int bin_count[Bins] = {};
+         for (int i = first; i < first + count; i++)
+         {
+            const int b = std::min(Bins - 1, int((centers[order[i]][axis] - lo) * scale));
+            bin_count[b]++;
+            bin_bounds[b].Grow(boxes[order[i]]);
+         }
+
+         float right_area[Bins];
+         int right_count[Bins];
+         Aabb right;
+         int right_n = 0;
+         for (int b = Bins - 1; b > 0; b--)
+         {
+            right.Grow(bin_bounds[b]);
+            right_n += bin_count[b];
+            right_area[b] = right.Area();
+            right_count[b] = right_n;
+         }
+         Aabb left;
+         int left_n = 0;
+         for (int b = 1; b < Bins; b++)
+         {
+            left.Grow(bin_bounds[b - 1]);
+            left_n += bin_count[b - 1];
+            if (left_n == 0 || right_count[b] == 0) continue;
+            const float cost = left.Area() * float((left_n + max_leaf - 1) / max_leaf) +
+               right_area[b] * float((right_count[b] + max_leaf - 1) / max_leaf);
+            if (cost < best_cost)
+            {
+               best_cost = cost;
+               best_axis = axis;
+               best_bin = b;
+            }
+         }
+      }
+
+      int middle = first + count / 2;
+      if (best_axis != -1)
+      {
+         const float lo = center_bounds.mMin[best_axis];
+         const float scale = Bins / (center_bounds.mMax[best_axis] - lo);
+         middle = int(std::partition(order.begin() + first, order.begin() + first + count, [&](int p)
+         {
+            return std::min(Bins - 1, int((centers[p][best_axis] - lo) * scale)) < best_bin;
+         }) - order.begin());
+      }
+      if (middle == first || middle == first + count)
+      {
+         middle = first + count / 2; //every center in one bin
+      }
+
+      const int left = int(nodes.size());
+      nodes.push_back({ range_bounds(boxes, order, first, middle - first), first, middle - first });
+      nodes.push_back({ range_bounds(boxes, order, middle, first + count - middle), middle, first + count - middle });
+      nodes[task.node].mFirst = left;
+      nodes[task.node].mCount = 0;
+      tasks.push_back({ left, task.depth + 1 });
+      tasks.push_back({ left + 1, task.depth + 1 });
+   }
+}
+
+//Distance along the ray to where it enters the box, FLT_MAX if it misses it before t_max
+static inline float enter_box(const Aabb& b, const glm::vec3& origin, const glm::vec3& inv_dir, float t_max)
+{
+   const glm::vec3 t0 = (b.mMin - origin) * inv_dir;
+   const glm::vec3 t1 = (b.mMax - origin) * inv_dir;
+   const glm::vec3 t_enter = glm::min(t0, t1);
+   const glm::vec3 t_exit = glm::max(t0, t1);
+   const float enter = std::max(std::max(t_enter.x, t_enter.y), std::max(t_enter.z, 0.0f));
+   const float exit = std::min(std::min(t_exit.x, t_exit.y), std::min(t_exit.z, t_max));
+   return (enter <= exit) ? enter : FLT_MAX;
+}
+
+//Axis-parallel rays would divide by zero and produce 0*inf = NaN in the slab test
+static glm::vec3 inverse_direction(const glm::vec3& dir)
+{
+   glm::vec3 inv;
+   for (int i = 0; i < 3; i++)
+   {
+      const float d = (std::fabs(dir[i]) < 1e-20f) ? std::copysign(1e-20f, dir[i]) : dir[i];
+      inv[i] = 1.0f / d;
+   }
+   return inv;
+}
+
+MeshBvh::MeshBvh() : mNumTriangles(0)
+{
+}
+
+void MeshBvh::Build(const float* positions, const unsigned int* indices, int num_triangles)
+{
+   mNumTriangles = num_triangles;
+   std::vector<Aabb> boxes(num_triangles);
+   for (int i = 0; i < num_triangles; i++)
+   {
+      for (int k = 0; k < 3; k++)
+      {
+         const float* p = positions + 3 * indices[3 * i + k];
+         boxes[i].Grow(glm::vec3(p[0], p[1], p[2]));
+      }
+   }
+   std::vector<int> order;
+   build_nodes(boxes, LeafSize, mNodes, order);
+
+   //One packet per leaf
+   mPackets.clear();
+   for (BvhNode& node : mNodes)
+   {
+      if (node.mCount == 0) continue;
+
+      Packet packet = {};
+      for (int lane = 0; lane < LeafSize; lane++)
+      {
+         packet.mTriangle[lane] = -1;
+         if (lane >= node.mCount) continue;
+
+         const int triangle = order[node.mFirst + lane];
+         const float* v0 = positions + 3 * indices[3 * triangle + 0];
+         const float* v1 = positions + 3 * indices[3 * triangle + 1];
+         const float* v2 = positions + 3 * indices[3 * triangle + 2];
+         for (int c = 0; c < 3; c++)
+         {
+            packet.mV0[c][lane] = v0[c];
+            packet.mE1[c][lane] = v1[c] - v0[c];
+            packet.mE2[c][lane] = v2[c] - v0[c];
+         }
+         packet.mTriangle[lane] = triangle;
+      }
+      node.mFirst = int(mPackets.size());
+      mPackets.push_back(packet);
+   }
+}
+
+const Aabb& MeshBvh::Bounds() const
+{
+   static const Aabb empty;
+   return mNodes.empty() ? empty : mNodes[0].mBounds;
+}
+
+//Moeller-Trumbore for the 4 triangles of a packet at once
+bool MeshBvh::Intersect(const glm::vec3& origin, const glm::vec3& dir, float t_max, RayHit& hit) const
+{
+   if (mNodes.empty()) return false;
+
+   const glm::vec3 inv_dir = inverse_direction(dir);
+   const __m128 ox = _mm_set1_ps(origin.x), oy = _mm_set1_ps(origin.y), oz = _mm_set1_ps(origin.z);
+   const __m128 dx = _mm_set1_ps(dir.x), dy = _mm_set1_ps(dir.y), dz = _mm_set1_ps(dir.z);
+   const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+
+   float closest = t_max;
+   bool found = false;
+   struct Entry
+   {
+      int node;
+      float enter;
+   };
+   Entry stack[StackSize];
+   int top = 0;
+   const float root_enter = enter_box(mNodes[0].mBounds, origin, inv_dir, closest);
+   if (root_enter == FLT_MAX) return false;
+   stack[top++] = { 0, root_enter };
+
+   while (top > 0)
+   {
+      const Entry entry = stack[--top];
+      if (entry.enter >= closest) continue; //a closer hit was found since it was pushed
+      const BvhNode& node = mNodes[entry.node];
+
+      if (node.mCount > 0)
+      {
+         const Packet& p = mPackets[node.mFirst];
+         const __m128 e1x = _mm_loadu_ps(p.mE1[0]), e1y = _mm_loadu_ps(p.mE1[1]), e1z = _mm_loadu_ps(p.mE1[2]);
+         const __m128 e2x = _mm_loadu_ps(p.mE2[0]), e2y = _mm_loadu_ps(p.mE2[1]), e2z = _mm_loadu_ps(p.mE2[2]);
+
+         //pvec = dir x e2, det = e1 . pvec
+         const __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+         const __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+         const __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+         const __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+         const __m128 inv_det = _mm_div_ps(one, det);
+
+         //tvec = origin - v0, qvec = tvec x e1
+         const __m128 tx = _mm_sub_ps(ox, _mm_loadu_ps(p.mV0[0]));
+         const __m128 ty = _mm_sub_ps(oy, _mm_loadu_ps(p.mV0[1]));
+         const __m128 tz = _mm_sub_ps(oz, _mm_loadu_ps(p.mV0[2]));
+         const __m128 qx = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(tz, e1y));
+         const __m128 qy = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(tx, e1z));
+         const __m128 qz = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(ty, e1x));
+
+         const __m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz)), inv_det);
+         const __m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), inv_det);
+         const __m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), inv_det);
+
+         //Zero det (parallel, or an unused lane) gives infinities and NaNs, which fail the compares
+         __m128 mask = _mm_cmpneq_ps(det, zero);
+         mask = _mm_and_ps(mask, _mm_cmpge_ps(u, zero));
+         mask = _mm_and_ps(mask, _mm_cmpge_ps(v, zero));
+         mask = _mm_and_ps(mask, _mm_cmple_ps(_mm_add_ps(u, v), one));
+         mask = _mm_and_ps(mask, _mm_cmpge_ps(t, zero));
+         mask = _mm_and_ps(mask, _mm_cmplt_ps(t, _mm_set1_ps(closest)));
+         const int lanes = _mm_movemask_ps(mask);
+         if (lanes != 0)
+         {
+            float ts[4];
+            _mm_storeu_ps(ts, t);
+            for (int lane = 0; lane < 4; lane++)
+            {
+               if ((lanes & (1 << lane)) && ts[lane] < closest)
+               {
+                  closest = ts[lane];
+                  hit.triangle = p.mTriangle[lane];
+                  found = true;
+               }
+            }
+         }
+         continue;
+      }
+
+      //Visit the nearer child first
+      const int a = node.mFirst, b = node.mFirst + 1;
+      const float enter_a = enter_box(mNodes[a].mBounds, origin, inv_dir, closest);
+      const float enter_b = enter_box(mNodes[b].mBounds, origin, inv_dir, closest);
+      const bool a_first = (enter_a <= enter_b);
+      const Entry nearer = a_first ? Entry{ a, enter_a } : Entry{ b, enter_b };
+      const Entry farther = a_first ? Entry{ b, enter_b } : Entry{ a, enter_a };
+      if (farther.enter != FLT_MAX) stack[top++] = farther;
+      if (nearer.enter != FLT_MAX) stack[top++] = nearer;
+   }
+
+   if (found == true)
+   {
+      hit.t = closest;
+      hit.instance = -1;
+      hit.position = origin + closest * dir;
+   }
+   return found;
+}
+
+SceneBvh::SceneBvh() : mRefit(false), mRebuild(false), mRefitMs(0.0f)
+{
+}
+
+void SceneBvh::SetInstance(int i, const MeshBvh* mesh, const glm::mat4& matrix)
+{
+   if (i >= int(mInstances.size()))
+   {
+      mInstances.resize(i + 1, Instance{ nullptr, glm::mat4(1.0f), glm::mat4(1.0f), Aabb() });
+      mRebuild = true;
+   }
+   Instance& instance = mInstances[i];
+   if (instance.mMesh != mesh || instance.mMatrix != matrix)
+   {
+      instance.mMesh = mesh;
+      instance.mMatrix = matrix;
+      instance.mInverse = glm::inverse(matrix);
+      mRefit = true;
+   }
+}
+
+//Bounds of the 8 transformed corners. A projective matrix may put corners behind the eye (w <= 0),
+//where the projected box is unbounded: use a box larger than anything a ray is tested against.
+static Aabb transform_bounds(const Aabb& b, const glm::mat4& matrix)
+{
+   Aabb bounds;
+   if (b.mMin.x > b.mMax.x) return bounds; //empty mesh
+   for (int corner = 0; corner < 8; corner++)
+   {
+      const glm::vec3 p((corner & 1) ? b.mMax.x : b.mMin.x, (corner & 2) ? b.mMax.y : b.mMin.y, (corner & 4) ? b.mMax.z : b.mMin.z);
+      const glm::vec4 q = matrix * glm::vec4(p, 1.0f);
+      if (q.w <= 1e-6f)
+      {
+         bounds.mMin = glm::vec3(-1e15f);
+         bounds.mMax = glm::vec3(1e15f);
+         return bounds;
+      }
+      bounds.Grow(glm::vec3(q) / q.w);
+   }
+   return bounds;
+}
+
+void SceneBvh::update()
+{
+   if (mRefit == false && mRebuild == false) return;
+
+   const auto start = std::chrono::high_resolution_clock::now();
+   for (Instance& instance : mInstances)
+   {
+      instance.mBounds = (instance.mMesh != nullptr) ? transform_bounds(instance.mMesh->Bounds(), instance.mMatrix) : Aabb();
+   }
+   if (mRebuild == true)
+   {
+      std::vector<Aabb> boxes(mInstances.size());
+      for (size_t i = 0; i < mInstances.size(); i++)
+      {
+         boxes[i] = mInstances[i].mBounds;
+      }
+      build_nodes(boxes, 1, mNodes, mOrder);
+   }
+   else
+   {
+      //Children come after their parents
+      for (int i = int(mNodes.size()) - 1; i >= 0; i--)
+      {
+         BvhNode& node = mNodes[i];
+         node.mBounds = Aabb();
+         if (node.mCount > 0)
+         {
+            for (int j = node.mFirst; j < node.mFirst + node.mCount; j++)
+            {
+               node.mBounds.Grow(mInstances[mOrder[j]].mBounds);
+            }
+         }
+         else
+         {
+            node.mBounds.Grow(mNodes[node.mFirst].mBounds);
+            node.mBounds.Grow(mNodes[node.mFirst + 1].mBounds);
+         }
+      }
+   }
+   mRefit = false;
+   mRebuild = false;
+   mRefitMs = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+bool SceneBvh::Intersect(const glm::vec3& from, const glm::vec3& to, RayHit& hit)
+{
+   update();
+   if (mNodes.empty()) return false;
+
+   const glm::vec3 dir = to - from;
+   const glm::vec3 inv_dir = inverse_direction(dir);
+   float closest = 1.0f;
+   bool found = false;
+   int stack[StackSize];
+   int top = 0;
+   stack[top++] = 0;
+   while (top > 0)
+   {
+      const BvhNode& node = mNodes[stack[--top]];
+      if (enter_box(node.mBounds, from, inv_dir, closest) == FLT_MAX) continue;
+      if (node.mCount == 0)
+      {
+         stack[top++] = node.mFirst + 1;
+         stack[top++] = node.mFirst;
+         continue;
+      }
+
+      for (int j = node.mFirst; j < node.mFirst + node.mCount; j++)
+      {
+         const Instance& instance = mInstances[mOrder[j]];
+         if (instance.mMesh == nullptr) continue;
+
+         //The segment up to the closest hit so far, in object space. Projective matrices don't keep
+         //distances along the segment, but they keep the order of points on it while w stays positive.
+         const glm::vec4 a = instance.mInverse * glm::vec4(from, 1.0f);
+         const glm::vec4 b = instance.mInverse * glm::vec4(from + closest * dir, 1.0f);
+         if (a.w <= 0.0f || b.w <= 0.0f) continue;
+         const glm::vec3 object_from = glm::vec3(a) / a.w;
+         const glm::vec3 object_to = glm::vec3(b) / b.w;
+
+         RayHit object_hit;
+         if (instance.mMesh->Intersect(object_from, object_to - object_from, 1.0f, object_hit))
+         {
+            const glm::vec4 p = instance.mMatrix * glm::vec4(object_hit.position, 1.0f);
+            const float t = glm::dot(glm::vec3(p) / p.w - from, dir) / glm::dot(dir, dir);
+            closest = std::min(t, closest);
+            hit = object_hit;
+            hit.t = closest;
+            hit.instance = mOrder[j];
+            found = true;
+         }
+      }
+   }
+   return found;
+}
+
+//A sphere with ripples, so triangles differ in size and orientation
+static void make_sphere(int triangles, std::vector<float>& positions, std::vector<unsigned int>& indices)
+{
+   const int rings = std::max(2, int(std::sqrt(triangles / 4.0)));
+   const int segments = 2 * rings;
+   const float pi = 3.14159265f;
+   positions.clear();
+   indices.clear();
+   for (int r = 0; r <= rings; r++)
+   {
+      const float theta = pi * r / rings;
+      for (int s = 0; s <= segments; s++)
+      {
+         const float phi = 2.0f * pi * s / segments;
+         const float radius = 1.0f + 0.05f * std::sin(7.0f * theta) * std::sin(9.0f * phi);
+         positions.push_back(radius * std::sin(theta) * std::cos(phi));
+         positions.push_back(radius * std::cos(theta));
+         positions.push_back(radius * std::sin(theta) * std::sin(phi));
+      }
+   }
+   for (int r = 0; r < rings; r++)
+   {
+      for (int s = 0; s < segments; s++)
+      {
+         const unsigned int i0 = r * (segments + 1) + s, i1 = i0 + 1;
+         const unsigned int i2 = i0 + segments + 1, i3 = i2 + 1;
+         const unsigned int quad[6] = { i0, i2, i1, i1, i2, i3 };
+         indices.insert(indices.end(), quad, quad + 6);
+      }
+   }
+}
+
+int BvhBenchmark(int triangles, int instances, int rays)
+{
+   std::vector<float> positions;
+   std::vector<unsigned int> indices;
+   make_sphere(triangles, positions, indices);
+   const int num_triangles = int(indices.size() / 3);
+
+   auto start = std::chrono::high_resolution_clock::now();
+   MeshBvh mesh;
+   mesh.Build(positions.data(), indices.data(), num_triangles);
+   const float build_ms = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+   printf("Mesh BVH: %d triangles, %d nodes, built in %.1f ms\n", num_triangles, mesh.NumNodes(), build_ms);
+
+   //Instances on a grid filling the view. Rays are picks in normalized device coordinates, like the
+   //FBO demo's, so the instance matrices are projective.
+   const int side = int(std::ceil(std::sqrt(double(instances))));
+   const glm::mat4 P = glm::perspective(3.14159265f / 4.0f, 1.0f, 0.1f, 100.0f);
+   const glm::mat4 V = glm::lookAt(glm::vec3(0.0f, 0.0f, 2.5f * side + 1.0f), glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+   std::vector<glm::vec3> offsets(instances);
+   SceneBvh scene;
+   for (int i = 0; i < instances; i++)
+   {
+      offsets[i] = glm::vec3(2.2f * (i % side - 0.5f * (side - 1)), 2.2f * (i / side - 0.5f * (side - 1)), 0.0f);
+      scene.SetInstance(i, &mesh, P * V * glm::translate(glm::mat4(1.0f), offsets[i]));
+   }
+
+   std::mt19937 random(1234);
+   std::uniform_real_distribution<float> ndc(-1.0f, 1.0f);
+   std::vector<glm::vec2> points(rays);
+   for (glm::vec2& p : points)
+   {
+      p = glm::vec2(ndc(random), ndc(random));
+   }
+
+   RayHit hit;
+   scene.Intersect(glm::vec3(0.0f, 0.0f, -1.0f), glm::vec3(0.0f, 0.0f, 1.0f), hit); //builds the top level
+   printf("Scene BVH: %d instances, %lld triangles, built in %.3f ms\n", instances,
+      (long long)instances * num_triangles, scene.RefitMs());
+
+   int hits = 0;
+   start = std::chrono::high_resolution_clock::now();
+   for (const glm::vec2& p : points)
+   {
+      if (scene.Intersect(glm::vec3(p, -1.0f), glm::vec3(p, 1.0f), hit)) hits++;
+   }
+   const float pick_s = std::chrono::duration<float>(std::chrono::high_resolution_clock::now() - start).count();
+   printf("%d picks in %.1f ms: %.0f picks/s, %.2f us/pick, %d hits\n", rays, 1000.0f * pick_s,
+      rays / pick_s, 1.0e6f * pick_s / rays, hits);
+
+   //Every instance moves, as when dragging in the demo moves one
+   for (int i = 0; i < instances; i++)
+   {
+      scene.SetInstance(i, &mesh, P * V * glm::translate(glm::mat4(1.0f), offsets[i] + glm::vec3(0.1f, 0.0f, 0.0f)));
+   }
+   scene.Intersect(glm::vec3(0.0f, 0.0f, -1.0f), glm::vec3(0.0f, 0.0f, 1.0f), hit);
+   printf("Scene BVH refit after moving every instance: %.3f ms\n", scene.RefitMs());
+   return 0;
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <vector>
+
+//Bounding volume hierarchies for picking by ray casting on the CPU, with no GPU readback.
+//MeshBvh is built once per mesh over its triangles with the binned surface area heuristic. Its leaves
+//hold up to 4 triangles laid out so one SSE test intersects all of them.
+//SceneBvh is the level above: one leaf per instance, each a MeshBvh and a matrix from the mesh's
+//object space to the space rays are given in. Changing matrices only refits the bounds.
+
+struct Aabb
+{
+   glm::vec3 mMin, mMax;
+
+   Aabb();  //empty
+   void Grow(const glm::vec3& p);
+   void Grow(const Aabb& b);
+   float Area() const;  //half the surface area, enough to compare
+};
+
+struct BvhNode
+{
+   Aabb mBounds;
+   int mFirst;   //inner nodes: first child, the second follows it. Leaves: first primitive.
+   int mCount;   //primitives in a leaf, 0 for inner nodes
+};
+
+struct RayHit
+{
+   float t;              //where the hit is along the ray or segment
+   int triangle;         //index of the triangle in the indices the mesh was built from
+   int instance;         //SceneBvh only
+   glm::vec3 position;   //in the mesh's object space
+};
+
+class MeshBvh
+{
+public:
+   static const int LeafSize = 4;
+
+   MeshBvh();
+
+   //positions are xyz triples, indices three per triangle
+   void Build(const float* positions, const unsigned int* indices, int num_triangles);
+
+   //Closest hit of origin + t*dir with t in [0, t_max)
+   bool Intersect(const glm::vec3& origin, const glm::vec3& dir, float t_max, RayHit& hit) const;
+
+   const Aabb& Bounds() const;
+   int NumTriangles() const {return mNumTriangles;}
+   int NumNodes() const {return int(mNodes.size());}
+
+private:
+   //4 triangles, one per SSE lane. Unused lanes have zero edges, which never hit.
+   struct Packet
+   {
+      float mV0[3][4];
+      float mE1[3][4];   //v1 - v0
+      float mE2[3][4];   //v2 - v0
+      int mTriangle[4];
+   };
+
+   std::vector<BvhNode> mNodes;   //leaves point at one packet
+   std::vector<Packet> mPackets;
+   int mNumTriangles;
+};
+
+class SceneBvh
+{
+public:
+   SceneBvh();
+
+   //Adds instance i if it is new. The mesh must outlive this. Marks the bounds for a refit when the
+   //matrix changed. Matrices may be projective (e.g. object space to clip space).
+   void SetInstance(int i, const MeshBvh* mesh, const glm::mat4& matrix);
+
+   //Closest hit on the segment from -> to, hit.t in [0, 1]. Refits or builds first if needed.
+   bool Intersect(const glm::vec3& from, const glm::vec3& to, RayHit& hit);
+
+   int NumInstances() const {return int(mInstances.size());}
+   float RefitMs() const {return mRefitMs;}  //of the last refit or build
+
+private:
+   struct Instance
+   {
+      const MeshBvh* mMesh;
+      glm::mat4 mMatrix;
+      glm::mat4 mInverse;
+      Aabb mBounds;
+   };
+
+   void update();
+
+   std::vector<Instance> mInstances;
+   std::vector<BvhNode> mNodes;
+   std::vector<int> mOrder;   //instances in leaf order
+   bool mRefit;               //a matrix changed
+   bool mRebuild;             //instances were added
+   float mRefitMs;
+};
+
+//Builds a mesh of about triangles triangles, instances copies of it and times random picks.
+//Needs no GL context. Returns the exit code for main.
+int BvhBenchmark(int triangles, int instances, int rays);
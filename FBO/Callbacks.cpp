@@ -2,11 +2,18 @@
 #include "Scene.h"
 #include <glm/glm.hpp>
 #include <iostream>
+#include <vector>
 
 bool isDragging = false;
 
 float clickScreenPos[] = { 0.0,0.0 };
 
+//Shift+drag selects the instances in a rectangle, Ctrl+drag the instances in a lasso
+enum Selection { NoSelection, RectangleSelection, LassoSelection };
+Selection selection = NoSelection;
+glm::ivec2 selectionStart;
+std::vector<glm::vec2> lasso; //window coordinates with y up
+
 void Callbacks::Register(GLFWwindow* window)
 {
    glfwSetKeyCallback(window, Keyboard);
@@ -39,6 +46,9 @@ void Callbacks::Keyboard(GLFWwindow* window, int key, int scancode, int action,
 //This function gets called when the mouse moves over the window.
 void Callbacks::MouseCursor(GLFWwindow* window, double x, double y)
 {
+    if (selection == LassoSelection) {
+        lasso.push_back(glm::vec2(x, Scene::WindowHeight - y));
+    }
     if (isDragging) {
         // Convert mouse position to normalized screen space (-1 to 1)
         float screenX = (2.0f * x / Scene::WindowWidth) - 1.0f;
@@ -61,17 +71,39 @@ void Callbacks::MouseButton(GLFWwindow* window, int button, int action, int mods
 
             int readX = static_cast<int>(xpos);
             int readY = Scene::WindowHeight - static_cast<int>(ypos);
-            int pickID = Scene::readPickID(readX, readY);
-          
-            // Output selected object
-            if (pickID > 0) {
-                std::cout << "Object ID Picked: " << pickID << std::endl;
-                isDragging = true;
+            if (mods & (GLFW_MOD_SHIFT | GLFW_MOD_CONTROL)) {
+                selection = (mods & GLFW_MOD_SHIFT) ? RectangleSelection : LassoSelection;
+                selectionStart = glm::ivec2(readX, readY);
+                lasso.assign(1, glm::vec2(xpos, Scene::WindowHeight - ypos));
+                return;
+            }
+            Scene::requestPickID(readX, readY, [window](int pickID) {
+                // The pick resolves a frame or two later. Don't start dragging if the button is already up.
+                if (glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_LEFT) != GLFW_PRESS) {
+                    Scene::resetPickID();
+                    return;
+                }
+                // Output selected object
+                if (pickID > 0) {
+                    std::cout << "Object ID Picked: " << pickID << std::endl;
+                    isDragging = true;
+                }
+                else {
+                    std::cout << "No object selected"  << std::endl;
+                    isDragging = false;
+                }
+            });
+        }
+        else if (action == GLFW_RELEASE && selection != NoSelection) {
+            double xpos, ypos;
+            glfwGetCursorPos(window, &xpos, &ypos);
+            if (selection == RectangleSelection) {
+                Scene::selectRectangle(selectionStart.x, selectionStart.y, static_cast<int>(xpos), Scene::WindowHeight - static_cast<int>(ypos));
             }
             else {
-                std::cout << "No object selected"  << std::endl;
-                isDragging = false;
+                Scene::selectLasso(lasso);
             }
+            selection = NoSelection;
         }
         else if (action == GLFW_RELEASE) {
             Scene::resetPickID(); // Reset object ID on release
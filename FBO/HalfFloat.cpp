@@ -0,0 +1,192 @@
+#include "HalfFloat.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <vector>
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define F16C_TARGET __attribute__((target("avx,f16c")))
+#else
+#define F16C_TARGET
+#endif
+
+bool HasF16C()
+{
+   static int has_f16c = -1;
+   if (has_f16c == -1)
+   {
+#ifdef _MSC_VER
+      int info[4] = { 0 };
+      __cpuid(info, 1);
+      const bool avx = (info[2] & (1 << 28)) != 0;
+      const bool f16c = (info[2] & (1 << 29)) != 0;
+      const bool os_saves_ymm = (info[2] & (1 << 27)) != 0 && (_xgetbv(0) & 6) == 6;
+      has_f16c = (avx && f16c && os_saves_ymm) ? 1 : 0;
+#else
+      has_f16c = (__builtin_cpu_supports("avx") && __builtin_cpu_supports("f16c")) ? 1 : 0;
+#endif
+   }
+   return has_f16c == 1;
+}
+
+uint16_t FloatToHalf(float f)
+{
+   uint32_t x;
+   memcpy(&x, &f, sizeof(x));
+
+   const uint32_t sign = (x >> 16) & 0x8000;
+   const uint32_t abs_x = x & 0x7fffffff;
+
+   if (abs_x >= 0x7f800000) //inf or nan
+   {
+      const uint32_t nan_bit = (abs_x > 0x7f800000) ? (0x200 | ((abs_x >> 13) & 0x3ff)) : 0;
+      return uint16_t(sign | 0x7c00 | nan_bit);
+   }
+   if (abs_x >= 0x477ff000) //rounds to a value above the largest half (65504)
+   {
+      return uint16_t(sign | 0x7c00);
+   }
+   if (abs_x < 0x38800000) //result is a half denormal (or zero)
+   {
+      if (abs_x < 0x33000000) return uint16_t(sign); //below half the smallest denormal
+      const uint32_t e = abs_x >> 23;
+      const uint32_t m = (abs_x & 0x7fffff) | 0x800000;
+      const uint32_t shift = 126 - e; //14..24
+      uint32_t h = m >> shift;
+      const uint32_t rem = m & ((1u << shift) - 1);
+      const uint32_t halfway = 1u << (shift - 1);
+      if (rem > halfway || (rem == halfway && (h & 1))) h++;
+      return uint16_t(sign | h);
+   }
+
+   //normal: rebias exponent and round mantissa to 10 bits
+   uint32_t h = ((abs_x - 0x38000000) >> 13);
+   const uint32_t rem = abs_x & 0x1fff;
+   if (rem > 0x1000 || (rem == 0x1000 && (h & 1))) h++; //carry into the exponent is correct
+   return uint16_t(sign | h);
+}
+
+void FloatToHalfScalar(const float* src, uint16_t* dst, size_t n)
+{
+   for (size_t i = 0; i < n; i++)
+   {
+      dst[i] = FloatToHalf(src[i]);
+   }
+}
+
+F16C_TARGET static void float_to_half_f16c(const float* src, uint16_t* dst, size_t n)
+{
+   size_t i = 0;
+   for (; i + 16 <= n; i += 16)
+   {
+      __m256 a = _mm256_loadu_ps(src + i);
+      __m256 b = _mm256_loadu_ps(src + i + 8);
+      _mm_storeu_si128((__m128i*)(dst + i), _mm256_cvtps_ph(a, _MM_FROUND_TO_NEAREST_INT));
+      _mm_storeu_si128((__m128i*)(dst + i + 8), _mm256_cvtps_ph(b, _MM_FROUND_TO_NEAREST_INT));
+   }
+   for (; i + 8 <= n; i += 8)
+   {
+      __m256 a = _mm256_loadu_ps(src + i);
+      _mm_storeu_si128((__m128i*)(dst + i), _mm256_cvtps_ph(a, _MM_FROUND_TO_NEAREST_INT));
+   }
+   FloatToHalfScalar(src + i, dst + i, n - i);
+}
+
+void FloatToHalf(const float* src, uint16_t* dst, size_t n)
+{
+   if (HasF16C())
+   {
+      float_to_half_f16c(src, dst, n);
+   }
+   else
+   {
+      FloatToHalfScalar(src, dst, n);
+   }
+}
+
+//Packing follows the EXT_texture_shared_exponent specification
+uint32_t FloatToRGB9E5(float r, float g, float b)
+{
+   const int N = 9;       //mantissa bits
+   const int B = 15;      //exponent bias
+   const int Emax = 31;   //max biased exponent
+   const float sharedexp_max = float((1 << N) - 1) / float(1 << N) * float(1 << (Emax - B));
+
+   //NaN and negative values clamp to 0
+   const float rc = (r > 0.0f) ? std::min(r, sharedexp_max) : 0.0f;
+   const float gc = (g > 0.0f) ? std::min(g, sharedexp_max) : 0.0f;
+   const float bc = (b > 0.0f) ? std::min(b, sharedexp_max) : 0.0f;
+   const float maxrgb = std::max(rc, std::max(gc, bc));
+   if (maxrgb == 0.0f) return 0;
+
+   int exp_shared = std::max(-B - 1, int(std::floor(std::log2(maxrgb)))) + 1 + B;
+   float denom = std::ldexp(1.0f, exp_shared - B - N);
+   const int maxm = int(std::floor(maxrgb / denom + 0.5f));
+   if (maxm == (1 << N))
+   {
+      denom *= 2.0f;
+      exp_shared++;
+   }
+
+   const uint32_t rm = uint32_t(std::floor(rc / denom + 0.5f));
+   const uint32_t gm = uint32_t(std::floor(gc / denom + 0.5f));
+   const uint32_t bm = uint32_t(std::floor(bc / denom + 0.5f));
+   return rm | (gm << 9) | (bm << 18) | (uint32_t(exp_shared) << 27);
+}
+
+void FloatToRGB9E5(const float* src, uint32_t* dst, size_t npixels, int src_channels)
+{
+   for (size_t i = 0; i < npixels; i++)
+   {
+      const float* p = src + i * src_channels;
+      dst[i] = FloatToRGB9E5(p[0], p[1], p[2]);
+   }
+}
+
+void BenchmarkHalfConversion(int width, int height)
+{
+   const size_t npixels = size_t(width) * height;
+   const size_t n = 4 * npixels;
+   std::vector<float> src(n);
+   for (size_t i = 0; i < n; i++)
+   {
+      src[i] = 100.0f * std::sin(0.001f * float(i)) * std::sin(0.001f * float(i)); //HDR range values
+   }
+   std::vector<uint16_t> half(n);
+   std::vector<uint32_t> rgb9e5(npixels);
+
+   typedef std::chrono::high_resolution_clock clock;
+   const int reps = 5;
+   auto time_ms = [&](auto&& fn)
+   {
+      double best = 1e30;
+      for (int r = 0; r < reps; r++)
+      {
+         auto t0 = clock::now();
+         fn();
+         auto t1 = clock::now();
+         best = std::min(best, std::chrono::duration<double, std::milli>(t1 - t0).count());
+      }
+      return best;
+   };
+
+   const double scalar_ms = time_ms([&]() { FloatToHalfScalar(src.data(), half.data(), n); });
+   const double simd_ms = time_ms([&]() { FloatToHalf(src.data(), half.data(), n); });
+   const double e5_ms = time_ms([&]() { FloatToRGB9E5(src.data(), rgb9e5.data(), npixels, 4); });
+
+   const double mpix = double(npixels) / 1.0e6;
+   const double mb = 1.0 / (1024.0 * 1024.0);
+   std::cout << "Half float conversion, " << width << "x" << height << " RGBA:" << std::endl;
+   std::cout << "   scalar:  " << scalar_ms << " ms (" << mpix / (scalar_ms * 1e-3) << " Mpixel/s)" << std::endl;
+   std::cout << "   " << (HasF16C() ? "F16C:    " : "scalar (no F16C): ") << simd_ms << " ms (" << mpix / (simd_ms * 1e-3) << " Mpixel/s)" << std::endl;
+   std::cout << "   RGB9E5:  " << e5_ms << " ms (" << mpix / (e5_ms * 1e-3) << " Mpixel/s)" << std::endl;
+   std::cout << "   GL_RGBA32F " << npixels * 16 * mb << " MB, GL_RGBA16F " << npixels * 8 * mb
+             << " MB, GL_RGB9_E5 " << npixels * 4 * mb << " MB" << std::endl;
+}
@@ -3,10 +3,71 @@
 
 #include <windows.h>
 #include <GL/GL.h>
+#include <functional>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
 
 GLuint InitShader( const char* computeShaderFile);
 GLuint InitShader( const char* vertexShaderFile, const char* fragmentShaderFile );
 GLuint InitShader( const char* vertexShaderFile, const char* geometryShader, const char* fragmentShaderFile );
 
+//Compile with extra #defines, each given as "NAME" or "NAME VALUE". They are inserted after the #version line
+//of every stage, and become part of the program binary cache key.
+GLuint InitShader( const char* vertexShaderFile, const char* fragmentShaderFile, const std::vector<std::string>& defines );
+
+//Compile-time permutations of one program. A shader can write e.g.
+//   #ifdef MODE
+//   const int mode = MODE;
+//   #else
+//   layout(location = 3) uniform int mode;
+//   #endif
+//and the compiler removes the branches on mode in each variant. Variants are built with InitShaderAsync and
+//arrive through PollShaders(). Get() queues a variant the first time its define set is requested and returns
+//-1 until it has linked (or if it failed to build), so the caller keeps drawing with a generic program meanwhile.
+//onReady, if given, is called with each variant that linked, e.g. to validate its uniform blocks.
+struct ShaderVariants
+{
+   std::string mVertexFile;
+   std::string mFragmentFile;
+   std::map<std::string, GLuint> mPrograms; //keyed by the generated #define lines
+   std::set<std::string> mPending;          //queued, not linked yet
+   int mGeneration;                         //bumped by Clear, so builds queued before it are dropped
+   std::function<void(GLuint)> mOnReady;
+
+   ShaderVariants(const std::string& vertexShaderFile, const std::string& fragmentShaderFile, std::function<void(GLuint)> onReady = nullptr);
+   GLuint Get(const std::vector<std::string>& defines);
+   void Queue(const std::vector<std::string>& defines); //start building a variant before it is needed
+   void Clear(); //delete all variants, e.g. after the shader files were edited
+   int NumVariants() const;
+   int NumPending() const;
+};
+
+//Separable programs (GL_PROGRAM_SEPARABLE) hold a single stage and are combined with program pipeline objects,
+//so any vertex stage can be paired with any fragment stage without relinking. Both functions cache their results,
+//and return -1 on failure. Bind with glUseProgram(0); glBindProgramPipeline(pipeline); and set uniforms with
+//glProgramUniform* on the stage program that declares them.
+GLuint InitStageProgram( GLenum type, const char* shaderFile, const std::vector<std::string>& defines = std::vector<std::string>() );
+GLuint InitPipeline( GLuint vertexProgram, GLuint fragmentProgram );
+void DeleteStagePrograms(); //e.g. after the shader files were edited, also drops stages still compiling
+
+//Like InitStageProgram, but queues the build with the asynchronous programs below and returns -1 until
+//PollShaders() has delivered it. Calling it again for a stage in flight doesn't queue it twice.
+//onReady of the call that queued the stage is called with the program if it linked.
+GLuint InitStageProgramAsync( GLenum type, const char* shaderFile, const std::vector<std::string>& defines = std::vector<std::string>(),
+                              std::function<void(GLuint)> onReady = nullptr );
+
+//Non-blocking versions. Compiling and linking are started right away, but their status is not queried
+//(which would make the driver finish synchronously). With GL_KHR_parallel_shader_compile the driver
+//compiles on its own threads. Call PollShaders() once per frame; onReady receives the program, or -1
+//on failure, once it has finished. WaitShaders() blocks until everything queued is done.
+void InitShaderAsync( const char* computeShaderFile, std::function<void(GLuint)> onReady );
+void InitShaderAsync( const char* vertexShaderFile, const char* fragmentShaderFile, std::function<void(GLuint)> onReady );
+void InitShaderAsync( const char* vertexShaderFile, const char* geometryShader, const char* fragmentShaderFile, std::function<void(GLuint)> onReady );
+void InitShaderAsync( const char* vertexShaderFile, const char* fragmentShaderFile, const std::vector<std::string>& defines, std::function<void(GLuint)> onReady );
+int PollShaders(); //returns the number of programs still compiling
+void WaitShaders();
+
 
 #endif
\ No newline at end of file
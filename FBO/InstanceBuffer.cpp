@@ -0,0 +1,159 @@
+#include "InstanceBuffer.h"
+
+#include <stdio.h>
+#include <stddef.h>
+#include <algorithm>
+#include <vector>
+
+namespace InstanceBuffer
+{
+   std::vector<Instance> instances;
+   GLuint buffer = -1;
+   GLuint binding = 0;
+
+   std::vector<bool> page_dirty;
+   std::vector<int> dirty_pages; //each dirty page once, in the order they were edited
+
+   int uploaded_bytes = 0;
+   int uploaded_ranges = 0;
+
+   //Clean pages between two dirty ones are uploaded with them when there are at most this many.
+   //Fewer, larger glNamedBufferSubData calls are cheaper than skipping a few KB.
+   const int MergeGap = 2;
+
+void Init(GLuint binding_, int count)
+{
+   binding = binding_;
+   instances.assign(count, Instance());
+   const int pages = (count + PageInstances - 1) / PageInstances;
+   page_dirty.assign(pages, false);
+   dirty_pages.clear();
+
+   const GLsizeiptr size = GLsizeiptr(count) * sizeof(Instance);
+   GLint64 max_size = 0;
+   glGetInteger64v(GL_MAX_SHADER_STORAGE_BLOCK_SIZE, &max_size);
+   if (size > max_size)
+   {
+      fprintf(stderr, "Instance buffer: %d instances need %lld bytes, GL_MAX_SHADER_STORAGE_BLOCK_SIZE is %lld\n",
+         count, (long long)size, (long long)max_size);
+   }
+
+   //Written only by Update, so it doesn't need to be mappable
+   glCreateBuffers(1, &buffer);
+   glNamedBufferStorage(buffer, std::max<GLsizeiptr>(size, sizeof(Instance)), instances.data(), GL_DYNAMIC_STORAGE_BIT);
+   glBindBufferBase(GL_SHADER_STORAGE_BUFFER, binding, buffer);
+}
+
+int Count() {return int(instances.size());}
+
+const Instance& Get(int i)
+{
+   return instances[i];
+}
+
+Instance& Edit(int i)
+{
+   const int page = i / PageInstances;
+   if (page_dirty[page] == false)
+   {
+      page_dirty[page] = true;
+      dirty_pages.push_back(page);
+   }
+   return instances[i];
+}
+
+static void upload(int first_page, int end_page)
+{
+   const int first = first_page * PageInstances;
+   const int end = std::min(end_page * PageInstances, int(instances.size()));
+   const GLsizeiptr size = GLsizeiptr(end - first) * sizeof(Instance);
+   glNamedBufferSubData(buffer, GLintptr(first) * sizeof(Instance), size, &instances[first]);
+   uploaded_bytes += int(size);
+   uploaded_ranges++;
+}
+
+void Update()
+{
+   uploaded_bytes = 0;
+   uploaded_ranges = 0;
+   if (dirty_pages.empty()) return;
+
+   //Only the dirty pages are visited, so dragging one instance among millions costs one page
+   std::sort(dirty_pages.begin(), dirty_pages.end());
+   int run_first = dirty_pages[0];
+   int run_end = run_first + 1;
+   for (size_t i = 1; i < dirty_pages.size(); i++)
+   {
+      const int page = dirty_pages[i];
+      if (page - run_end > MergeGap)
+      {
+         upload(run_first, run_end);
+         run_first = page;
+      }
+      run_end = page + 1;
+   }
+   upload(run_first, run_end);
+
+   for (int page : dirty_pages)
+   {
+      page_dirty[page] = false;
+   }
+   dirty_pages.clear();
+}
+
+int UploadedBytes() {return uploaded_bytes;}
+int UploadedRanges() {return uploaded_ranges;}
+
+static GLint resource_int(GLuint program, GLenum interface, GLuint index, GLenum property)
+{
+   GLint value = -1;
+   glGetProgramResourceiv(program, interface, index, 1, &property, 1, nullptr, &value);
+   return value;
+}
+
+bool Validate(GLuint program)
+{
+   const GLuint index = glGetProgramResourceIndex(program, GL_BUFFER_VARIABLE, "instances[0].model_matrix");
+   if (index == GL_INVALID_INDEX) return true; //not used by this program
+
+   bool valid = true;
+   const GLint block = resource_int(program, GL_BUFFER_VARIABLE, index, GL_BLOCK_INDEX);
+   const GLint block_binding = resource_int(program, GL_SHADER_STORAGE_BLOCK, GLuint(block), GL_BUFFER_BINDING);
+   if (GLuint(block_binding) != binding)
+   {
+      fprintf(stderr, "Instance buffer: binding %d in the shader, %d in C++\n", block_binding, binding);
+      valid = false;
+   }
+   const GLint stride = resource_int(program, GL_BUFFER_VARIABLE, index, GL_TOP_LEVEL_ARRAY_STRIDE);
+   if (stride != GLint(sizeof(Instance)))
+   {
+      fprintf(stderr, "Instance buffer: instances are %d bytes apart in the shader, %d in C++\n", stride, int(sizeof(Instance)));
+      valid = false;
+   }
+
+   struct Member
+   {
+      const char* name;
+      GLint offset;
+   };
+   const Member members[] = {
+      { "instances[0].model_matrix", GLint(offsetof(Instance, model_matrix)) },
+      { "instances[0].color", GLint(offsetof(Instance, color)) },
+      { "instances[0].material", GLint(offsetof(Instance, material)) },
+      { "instances[0].layer", GLint(offsetof(Instance, layer)) },
+   };
+   for (const Member& m : members)
+   {
+      //Members the shader never reads may be left out of the interface
+      const GLuint member = glGetProgramResourceIndex(program, GL_BUFFER_VARIABLE, m.name);
+      if (member == GL_INVALID_INDEX) continue;
+      const GLint offset = resource_int(program, GL_BUFFER_VARIABLE, member, GL_OFFSET);
+      if (offset != m.offset)
+      {
+         fprintf(stderr, "Instance buffer: %s at offset %d in the shader, %d in C++\n", m.name, offset, m.offset);
+         valid = false;
+      }
+   }
+   return valid;
+}
+};
@@ -54,6 +54,34 @@ MeshData LoadMesh(const std::string& pFile)
    return mesh;
 }
 
+void GetMeshTriangles(const MeshData& mesh, std::vector<float>& positions, std::vector<unsigned int>& indices)
+{
+   positions.clear();
+   indices.clear();
+   if (mesh.mScene == NULL) return;
+
+   for (unsigned int m = 0; m < mesh.mScene->mNumMeshes; m++)
+   {
+      const aiMesh* submesh = mesh.mScene->mMeshes[m];
+      const unsigned int base_vertex = (unsigned int)(positions.size() / 3);
+      for (unsigned int v = 0; v < submesh->mNumVertices; v++)
+      {
+         positions.push_back(submesh->mVertices[v].x);
+         positions.push_back(submesh->mVertices[v].y);
+         positions.push_back(submesh->mVertices[v].z);
+      }
+      for (unsigned int f = 0; f < submesh->mNumFaces; f++)
+      {
+         const aiFace& face = submesh->mFaces[f];
+         if (face.mNumIndices != 3) continue; //points and lines
+         for (int k = 0; k < 3; k++)
+         {
+            indices.push_back(base_vertex + face.mIndices[k]);
+         }
+      }
+   }
+}
+
 void GetBoundingBox(const aiMesh* mesh, aiVector3D* min, aiVector3D* max)
 {
    min->x = min->y = min->z = 1e10f;
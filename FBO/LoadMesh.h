@@ -41,6 +41,8 @@ struct MeshData
 
 
 MeshData LoadMesh(const std::string& pFile);
+//Positions (xyz) and triangle indices of every submesh, indexed like the mesh's vertex buffer
+void GetMeshTriangles(const MeshData& mesh, std::vector<float>& positions, std::vector<unsigned int>& indices);
 
 
 #endif
\ No newline at end of file
@@ -1,8 +1,13 @@
 
 
 #include <windows.h>
+#include "FrameCapture.h" //includes glew, which has to come before gl.h
+#include "Picking.h"
+#include "Bvh.h"
 #include "Callbacks.h"
 #include "Scene.h"
+#include "VideoRecorder.h"
+#include "YuvConvert.h"
 
 #include "imgui_impl_glfw.h"
 #include "imgui_impl_opengl3.h"
@@ -13,6 +18,31 @@ int main(int argc, char **argv)
 {
    GLFWwindow* window;
 
+   //Encode a raw capture and exit: --transcode capture.y4m capture.mp4 [crf] [preset]
+   if (argc >= 4 && strcmp(argv[1], "--transcode") == 0)
+   {
+      VideoRecorder::Options options;
+      options.preset = "medium"; //offline, so spend the time on quality
+      if (argc >= 5) options.crf = atoi(argv[4]);
+      if (argc >= 6) options.preset = argv[5];
+      return VideoRecorder::Transcode(argv[2], argv[3], options);
+   }
+
+   //Time CPU picking without a window: --pick-benchmark [triangles] [instances] [rays]
+   if (argc >= 2 && strcmp(argv[1], "--pick-benchmark") == 0)
+   {
+      const int triangles = (argc >= 3) ? atoi(argv[2]) : 1000000;
+      const int instances = (argc >= 4) ? atoi(argv[3]) : 6;
+      const int rays = (argc >= 5) ? atoi(argv[4]) : 100000;
+      return BvhBenchmark(triangles, instances, rays);
+   }
+
+   //Check the CPU color conversion against sws_scale without a window: --yuv-selftest
+   if (argc >= 2 && strcmp(argv[1], "--yuv-selftest") == 0)
+   {
+      return YuvSelfTest();
+   }
+
    /* Initialize the library */
    if (!glfwInit())
    {
@@ -55,6 +85,9 @@ int main(int argc, char **argv)
       /* Poll for and process events */
       glfwPollEvents();
    }
+   FrameCapture::Shutdown(); //finish writing screenshots while the context still exists
+   Picking::Shutdown();
+   Scene::Shutdown();
 
     // Cleanup ImGui
     ImGui_ImplOpenGL3_Shutdown();
@@ -0,0 +1,219 @@
+#include "Picking.h"
+
+#include <algorithm>
+#include <deque>
+
+namespace Picking
+{
+   struct Readback
+   {
+      Region region;
+      std::function<void(GLuint id)> picked;              //single pixel requests
+      std::function<void(const Region& region)> picked_region;
+      GLuint pbo;
+      GLsync fence;
+      int frame;    //Update call that started the readback
+   };
+
+   struct PackBuffer
+   {
+      GLuint pbo;
+      int size;
+      bool in_use;
+   };
+
+   std::vector<Readback> requested;  //since the last Update
+   std::deque<Readback> reading;     //in flight, oldest first
+   std::vector<PackBuffer> buffers;
+   int frame = 0;
+   int latency_frames = 0;
+
+void Request(int x, int y, std::function<void(GLuint id)> picked)
+{
+   Readback r = {};
+   r.region = { x, y, 1, 1 };
+   r.picked = picked;
+   requested.push_back(r);
+}
+
+void RequestRegion(int x, int y, int width, int height, std::function<void(const Region& region)> picked)
+{
+   Readback r = {};
+   r.region = { x, y, width, height };
+   r.picked_region = picked;
+   requested.push_back(r);
+}
+
+int Pending() {return int(requested.size() + reading.size());}
+int LatencyFrames() {return latency_frames;}
+
+static void finish(const Readback& r)
+{
+   if (r.picked)
+   {
+      r.picked(r.region.ids.empty() ? 0 : r.region.ids[0]);
+   }
+   else if (r.picked_region)
+   {
+      r.picked_region(r.region);
+   }
+}
+
+//A free buffer with room for size bytes. Regions are rarely more than a few hundred pixels on a
+//side, so a free buffer that is too small is simply respecified.
+static GLuint acquire_buffer(int size)
+{
+   PackBuffer* b = nullptr;
+   for (PackBuffer& free : buffers)
+   {
+      if (free.in_use == false && (b == nullptr || free.size >= size)) b = &free;
+   }
+   if (b == nullptr)
+   {
+      buffers.push_back({ 0, 0, false });
+      b = &buffers.back();
+      glCreateBuffers(1, &b->pbo);
+   }
+   if (b->size < size)
+   {
+      glNamedBufferData(b->pbo, size, nullptr, GL_STREAM_READ);
+      b->size = size;
+   }
+   b->in_use = true;
+   return b->pbo;
+}
+
+static void release_buffer(GLuint pbo)
+{
+   for (PackBuffer& b : buffers)
+   {
+      if (b.pbo == pbo) b.in_use = false;
+   }
+}
+
+//Resolve readbacks whose fences have signaled, in the order they were issued. With wait every
+//readback is waited for.
+static void resolve(bool wait)
+{
+   while (reading.empty() == false)
+   {
+      const GLenum status = glClientWaitSync(reading.front().fence, wait ? GL_SYNC_FLUSH_COMMANDS_BIT : 0, wait ? 1000000000 : 0);
+      if (status == GL_TIMEOUT_EXPIRED) break;
+
+      Readback r = reading.front();
+      reading.pop_front();
+      glDeleteSync(r.fence);
+      if (status != GL_WAIT_FAILED)
+      {
+         //Doesn't stall: the data is already in the buffer
+         r.region.ids.resize(size_t(r.region.width) * r.region.height);
+         glGetNamedBufferSubData(r.pbo, 0, r.region.ids.size() * sizeof(GLuint), r.region.ids.data());
+      }
+      release_buffer(r.pbo);
+      latency_frames = frame - r.frame;
+      finish(r);
+   }
+}
+
+void Update(GLuint framebuffer, GLenum attachment, int width, int height)
+{
+   frame++;
+   resolve(false);
+   if (requested.empty()) return;
+
+   std::vector<Readback> start;
+   start.swap(requested); //callbacks may request again
+
+   GLint read_framebuffer = 0;
+   glGetIntegerv(GL_READ_FRAMEBUFFER_BINDING, &read_framebuffer);
+   glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer);
+   glNamedFramebufferReadBuffer(framebuffer, attachment);
+   glPixelStorei(GL_PACK_ALIGNMENT, 4);
+
+   std::vector<Readback> outside;
+   for (Readback& r : start)
+   {
+      Region& region = r.region;
+      const int x0 = std::max(region.x, 0), y0 = std::max(region.y, 0);
+      const int x1 = std::min(region.x + region.width, width), y1 = std::min(region.y + region.height, height);
+      region = { x0, y0, std::max(x1 - x0, 0), std::max(y1 - y0, 0) };
+      if (region.width == 0 || region.height == 0)
+      {
+         outside.push_back(r);
+         continue;
+      }
+
+      const int size = region.width * region.height * int(sizeof(GLuint));
+      r.pbo = acquire_buffer(size);
+      glBindBuffer(GL_PIXEL_PACK_BUFFER, r.pbo);
+      glReadPixels(region.x, region.y, region.width, region.height, GL_RED_INTEGER, GL_UNSIGNED_INT, 0);
+      r.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+      r.frame = frame;
+      reading.push_back(r);
+   }
+   glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+   glBindFramebuffer(GL_READ_FRAMEBUFFER, read_framebuffer);
+
+   for (const Readback& r : outside)
+   {
+      finish(r);
+   }
+}
+
+void Shutdown()
+{
+   resolve(true);
+   requested.clear();
+   for (const PackBuffer& b : buffers)
+   {
+      glDeleteBuffers(1, &b.pbo);
+   }
+   buffers.clear();
+}
+
+std::vector<GLuint> UniqueIds(const Region& region)
+{
+   std::vector<GLuint> ids = region.ids;
+   std::sort(ids.begin(), ids.end());
+   ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+   if (ids.empty() == false && ids[0] == 0) ids.erase(ids.begin());
+   return ids;
+}
+
+//Even-odd rule at the pixel center
+static bool inside(const std::vector<glm::vec2>& polygon, glm::vec2 p)
+{
+   bool in = false;
+   for (size_t i = 0, j = polygon.size() - 1; i < polygon.size(); j = i++)
+   {
+      const glm::vec2& a = polygon[i];
+      const glm::vec2& b = polygon[j];
+      if ((a.y > p.y) != (b.y > p.y) && p.x < a.x + (p.y - a.y) * (b.x - a.x) / (b.y - a.y))
+      {
+         in = !in;
+      }
+   }
+   return in;
+}
+
+std::vector<GLuint> IdsInPolygon(const Region& region, const std::vector<glm::vec2>& polygon)
+{
+   std::vector<GLuint> ids;
+   if (polygon.size() < 3 || region.ids.empty()) return ids;
+
+   for (int y = 0; y < region.height; y++)
+   {
+      for (int x = 0; x < region.width; x++)
+      {
+         const GLuint id = region.ids[size_t(y) * region.width + x];
+         if (id != 0 && inside(polygon, glm::vec2(region.x + x + 0.5f, region.y + y + 0.5f)))
+         {
+            ids.push_back(id);
+         }
+      }
+   }
+   std::sort(ids.begin(), ids.end());
+   ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+   return ids;
+}
+};
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+#include <functional>
+#include <vector>
+
+//Object picking from an integer id attachment (GL_R32UI, 0 = background) without stalling the pipeline.
+//Requests made between frames are read into a small pixel pack buffer right after the ids are drawn,
+//followed by a fence. Update() resolves readbacks whose fence has signaled, usually one or two frames
+//later, and calls their callbacks on the render thread.
+namespace Picking
+{
+   //Ids of a rectangle of the attachment, rows bottom to top as GL reads them
+   struct Region
+   {
+      int x, y, width, height;
+      std::vector<GLuint> ids;  //width*height, empty if the rectangle was outside the attachment
+   };
+
+   //Window coordinates with y up, like glReadPixels
+   void Request(int x, int y, std::function<void(GLuint id)> picked);
+   void RequestRegion(int x, int y, int width, int height, std::function<void(const Region& region)> picked);
+
+   //Call once per frame after the ids have been drawn into attachment of framebuffer (width x height).
+   //Starts the readbacks requested since the last call and resolves the finished ones. Never waits.
+   void Update(GLuint framebuffer, GLenum attachment, int width, int height);
+   //Resolve every readback, waiting for the GPU. Call before the GL context is destroyed.
+   void Shutdown();
+
+   std::vector<GLuint> UniqueIds(const Region& region);  //sorted, without 0
+   //Ids under a lasso. polygon is in the same window coordinates as the region.
+   std::vector<GLuint> IdsInPolygon(const Region& region, const std::vector<glm::vec2>& polygon);
+
+   int Pending();        //requests not yet resolved
+   int LatencyFrames();  //Update calls between the last resolved request and its readback
+};
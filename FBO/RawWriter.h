@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <chrono>
+
+//Sequential writer for uncompressed capture files. Data is gathered into large sector aligned chunks that
+//are written with overlapped, unbuffered I/O (FILE_FLAG_NO_BUFFERING), so it bypasses the file cache and
+//the caller fills the next chunk while earlier ones are on their way to the disk. The file is
+//preallocated ahead of the data in large steps and cut to the bytes written by Close.
+//Extending the valid data length with the preallocation keeps writes past it asynchronous, but the reserved
+//space then isn't zeroed: until Close cuts it off it holds whatever the disk held before, which readers of
+//the file (it is shared for reading) can see, and a crash leaves it in the file. So it is opt-in.
+//Write and Close belong to one thread. The statistics can be read from any thread.
+class RawWriter
+{
+public:
+   RawWriter();
+   ~RawWriter(); //closes the file
+
+   //preallocate is the space reserved ahead of the data and the step the file grows by. valid_data also
+   //moves the valid data length over it, if SeManageVolumePrivilege can be enabled (see above).
+   bool Open(const char* filename, int64_t preallocate = int64_t(1) << 30, bool valid_data = false);
+   //Copies data into the current chunk and starts the write of every chunk that fills. Only waits when
+   //all chunks are still being written, i.e. when the disk is slower than the data arrives. Returns
+   //false once a write has failed.
+   bool Write(const void* data, size_t size);
+   //Writes the rest, waits for every write and sets the file size. Returns false if a write failed.
+   bool Close();
+   bool IsOpen() const { return mFile != nullptr; }
+
+   int64_t BytesWritten() const { return mBytes; }  //passed to Write
+   float WaitMs() const { return mWaitMs; }         //Write waiting for the disk since Open
+   float MBPerSec() const;                          //sustained: bytes on disk / time since Open
+   bool Unbuffered() const { return mUnbuffered; }  //false if the volume refused FILE_FLAG_NO_BUFFERING
+   bool AsyncExtend() const { return mValidData; }  //writes past the valid data length stay asynchronous
+
+private:
+   struct Chunk;
+   static const int NumChunks = 4;
+   static const size_t ChunkSize = 8 << 20;
+   static const size_t Alignment = 4096; //a multiple of every sector size in use
+
+   bool submit(size_t size);
+   bool complete(Chunk& chunk);
+   bool reserve(int64_t size);
+
+   void* mFile;                 //HANDLE
+   Chunk* mChunks;
+   int mCurrent;                //chunk being filled
+   size_t mFill;                //bytes in it
+   int64_t mOffset;             //file offset of the next write
+   int64_t mReserved;           //end of file set ahead of the data
+   int64_t mPreallocate;
+   bool mUnbuffered;
+   bool mValidData;
+   bool mFailed;
+   std::chrono::steady_clock::time_point mStart;
+   std::atomic<int64_t> mBytes;
+   std::atomic<int64_t> mCompleted; //bytes of finished writes
+   std::atomic<float> mWaitMs;
+   std::atomic<float> mSeconds;     //open time once closed
+};
@@ -17,13 +17,24 @@
 #include <fstream>
 #include <sstream>
 #include <string>
+#include <chrono>
+#include <vector>
 
 #include "Scene.h"
 #include "Uniforms.h"
+#include "UniformRing.h"   //Per-frame uniform data
+#include "UniformBlocks.h" //Light and material uniform blocks
+#include "InstanceBuffer.h" //Per-instance transforms and texture layers
 #include "InitShader.h"    //Functions for loading shaders from text files
+#include "ShaderWatcher.h"  //Rebuilds shaders when their files change
 #include "LoadMesh.h"      //Functions for creating OpenGL buffers from mesh files
 #include "LoadTexture.h"   //Functions for creating OpenGL textures from image files
+#include "TextureArray.h"  //Functions for packing textures into array textures
 #include "VideoRecorder.h"      //Functions for saving videos
+#include "FrameCapture.h"       //Asynchronous screenshots and frame dumps
+#include "Picking.h"            //Asynchronous reads of the pick attachment
+#include "Bvh.h"                //Ray-cast picking on the CPU
+#include "YuvConvert.h"         //CPU color conversion for recorded frames
 #include "DebugCallback.h"
 #include "AttriblessRendering.h"
 
@@ -31,26 +42,117 @@ static const std::string vertex_shader("fbo_demo_vs.glsl");
 static const std::string fragment_shader("fbo_demo_fs.glsl");
 GLuint shader_program = -1;
 
+//Each pass is a pipeline of separable stage programs with pass and mode compiled in.
+//shader_program links both passes together and branches on the uniforms instead.
+bool use_pipelines = true;
+GLuint postprocess_query[2] = { 0, 0 }; //GPU time of render pass 1, read back one frame late
+bool postprocess_query_issued[2] = { false, false };
+int query_index = 0;
+float postprocess_ms = 0.0f;
+float time_sec = 0.0f;
+
 static const std::string mesh_name = "Amago0.obj";
 static const std::string texture_name = "AmagoT.bmp";
 
-GLuint texture_id = -1; //Texture map for mesh
+//Texture used by each instance. Images of the same size are packed into one array texture, so the
+//instances draw in one call per array: here the two 256x256 images share an array, the 128x128 one gets its own.
+static const std::vector<std::string> instance_texture_names = { texture_name, "AmagoT_tint.bmp", texture_name,
+   "AmagoT_tint.bmp", "AmagoT_small.bmp", "AmagoT_small.bmp" };
+std::vector<TextureArrayData> texture_arrays;
+std::vector<TextureLayer> instance_layers;
+
+//Consecutive instances that sample the same array texture, drawn with one instanced call
+struct InstanceDraw
+{
+   int array; //-1 if the instances' images failed to load
+   int first;
+   int count;
+};
+std::vector<InstanceDraw> instance_draws;
 MeshData mesh_data;
 
 GLuint fbo = -1;
 GLuint fbo_tex = -1;
 GLuint rbo = -1;
 GLuint pick_tex = -1;
-GLuint model_matrix_buffer;
 int shader_mode = 0;
 GLenum drawBuffers[2] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
 int pickedID = 0;
-glm::mat4 modmatric_data[6] = {};
-glm::mat4 lastmodmatric_data[6] = {};
+const int num_instances = 6;
+glm::mat4 lastmodmatric_data[num_instances] = {}; //transforms when the drag started
+
+//CPU picking: rays are cast in normalized device coordinates against the mesh's triangles
+bool cpu_picking = false;
+MeshBvh mesh_bvh;
+SceneBvh instance_bvh;
+float cpu_pick_us = 0.0f;
+
+//Point under the cursor when the last pick hit an instance
+struct PickPoint
+{
+   bool valid = false;
+   int instance = -1;
+   int triangle = -1;
+   glm::vec3 world;   //before the instance matrix
+   float depth = 0.0f; //normalized device coordinates
+   float w = 1.0f;     //clip space. Dragging scales the cursor offset by it so this point stays under the cursor.
+};
+PickPoint pick_point;
 
 float angle = glm::pi<float>()*0.5;
 float scale = 0.6f;
 bool recording = false;
+bool offline_capture = false;  //fixed timestep and no vsync while recording
+double capture_start_sec = 0.0;
+
+//Rotation and scale of the mesh, shared by every instance
+static glm::mat4 model_matrix()
+{
+   return glm::rotate(angle, glm::vec3(1.0f, 0.0f, 0.0f)) * glm::scale(glm::vec3(scale * mesh_data.mScaleFactor));
+}
+
+//Object space to clip space for instance i, as fbo_demo_vs.glsl transforms it. The instance matrix is
+//applied after the projection. The shader's wave animation is left out.
+static glm::mat4 instance_to_clip(int i)
+{
+   const glm::vec3 offset = glm::vec3(i % 3 - 1, 0.0f, i / 3 - 1);
+   return InstanceBuffer::Get(i).model_matrix * Uniforms::SceneData.PV * model_matrix() * glm::translate(0.5f * offset);
+}
+
+//Reports C++ structs that don't match the uniform and storage blocks the program declares
+static void ValidateProgram(GLuint program)
+{
+   if (program == -1) return;
+   UniformBlocks::Validate(program);
+   InstanceBuffer::Validate(program);
+}
+
+//Instance id (1-based, 0 for none) under window position x, y (y up) from the CPU BVH. Uses the camera
+//of the last frame drawn, which is what is on screen. Sets pick_point.
+static int castPickRay(int x, int y)
+{
+   const auto start = std::chrono::high_resolution_clock::now();
+   for (int i = 0; i < num_instances; i++)
+   {
+       instance_bvh.SetInstance(i, &mesh_bvh, instance_to_clip(i)); //refits only if a matrix changed
+   }
+   const glm::vec2 ndc = 2.0f * glm::vec2(x + 0.5f, y + 0.5f) / glm::vec2(Scene::WindowWidth, Scene::WindowHeight) - 1.0f;
+   RayHit hit;
+   int id = 0;
+   pick_point = PickPoint();
+   if (instance_bvh.Intersect(glm::vec3(ndc, -1.0f), glm::vec3(ndc, 1.0f), hit)) {
+       id = hit.instance + 1;
+       const glm::vec3 offset = glm::vec3(hit.instance % 3 - 1, 0.0f, hit.instance / 3 - 1);
+       pick_point.valid = true;
+       pick_point.instance = hit.instance;
+       pick_point.triangle = hit.triangle;
+       pick_point.world = glm::vec3(model_matrix() * glm::vec4(hit.position + 0.5f * offset, 1.0f));
+       pick_point.depth = 2.0f * hit.t - 1.0f;
+       pick_point.w = (instance_to_clip(hit.instance) * glm::vec4(hit.position, 1.0f)).w;
+   }
+   cpu_pick_us = std::chrono::duration<float, std::micro>(std::chrono::high_resolution_clock::now() - start).count();
+   return id;
+}
 
 namespace Scene
 {
@@ -73,6 +175,7 @@ namespace Scene
    void UpdateFbo() {
 
        glDeleteTextures(1, &fbo_tex);
+       glDeleteTextures(1, &pick_tex);
        glDeleteRenderbuffers(1, &rbo);
 
        glGenTextures(1, &fbo_tex);
@@ -86,15 +189,14 @@ namespace Scene
 
        glGenTextures(1, &pick_tex);
        glBindTexture(GL_TEXTURE_2D, pick_tex);
-       glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, Scene::WindowWidth, Scene::WindowHeight, 0, GL_RED, GL_FLOAT, NULL);
+       glTexImage2D(GL_TEXTURE_2D, 0, GL_R32UI, Scene::WindowWidth, Scene::WindowHeight, 0, GL_RED_INTEGER, GL_UNSIGNED_INT, NULL);
        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
-       glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-       glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+       glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST); //ids can't be filtered
+       glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
        glBindTexture(GL_TEXTURE_2D, 0);
 
        //Create renderbuffer for depth.
-       GLuint rbo = -1;
        glGenRenderbuffers(1, &rbo);
        glBindRenderbuffer(GL_RENDERBUFFER, rbo);
        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT, Scene::WindowWidth, Scene::WindowHeight);
@@ -112,36 +214,62 @@ namespace Scene
        glBindFramebuffer(GL_FRAMEBUFFER, 0);
    }
 
-   int readPickID(int x, int y) {
-       glBindFramebuffer(GL_FRAMEBUFFER, fbo);
-       glReadBuffer(GL_COLOR_ATTACHMENT1); // Read from pick buffer
-
-       float pickedFloatID;
-       glReadPixels(x, y, 1, 1, GL_RED, GL_FLOAT, &pickedFloatID);
+   void requestPickID(int x, int y, std::function<void(int id)> picked) {
+       if (cpu_picking == true) {
+           pickedID = castPickRay(x, y);
+           picked(pickedID);
+           return;
+       }
+       // Read from pick buffer after the next frame's pass 0, without waiting for the GPU
+       Picking::Request(x, y, [x, y, picked](GLuint id) {
+           pickedID = int(id);
+           // The id buffer has no depth. A ray gives the point to drag by, unless the wave moved another instance under the cursor.
+           if (pickedID > 0 && castPickRay(x, y) != pickedID) {
+               pick_point = PickPoint();
+           }
+           picked(pickedID);
+       });
+   }
 
-       glBindFramebuffer(GL_FRAMEBUFFER, 0); // Unbind FBO
+   static void printSelection(const std::vector<GLuint>& ids) {
+       std::cout << "Objects selected:";
+       for (GLuint id : ids) {
+           std::cout << " " << id;
+       }
+       std::cout << (ids.empty() ? " none" : "") << std::endl;
+   }
 
-       pickedID = int(pickedFloatID + 0.5f);
+   void selectRectangle(int x0, int y0, int x1, int y1) {
+       Picking::RequestRegion(glm::min(x0, x1), glm::min(y0, y1), glm::abs(x1 - x0) + 1, glm::abs(y1 - y0) + 1,
+           [](const Picking::Region& region) {printSelection(Picking::UniqueIds(region));});
+   }
 
-       glBindFramebuffer(GL_FRAMEBUFFER, 0); // Unbind FBO
-       return pickedID;
+   void selectLasso(const std::vector<glm::vec2>& lasso) {
+       if (lasso.size() < 3) return;
+       glm::vec2 lower = lasso[0], upper = lasso[0];
+       for (const glm::vec2& p : lasso) {
+           lower = glm::min(lower, p);
+           upper = glm::max(upper, p);
+       }
+       // Read the bounding rectangle, then keep the pixels inside the lasso
+       const glm::ivec2 first = glm::ivec2(glm::floor(lower));
+       const glm::ivec2 last = glm::ivec2(glm::ceil(upper));
+       Picking::RequestRegion(first.x, first.y, last.x - first.x + 1, last.y - first.y + 1,
+           [lasso](const Picking::Region& region) {printSelection(Picking::IdsInPolygon(region, lasso));});
    }
 
    void moveInstance(float x, float y) {
-       // Update instance transform to move parallel to the image plane
-       modmatric_data[pickedID - 1] = glm::translate(glm::vec3(x, y, 0.0f)) * lastmodmatric_data[pickedID - 1];
-       
-       // Upload new instance transforms
-       glBindVertexArray(mesh_data.mVao);
-       glBindBuffer(GL_ARRAY_BUFFER, model_matrix_buffer);
-       glBufferSubData(GL_ARRAY_BUFFER, (pickedID-1) * sizeof(glm::mat4), sizeof(glm::mat4), &modmatric_data[pickedID - 1]);
-       glBindBuffer(GL_ARRAY_BUFFER, 0);
-       glBindVertexArray(0);
+       // Update instance transform to move parallel to the image plane. Uploaded by InstanceBuffer::Update.
+       // The instance matrix is applied in clip space, so scaling the cursor offset by w moves the picked point
+       // on the plane through it parallel to the image plane, and keeps it under the cursor.
+       const float w = pick_point.valid ? pick_point.w : 1.0f;
+       InstanceBuffer::Edit(pickedID - 1).model_matrix = glm::translate(glm::vec3(w * x, w * y, 0.0f)) * lastmodmatric_data[pickedID - 1];
+       instance_bvh.SetInstance(pickedID - 1, &mesh_bvh, instance_to_clip(pickedID - 1)); // refits at the next CPU pick
    }
 
    void resetPickID() {
        if (pickedID > 0) {
-           lastmodmatric_data[pickedID - 1] = modmatric_data[pickedID - 1];
+           lastmodmatric_data[pickedID - 1] = InstanceBuffer::Get(pickedID - 1).model_matrix;
        }
        pickedID = 0;
    }
@@ -159,23 +287,56 @@ void Scene::Display(GLFWwindow* window)
 {
    Camera::V = glm::lookAt(glm::vec3(Uniforms::SceneData.eye_w), glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
    Uniforms::SceneData.PV = Camera::P * Camera::V;
+   UniformRing::BeginFrame();
    Uniforms::BufferSceneData();
+   UniformBlocks::Update(); //light and material, when the GUI has changed them
+   InstanceBuffer::Update(); //instances moved since the last frame
+
+   //The fullscreen quad vertex stage is shared by every post-process fragment stage.
+   //Stages compile in the background, InitStageProgramAsync returns -1 until they have linked.
+   GLuint scene_vs = -1, scene_fs = -1, quad_vs = -1, post_fs = -1;
+   GLuint scene_pipeline = -1, post_pipeline = -1;
+   if (use_pipelines == true)
+   {
+      scene_vs = InitStageProgramAsync(GL_VERTEX_SHADER, vertex_shader.c_str(), { "PASS 0" }, ValidateProgram);
+      scene_fs = InitStageProgramAsync(GL_FRAGMENT_SHADER, fragment_shader.c_str(), { "PASS 0" }, ValidateProgram);
+      quad_vs = InitStageProgramAsync(GL_VERTEX_SHADER, vertex_shader.c_str(), { "PASS 1" }, ValidateProgram);
+      post_fs = InitStageProgramAsync(GL_FRAGMENT_SHADER, fragment_shader.c_str(), { "PASS 1", "MODE " + std::to_string(shader_mode) }, ValidateProgram);
+      scene_pipeline = InitPipeline(scene_vs, scene_fs);
+      post_pipeline = InitPipeline(quad_vs, post_fs);
+   }
+   const bool specialized = (scene_pipeline != -1 && post_pipeline != -1);
+   if (specialized == false)
+   {
+      //Every stage is the monolithic program, also while the stages are still compiling
+      scene_vs = scene_fs = quad_vs = post_fs = shader_program;
+   }
 
-   glUseProgram(shader_program);
+   if (specialized == true)
+   {
+      glUseProgram(0); //a current program overrides the bound pipeline
+      glBindProgramPipeline(scene_pipeline);
+   }
+   else
+   {
+      glUseProgram(shader_program);
+   }
    //Set uniforms
-   glm::mat4 M = glm::rotate(angle, glm::vec3(1.0f, 0.0f, 0.0f)) * glm::scale(glm::vec3(scale * mesh_data.mScaleFactor));
-   glUniformMatrix4fv(Uniforms::UniformLocs::M, 1, false, glm::value_ptr(M));
+   glm::mat4 M = model_matrix();
+   glProgramUniformMatrix4fv(scene_vs, Uniforms::UniformLocs::M, 1, false, glm::value_ptr(M));
 
    ////////////////////////////////////////////////////////////////////////////
    //Render pass 0
    ////////////////////////////////////////////////////////////////////////////
  
-   //Note that we don't need to set the value of a uniform here. The value is set with the "binding" in the layout qualifier
-   glBindTextureUnit(0, texture_id);
-
    //Pass 0: scene will be rendered into fbo attachment
-   glUniform1i(Uniforms::UniformLocs::pass, 0);
-   glUniform1i(Uniforms::UniformLocs::pickedID, pickedID);
+   if (specialized == false)
+   {
+      glUniform1i(Uniforms::UniformLocs::pass, 0);
+   }
+   glProgramUniform1f(scene_vs, Uniforms::UniformLocs::time, time_sec);
+   glProgramUniform1i(scene_vs, Uniforms::UniformLocs::pickedID, pickedID);
+   glProgramUniform1i(scene_fs, Uniforms::UniformLocs::pickedID, pickedID);
    glBindFramebuffer(GL_FRAMEBUFFER, fbo); // Render to FBO.
    
    //Make the viewport match the FBO texture size.
@@ -184,21 +345,45 @@ void Scene::Display(GLFWwindow* window)
    //Clear the FBO attached texture.
    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-   float clearValue = 0.0f;
-   glClearBufferfv(GL_COLOR, 1, &clearValue);
+   GLuint clearValue = 0; //background id
+   glClearBufferuiv(GL_COLOR, 1, &clearValue);
    //glClearBufferfv(GL_COLOR, 1, clear);
 
    glDrawBuffers(2, drawBuffers);
    //Draw mesh
    glBindVertexArray(mesh_data.mVao);
-   glDrawElementsInstanced(GL_TRIANGLES, mesh_data.mSubmesh[0].mNumIndices, GL_UNSIGNED_INT, 0, 6);
+   //Note that we don't need to set the value of a uniform here. The value is set with the "binding" in the layout qualifier
+   //One draw per array texture. Each instance selects its layer, the base instance is where the draw starts in the instance buffer.
+   //Drivers without gl_BaseInstanceARB get it from the base_instance uniform, which is inactive otherwise.
+   const bool base_instance_uniform = glGetUniformLocation(scene_vs, "base_instance") != -1;
+   for (const InstanceDraw& draw : instance_draws)
+   {
+      glBindTextureUnit(2, draw.array >= 0 ? texture_arrays[draw.array].mTexId : 0);
+      if (base_instance_uniform == true)
+      {
+         glProgramUniform1i(scene_vs, Uniforms::UniformLocs::base_instance, draw.first);
+      }
+      glDrawElementsInstancedBaseInstance(GL_TRIANGLES, mesh_data.mSubmesh[0].mNumIndices, GL_UNSIGNED_INT, 0, draw.count, draw.first);
+   }
+
+   //Start reading the ids under the picks requested since the last frame, resolve earlier picks
+   Picking::Update(fbo, GL_COLOR_ATTACHMENT1, Scene::WindowWidth, Scene::WindowHeight);
 
 
    ////////////////////////////////////////////////////////////////////////////
    //Render pass 1
    ////////////////////////////////////////////////////////////////////////////
 
-   glUniform1i(Uniforms::UniformLocs::pass, 1);
+   if (specialized == true)
+   {
+      glBindProgramPipeline(post_pipeline);
+   }
+   else
+   {
+      glUniform1i(Uniforms::UniformLocs::pass, 1);
+      glUniform1i(Uniforms::UniformLocs::mode, shader_mode);
+   }
+   glProgramUniform1f(post_fs, Uniforms::UniformLocs::time, time_sec);
 
    //Don't draw this pass into the FBO. Draw to the back buffer
    glBindFramebuffer(GL_FRAMEBUFFER, 0);
@@ -211,21 +396,38 @@ void Scene::Display(GLFWwindow* window)
   
    glBindTextureUnit(1, fbo_tex);
 
+   glBeginQuery(GL_TIME_ELAPSED, postprocess_query[query_index]);
    bind_attribless_vao();
    draw_attribless_quad();
+   glEndQuery(GL_TIME_ELAPSED);
+   postprocess_query_issued[query_index] = true;
+
+   //Read last frame's query so we don't wait for the GPU
+   query_index = 1 - query_index;
+   if (postprocess_query_issued[query_index] == true)
+   {
+      GLuint64 elapsed_ns = 0;
+      glGetQueryObjectui64v(postprocess_query[query_index], GL_QUERY_RESULT, &elapsed_ns);
+      postprocess_ms = 0.95f * postprocess_ms + 0.05f * float(elapsed_ns) * 1.0e-6f; //smoothed for display
+   }
 
 
    DrawGui(window);
 
+   //Screenshots and frame dumps of the finished frame
+   glReadBuffer(GL_BACK);
+   FrameCapture::Update();
+
    if (recording == true)
    {
-      glFinish();
       glReadBuffer(GL_BACK);
       int w, h;
       glfwGetFramebufferSize(window, &w, &h);
       VideoRecorder::EncodeBuffer(GL_BACK);
    }
 
+   UniformRing::EndFrame();
+
    /* Swap front and back buffers */
    glfwSwapBuffers(window);
 }
@@ -247,6 +449,16 @@ void Scene::DrawGui(GLFWwindow* window)
    const int filename_len = 256;
    static char video_filename[filename_len] = "capture.mp4";
    static bool show_imgui_demo = false;
+   static int video_codec = VideoRecorder::Options::H264;
+   static int video_crf = 23;
+   static bool low_latency = false;
+   static int stream_container = 0; //0 writes a file, 3 a raw .y4m file
+   static bool probing = false;
+   static int backpressure = VideoRecorder::Options::BLOCK;
+   static int preview_level = 0;
+   static bool instant_replay = false;
+   static float replay_seconds = 30.0f;
+   static int replays_saved = 0;
 
    if (recording == false)
    {
@@ -255,9 +467,41 @@ void Scene::DrawGui(GLFWwindow* window)
          int w, h;
          glfwGetFramebufferSize(window, &w, &h);
          recording = true;
-         const int fps = 60;
-         const int bitrate = 4000000;
-         VideoRecorder::Start(video_filename, w, h, fps, bitrate); //Uses ffmpeg
+         VideoRecorder::Options options = low_latency ? VideoRecorder::LowLatencyOptions() : VideoRecorder::Options();
+         std::string filename = video_filename;
+         if (stream_container == 1 || stream_container == 2)
+         {
+            options = VideoRecorder::StreamingOptions(stream_container == 1 ? "mpegts" : "h264");
+         }
+         else if (stream_container == 3)
+         {
+            options.raw = true;
+            filename = filename.substr(0, filename.find_last_of('.')) + ".y4m";
+         }
+         options.codec = VideoRecorder::Options::Codec(video_codec);
+         options.crf = video_crf;
+         //Offline capture needs every frame at full size, so it always waits for the encoder
+         options.backpressure = offline_capture ? VideoRecorder::Options::BLOCK : VideoRecorder::Options::Backpressure(backpressure);
+         if (instant_replay == true)
+         {
+            options.replay_seconds = replay_seconds;
+         }
+         std::vector<VideoRecorder::Preview> previews;
+         if (preview_level > 0)
+         {
+            //Encoded from the same readback as the recording
+            VideoRecorder::Preview preview;
+            preview.filename = std::string("preview_") + video_filename;
+            preview.level = preview_level;
+            preview.options.codec = options.codec;
+            previews.push_back(preview);
+         }
+         VideoRecorder::Start(filename.c_str(), w, h, options, previews); //Uses ffmpeg
+         if (offline_capture == true)
+         {
+            capture_start_sec = glfwGetTime();
+            glfwSwapInterval(0); //render as fast as the encoder accepts frames
+         }
       }
    }
    else
@@ -266,13 +510,111 @@ void Scene::DrawGui(GLFWwindow* window)
       {
          recording = false;
          VideoRecorder::Stop(); //Uses ffmpeg
+         VideoRecorder::StopLatencyProbe();
+         probing = false;
+         if (offline_capture == true)
+         {
+            glfwSetTime(capture_start_sec + VideoRecorder::FrameTime()); //carry on from the end of the video
+            glfwSwapInterval(1);
+         }
       }
    }
    ImGui::SameLine();
    ImGui::InputText("Video filename", video_filename, filename_len);
+   if (recording == false)
+   {
+      ImGui::Combo("Codec", &video_codec, "Container default\0libx264\0libx265\0mpeg4\0ffv1 (lossless, .mkv)\0");
+      ImGui::SliderInt("CRF", &video_crf, 0, 51);
+      ImGui::Checkbox("Low latency (ultrafast, zerolatency, slice threads)", &low_latency);
+      ImGui::Combo("Output", &stream_container, "File\0MPEG-TS stream (filename is a URL or pipe)\0Raw H.264 stream\0Uncompressed .y4m (encode later with --transcode)\0");
+      ImGui::BeginDisabled(offline_capture); //offline capture always blocks
+      ImGui::Combo("When the encoder falls behind", &backpressure, "Block the renderer\0Drop the newest frame\0Capture at half resolution\0");
+      ImGui::EndDisabled();
+      ImGui::SliderInt("Preview file size (0: none, 1: 1/2, 2: 1/4)", &preview_level, 0, 2);
+      ImGui::Checkbox("Instant replay (keep the last seconds in memory, F9 saves them)", &instant_replay);
+      if (instant_replay == true)
+      {
+         ImGui::SliderFloat("Replay seconds", &replay_seconds, 5.0f, 120.0f);
+      }
+      ImGui::Checkbox("Offline capture (fixed timestep, no vsync)", &offline_capture);
+      ImGui::Checkbox("Convert to YUV on the GPU", &VideoRecorder::ConvertOnGpu);
+      ImGui::SameLine();
+      if (ImGui::Button("Benchmark CPU conversion"))
+      {
+         BenchmarkYuvConversion(1920, 1080);
+         BenchmarkYuvConversion(3840, 2160);
+      }
+   }
+   else
+   {
+      ImGui::Text("Recording: %.1f frames/s, %.3f ms/frame on the render thread, %d frames queued, %d readback buffers",
+         VideoRecorder::CaptureFps(), VideoRecorder::RenderThreadMs(), VideoRecorder::QueuedFrames(), VideoRecorder::ReadbackBuffers());
+      for (int i = 0; i < VideoRecorder::Outputs(); i++)
+      {
+         const VideoRecorder::CaptureStats stats = VideoRecorder::Stats(i);
+         ImGui::Text("   %s wait %.2f ms, convert %.2f ms, encode %.2f ms, mux %.2f ms, %d dropped, %d at half resolution, %.1f ms capture to muxed",
+            i == 0 ? "recording:" : "preview:  ", stats.wait_ms, stats.convert_ms, stats.encode_ms, stats.mux_ms, stats.dropped, stats.half_res, stats.latency_ms);
+      }
+      if (stream_container == 3)
+      {
+         ImGui::Text("   raw: %.0f MB/s to disk", VideoRecorder::Stats().write_mb_s);
+      }
+      if (stream_container == 1 || stream_container == 2)
+      {
+         //The probe reads the stream itself, in place of a player
+         if (ImGui::Button(probing ? "Stop latency probe" : "Start latency probe"))
+         {
+            if (probing == false) VideoRecorder::StartLatencyProbe(video_filename);
+            else VideoRecorder::StopLatencyProbe();
+            probing = !probing;
+         }
+         if (probing == true)
+         {
+            ImGui::SameLine();
+            ImGui::Text("capture to client %.1f ms (%d frames)", VideoRecorder::ProbeLatencyMs(), VideoRecorder::ProbeFrames());
+         }
+      }
+      const VideoRecorder::CaptureStats stats = VideoRecorder::Stats();
+      if (stats.replay_bytes > 0)
+      {
+         //Encoding is the steady-state CPU cost of the replay, the ring is its memory cost
+         ImGui::Text("   replay: %.1f s in %.1f MB", stats.replay_sec, stats.replay_bytes / 1048576.0);
+         ImGui::SameLine();
+         if (ImGui::Button("Save replay (F9)") || ImGui::IsKeyPressed(ImGuiKey_F9, false))
+         {
+            const std::string replay_filename = "replay_" + std::to_string(replays_saved++) + "_" + video_filename;
+            VideoRecorder::SaveReplay(replay_filename.c_str());
+         }
+      }
+   }
+
+   static char screenshot_filename[filename_len] = "screenshot.png";
+   static int screenshot_format = FrameCapture::PNG;
+   static int screenshot_source = 0;
+   static int dump_frames = 300;
+   const GLuint screenshot_textures[] = { GLuint(-1), fbo_tex, pick_tex };
+   if (ImGui::Button("Save screenshot"))
+   {
+      FrameCapture::StartBurst(screenshot_filename, FrameCapture::Format(screenshot_format), 1, screenshot_textures[screenshot_source]);
+   }
+   ImGui::SameLine();
+   if (ImGui::Button("Dump frames"))
+   {
+      FrameCapture::StartBurst(screenshot_filename, FrameCapture::Format(screenshot_format), dump_frames, screenshot_textures[screenshot_source]);
+   }
+   ImGui::SameLine();
+   ImGui::InputText("Screenshot filename", screenshot_filename, filename_len);
+   ImGui::Combo("Screenshot format", &screenshot_format, "PNG\0EXR (float)\0Raw float RGBA\0");
+   ImGui::Combo("Screenshot source", &screenshot_source, "Back buffer\0fbo_tex\0pick_tex\0");
+   ImGui::SliderInt("Frames to dump", &dump_frames, 2, 1000);
+   if (FrameCapture::BurstActive() || FrameCapture::Pending() > 0 || FrameCapture::Skipped() > 0)
+   {
+      ImGui::Text("Screenshots: %d being written, %d skipped (no free readback buffer)", FrameCapture::Pending(), FrameCapture::Skipped());
+   }
 
    //Show fbo_tex for debugging purposes. This is highly recommended for multipass rendering.
-   ImGui::Image((ImTextureID)(intptr_t)pick_tex, ImVec2(128.0f, 128.0f), ImVec2(0.0, 1.0), ImVec2(1.0, 0.0));
+   //pick_tex is an integer texture, which ImGui can't sample. Save it as EXR to inspect the ids.
+   ImGui::Image((ImTextureID)(intptr_t)fbo_tex, ImVec2(128.0f, 128.0f), ImVec2(0.0, 1.0), ImVec2(1.0, 0.0));
 
    ImGui::SliderFloat("View angle", &angle, -glm::pi<float>(), +glm::pi<float>());
    ImGui::SliderFloat("Scale", &scale, 0.0f, +10.0f);
@@ -286,7 +628,29 @@ void Scene::DrawGui(GLFWwindow* window)
    ImGui::RadioButton("Glitch", &shader_mode, 4); ImGui::SameLine();
    ImGui::RadioButton("Gamma", &shader_mode, 5);
    ImGui::RadioButton("Blur", &shader_mode, 6); ImGui::SameLine();*/
-   glUniform1i(Uniforms::UniformLocs::mode, shader_mode);
+
+   //Toggle to compare the uniform branches with the specialized per-pass programs
+   ImGui::Checkbox("Per-pass program pipelines", &use_pipelines);
+   ImGui::Text("Post-process pass GPU time %.3f ms", postprocess_ms);
+   ImGui::Text("Uniform ring: %d blocks, %d of %d bytes per frame, %.3f ms waiting for the GPU", UniformRing::FrameBlocks(),
+      int(UniformRing::FrameBytes()), int(UniformRing::FrameSize()), UniformRing::WaitMs());
+   ImGui::Text("Uniform blocks: %d bytes uploaded this frame", UniformBlocks::UploadedBytes());
+   ImGui::Text("Instances: %d bytes in %d ranges uploaded this frame", InstanceBuffer::UploadedBytes(), InstanceBuffer::UploadedRanges());
+   ImGui::Checkbox("CPU ray-cast picking", &cpu_picking);
+   if (cpu_picking == true)
+   {
+      ImGui::Text("Picking: %.1f us for the last pick, %d triangles in %d BVH nodes, top level refit %.3f ms", cpu_pick_us,
+         mesh_bvh.NumTriangles(), mesh_bvh.NumNodes(), instance_bvh.RefitMs());
+   }
+   else
+   {
+      ImGui::Text("Picking: %d pending, last resolved %d frames after it was read", Picking::Pending(), Picking::LatencyFrames());
+   }
+   if (pick_point.valid == true)
+   {
+      ImGui::Text("Picked point: instance %d, triangle %d at (%.3f, %.3f, %.3f), depth %.4f", pick_point.instance + 1, pick_point.triangle,
+         pick_point.world.x, pick_point.world.y, pick_point.world.z, pick_point.depth);
+   }
    
    if (ImGui::Button("Show ImGui Demo Window"))
    {
@@ -306,21 +670,32 @@ void Scene::DrawGui(GLFWwindow* window)
    ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
 }
 
+//Offline capture advances exactly one video frame per rendered frame, whatever the wall clock says
+static double scene_time()
+{
+   if (recording == true && offline_capture == true)
+   {
+      return capture_start_sec + VideoRecorder::FrameTime();
+   }
+   return glfwGetTime();
+}
+
 void Scene::Idle()
 {
-   float time_sec = static_cast<float>(glfwGetTime());
+   //Frame boundary: rebuild edited shaders and swap in programs that finished linking
+   ShaderWatcher::Poll();
+   PollShaders();
 
-   //Pass time_sec value to the shaders
-   glUniform1f(Uniforms::UniformLocs::time, time_sec);
+   //Passed to the shaders in Display, since each pass may use a different program
+   time_sec = static_cast<float>(scene_time());
 }
 
-void Scene::ReloadShader()
+//Swap in new_shader once it has linked. If it failed keep rendering with the previous program.
+static void ShaderReady(GLuint new_shader)
 {
-   GLuint new_shader = InitShader(vertex_shader.c_str(), fragment_shader.c_str());
-
    if (new_shader == -1) // loading failed
    {
-      DebugBreak(); //alert user by breaking and showing debugger
+      std::cerr << "Shader build failed, keeping the previous program" << std::endl;
       glClearColor(1.0f, 0.0f, 1.0f, 0.0f); //change clear color if shader can't be compiled
    }
    else
@@ -332,9 +707,27 @@ void Scene::ReloadShader()
          glDeleteProgram(shader_program);
       }
       shader_program = new_shader;
+      ValidateProgram(shader_program);
+      glUseProgram(shader_program);
+
+      //Stage programs are rebuilt from the edited files the next time they are used
+      DeleteStagePrograms();
    }
 }
 
+//Rebuilds in the background. The new program is swapped in by PollShaders() in Idle().
+void Scene::ReloadShader()
+{
+   InitShaderAsync(vertex_shader.c_str(), fragment_shader.c_str(), ShaderReady);
+}
+
+//Free what Init created. Called once before the GL context is destroyed.
+void Scene::Shutdown()
+{
+   DeleteTextureArrays(texture_arrays);
+   instance_draws.clear();
+}
+
 //Initialize OpenGL state. This function only gets called once.
 void Scene::Init()
 {
@@ -372,36 +765,39 @@ void Scene::Init()
    info_file.close();
    glEnable(GL_DEPTH_TEST);
 
+   //Start compiling without waiting so the driver works on it while assets load
    ReloadShader();
+   ShaderWatcher::Add({ vertex_shader, fragment_shader }, ReloadShader);
+   ShaderWatcher::Start();
    mesh_data = LoadMesh(mesh_name);
-   texture_id = LoadTexture(texture_name);
-
-   glBindVertexArray(mesh_data.mVao);
-
-   for (int n = 0; n < 6; n++)
    {
-       modmatric_data[n] = glm::translate(glm::vec3(0.0, 0.0, 0.0));
-       lastmodmatric_data[n] = glm::translate(glm::vec3(0.0, 0.0, 0.0));
+      std::vector<float> positions;
+      std::vector<unsigned int> indices;
+      GetMeshTriangles(mesh_data, positions, indices);
+      mesh_bvh.Build(positions.data(), indices.data(), int(indices.size() / 3));
    }
+   texture_arrays = LoadTextureArrays(instance_texture_names, instance_layers);
 
-   
-   glGenBuffers(1, &model_matrix_buffer);
-   glBindBuffer(GL_ARRAY_BUFFER, model_matrix_buffer);
-   glBufferData(GL_ARRAY_BUFFER, 6 * sizeof(glm::mat4), modmatric_data, GL_STATIC_DRAW);
-   // Loop over each column of the matrix...
-   for (int i = 0; i < 4; i++)
+   //Per-instance transform and array texture, read by the vertex shader from a storage buffer
+   InstanceBuffer::Init(Uniforms::SsboBinding::instances, num_instances);
+   for (int n = 0; n < num_instances; n++)
    {
-       // Set up the vertex attribute
-       glVertexAttribPointer(Uniforms::UniformLocs::modmatric + i,              // Location
-           4, GL_FLOAT, GL_FALSE,       // vec4
-           sizeof(glm::mat4),                // Stride
-           (void*)(sizeof(glm::vec4) * i)); // Start offset
-       // Enable it
-       glEnableVertexAttribArray(Uniforms::UniformLocs::modmatric + i);
-       // Make it instanced
-       glVertexAttribDivisor(Uniforms::UniformLocs::modmatric + i, 1);
-   }
-   glBindVertexArray(0);
+       InstanceBuffer::Instance& instance = InstanceBuffer::Edit(n);
+       instance.model_matrix = glm::translate(glm::vec3(0.0, 0.0, 0.0));
+       instance.material = instance_layers[n].mArray;
+       instance.layer = glm::max(0, instance_layers[n].mLayer);
+       lastmodmatric_data[n] = instance.model_matrix;
+
+       if (instance_draws.empty() == false && instance_draws.back().array == instance.material)
+       {
+          instance_draws.back().count++;
+       }
+       else
+       {
+          instance_draws.push_back({ instance.material, n, 1 });
+       }
+   }
+   InstanceBuffer::Update();
 
 #pragma region FBO creation
    //Create a texture object and set initial wrapping and filtering state
@@ -416,11 +812,11 @@ void Scene::Init()
 
    glGenTextures(1, &pick_tex);
    glBindTexture(GL_TEXTURE_2D, pick_tex);
-   glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, Scene::InitWindowWidth, Scene::InitWindowHeight, 0, GL_RED, GL_FLOAT, NULL);
+   glTexImage2D(GL_TEXTURE_2D, 0, GL_R32UI, Scene::InitWindowWidth, Scene::InitWindowHeight, 0, GL_RED_INTEGER, GL_UNSIGNED_INT, NULL);
    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
-   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST); //ids can't be filtered
+   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
    glBindTexture(GL_TEXTURE_2D, 0);
 
    //Create renderbuffer for depth.
@@ -441,6 +837,22 @@ void Scene::Init()
    glBindFramebuffer(GL_FRAMEBUFFER, 0);
 
 #pragma endregion
+   glGenQueries(2, postprocess_query);
+
+   WaitShaders(); //only blocks for whatever compiling is left
+   glUseProgram(shader_program);
+
+   //Build the per-pass stages in the background, shader_program draws until they have linked.
+   //They arrive after Uniforms::Init, so the blocks are described by the time they are validated.
+   InitStageProgramAsync(GL_VERTEX_SHADER, vertex_shader.c_str(), { "PASS 0" }, ValidateProgram);
+   InitStageProgramAsync(GL_FRAGMENT_SHADER, fragment_shader.c_str(), { "PASS 0" }, ValidateProgram);
+   InitStageProgramAsync(GL_VERTEX_SHADER, vertex_shader.c_str(), { "PASS 1" }, ValidateProgram);
+   for (int mode = 0; mode < 7; mode++)
+   {
+      InitStageProgramAsync(GL_FRAGMENT_SHADER, fragment_shader.c_str(), { "PASS 1", "MODE " + std::to_string(mode) }, ValidateProgram);
+   }
+
    Camera::UpdateP();
    Uniforms::Init();
+   ValidateProgram(shader_program); //ShaderReady ran before Uniforms::Init described the blocks
 }
\ No newline at end of file
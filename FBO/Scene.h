@@ -1,6 +1,8 @@
 #pragma once
 
 #include <glm/glm.hpp>
+#include <functional>
+#include <vector>
 
 namespace Scene
 {
@@ -8,9 +10,13 @@ namespace Scene
    void Display(GLFWwindow* window);
    void Idle();
    void Init();
+   void Shutdown();
    void ReloadShader();
    void UpdateFbo();
-   int readPickID(int x, int y);
+   //Window coordinates with y up. The results arrive a frame or two later, during Display.
+   void requestPickID(int x, int y, std::function<void(int id)> picked);
+   void selectRectangle(int x0, int y0, int x1, int y1);
+   void selectLasso(const std::vector<glm::vec2>& lasso);
    void moveInstance(float x, float y);
    void resetPickID();
    extern const int InitWindowWidth;
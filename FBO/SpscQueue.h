@@ -0,0 +1,48 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+
+//Bounded lock-free queue for exactly one producer thread and one consumer thread.
+//Push and Pop never block; they return false when the queue is full or empty.
+template <typename T, size_t Capacity>
+class SpscQueue
+{
+public:
+   SpscQueue() : mHead(0), mTail(0) {}
+
+   //Producer thread only
+   bool Push(const T& value)
+   {
+      const size_t tail = mTail.load(std::memory_order_relaxed);
+      const size_t next = (tail + 1) % Slots;
+      if (next == mHead.load(std::memory_order_acquire)) return false; //full
+      mItems[tail] = value;
+      mTail.store(next, std::memory_order_release); //publishes the item and everything written before it
+      return true;
+   }
+
+   //Consumer thread only
+   bool Pop(T& value)
+   {
+      const size_t head = mHead.load(std::memory_order_relaxed);
+      if (head == mTail.load(std::memory_order_acquire)) return false; //empty
+      value = mItems[head];
+      mHead.store((head + 1) % Slots, std::memory_order_release);
+      return true;
+   }
+
+   //Exact only when called from one of the two threads while the other is idle
+   size_t Size() const
+   {
+      const size_t head = mHead.load(std::memory_order_acquire);
+      const size_t tail = mTail.load(std::memory_order_acquire);
+      return (tail + Slots - head) % Slots;
+   }
+
+private:
+   static const size_t Slots = Capacity + 1; //one slot stays empty to tell full from empty
+   T mItems[Slots];
+   alignas(64) std::atomic<size_t> mHead; //next item to pop, written by the consumer
+   alignas(64) std::atomic<size_t> mTail; //next free slot, written by the producer
+};
@@ -0,0 +1,129 @@
+#include "TextureArray.h"
+#include "LoadTexture.h"
+
+#include <algorithm>
+#include <iostream>
+#include <map>
+
+namespace
+{
+   struct DecodedImage
+   {
+      std::string filename;
+      std::vector<GLubyte> bytes;
+      GLuint w = 0;
+      GLuint h = 0;
+   };
+
+   int NumMipLevels(GLuint w, GLuint h)
+   {
+      int levels = 1;
+      GLuint size = std::max(w, h);
+      while (size > 1)
+      {
+         size /= 2;
+         levels++;
+      }
+      return levels;
+   }
+}
+
+std::vector<TextureArrayData> LoadTextureArrays(const std::vector<std::string>& fnames, std::vector<TextureLayer>& layers)
+{
+   std::vector<TextureArrayData> arrays;
+   layers.assign(fnames.size(), TextureLayer());
+
+   GLint max_layers = 0;
+   glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &max_layers);
+
+   //Decode each distinct file once
+   std::vector<DecodedImage> images;
+   std::map<std::string, int> image_index;
+   for (const std::string& fname : fnames)
+   {
+      if (image_index.count(fname) > 0) continue;
+
+      DecodedImage img;
+      img.filename = fname;
+      if (LoadImageBGRA(fname, img.bytes, img.w, img.h) == false)
+      {
+         std::cerr << "Failed to load " << fname << std::endl;
+         image_index[fname] = -1;
+         continue;
+      }
+      image_index[fname] = int(images.size());
+      images.push_back(std::move(img));
+   }
+
+   //Group by size and format. All images are currently decoded to 8-bit BGRA, so the format is GL_RGBA8.
+   const GLenum internal_format = GL_RGBA8;
+   std::map<std::pair<GLuint, GLuint>, std::vector<int>> groups;
+   for (int i = 0; i < int(images.size()); i++)
+   {
+      groups[std::make_pair(images[i].w, images[i].h)].push_back(i);
+   }
+
+   std::vector<TextureLayer> image_layer(images.size());
+   for (auto& group : groups)
+   {
+      const GLuint w = group.first.first;
+      const GLuint h = group.first.second;
+      const std::vector<int>& members = group.second;
+
+      //Split groups that would exceed the layer limit of a single array texture
+      for (size_t first = 0; first < members.size(); first += max_layers)
+      {
+         const size_t count = std::min(members.size() - first, size_t(max_layers));
+
+         TextureArrayData array;
+         array.mWidth = w;
+         array.mHeight = h;
+         array.mInternalFormat = internal_format;
+
+         glGenTextures(1, &array.mTexId);
+         glBindTexture(GL_TEXTURE_2D_ARRAY, array.mTexId);
+         glTexStorage3D(GL_TEXTURE_2D_ARRAY, NumMipLevels(w, h), internal_format, w, h, GLsizei(count));
+
+         for (size_t j = 0; j < count; j++)
+         {
+            const int img = members[first + j];
+            glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, GLint(j), w, h, 1, GL_BGRA, GL_UNSIGNED_BYTE, images[img].bytes.data());
+            image_layer[img].mArray = int(arrays.size());
+            image_layer[img].mLayer = int(j);
+            array.mFilenames.push_back(images[img].filename);
+         }
+
+         glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+         glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+         glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+         glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+         glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+         glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+         arrays.push_back(array);
+      }
+   }
+
+   for (size_t i = 0; i < fnames.size(); i++)
+   {
+      const int img = image_index[fnames[i]];
+      if (img >= 0)
+      {
+         layers[i] = image_layer[img];
+      }
+   }
+
+   return arrays;
+}
+
+void DeleteTextureArrays(std::vector<TextureArrayData>& arrays)
+{
+   for (TextureArrayData& array : arrays)
+   {
+      if (array.mTexId != -1)
+      {
+         glDeleteTextures(1, &array.mTexId);
+      }
+   }
+   arrays.clear();
+}
\ No newline at end of file
@@ -0,0 +1,50 @@
+#ifndef __TEXTUREARRAY_H__
+#define __TEXTUREARRAY_H__
+
+#include <string>
+#include <vector>
+#include <windows.h>
+#include "GL/glew.h"
+#include "GL/gl.h"
+
+/*
+Packs many images into GL_TEXTURE_2D_ARRAY textures so that instances with different
+textures can be drawn in a single instanced call. Images are grouped by size and format:
+each group becomes one array texture with a full mip chain, and each image is one layer.
+Instances in different arrays need separate draws, with the array bound in between.
+
+Pass the layer of each instance with the per-instance data and sample with:
+
+	layout(binding = 2) uniform sampler2DArray diffuse_array;
+	vec4 ktex = texture(diffuse_array, vec3(tex_coord, layer));
+*/
+
+//Where a loaded image ended up
+struct TextureLayer
+{
+   int mArray; //index into the vector returned by LoadTextureArrays
+   int mLayer; //layer within that array texture
+
+   TextureLayer() : mArray(-1), mLayer(-1) {}
+};
+
+struct TextureArrayData
+{
+   GLuint mTexId;
+   GLuint mWidth;
+   GLuint mHeight;
+   GLenum mInternalFormat;
+   std::vector<std::string> mFilenames; //one entry per layer
+
+   TextureArrayData() : mTexId(-1), mWidth(0), mHeight(0), mInternalFormat(GL_NONE) {}
+
+   int NumLayers() const { return int(mFilenames.size()); }
+};
+
+//Load each file in fnames and pack it into an array texture. On return layers[i] tells where fnames[i] was placed.
+//Repeated filenames share a layer. Files that fail to load are reported and get mArray = -1.
+std::vector<TextureArrayData> LoadTextureArrays(const std::vector<std::string>& fnames, std::vector<TextureLayer>& layers);
+void DeleteTextureArrays(std::vector<TextureArrayData>& arrays);
+
+
+#endif
\ No newline at end of file
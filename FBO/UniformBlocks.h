@@ -0,0 +1,38 @@
+#pragma once
+
+#include <GL/glew.h>
+#include <stddef.h>
+#include <vector>
+
+//Uniform blocks that change now and then (lights, materials edited in the GUI) packed into one buffer at
+//GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT offsets. Update() compares each block's C++ struct with the copy last
+//uploaded and uploads only the changed bytes. Validate() compares each struct's member offsets and sizes
+//with the std140 layout the linker reports, so a struct and its GLSL block can't drift apart unnoticed.
+namespace UniformBlocks
+{
+   struct Member
+   {
+      const char* name;  //as declared in the GLSL block
+      GLint offset;
+      GLint size;
+   };
+   //Member list entry for a member of struct T, e.g. UNIFORM_MEMBER(LightUniforms, La)
+   #define UNIFORM_MEMBER(T, member) UniformBlocks::Member{ #member, GLint(offsetof(T, member)), GLint(sizeof(T::member)) }
+
+   //Call before Init. data is owned by the caller and read by every Update.
+   void Add(const char* name, GLuint binding, const void* data, GLsizeiptr size, const std::vector<Member>& members);
+   template <typename T>
+   void Add(const char* name, GLuint binding, const T& data, const std::vector<Member>& members)
+   {
+      Add(name, binding, &data, sizeof(T), members);
+   }
+   //A block whose data lives elsewhere (e.g. streamed through UniformRing): only its layout is validated
+   void Describe(const char* name, GLuint binding, GLsizeiptr size, const std::vector<Member>& members);
+
+   void Init();    //creates the buffer, uploads every block and binds it
+   void Update();  //once per frame before drawing: uploads the bytes that changed since the last Update
+   //Checks every described block the program uses. Prints each mismatch and returns false if there was one.
+   bool Validate(GLuint program);
+
+   int UploadedBytes(); //by the last Update
+};
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <GL/glew.h>
+
+//Streaming allocator for uniform block data. One buffer, persistently and coherently mapped, is split
+//into a region per frame in flight. Blocks are bump allocated from the current frame's region, written
+//through the mapped pointer and bound with glBindBufferRange, so an update never waits for draws still
+//reading earlier values (glBufferSubData on a buffer in use may). EndFrame fences the region and
+//BeginFrame waits for that fence before the region is reused FramesInFlight frames later.
+namespace UniformRing
+{
+   const int FramesInFlight = 3;
+
+   struct Block
+   {
+      GLuint buffer;      //changes when the ring grows
+      GLintptr offset;    //aligned to GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT
+      GLsizeiptr size;
+   };
+
+   void Init(GLsizeiptr frame_size = 64 * 1024); //bytes per frame. Doubles when a frame needs more.
+
+   void BeginFrame(); //before the frame's first Push
+   void EndFrame();   //after the frame's last draw
+
+   //Copy a block into the current frame's region. Blocks stay valid until the end of the frame.
+   Block Push(const void* data, GLsizeiptr size);
+   void Bind(GLuint binding, const Block& block);
+
+   //Per-frame or per-draw uniform block: Push, then bind to the block's binding point
+   template <typename T>
+   Block Bind(GLuint binding, const T& data)
+   {
+      const Block block = Push(&data, sizeof(T));
+      Bind(binding, block);
+      return block;
+   }
+
+   GLsizeiptr FrameSize();  //bytes per region
+   GLsizeiptr FrameBytes(); //bytes the last frame used, including alignment padding
+   int FrameBlocks();       //blocks the last frame pushed
+   float WaitMs();          //BeginFrame waiting for the GPU, smoothed. Non-zero means the GPU is 3 frames behind.
+};
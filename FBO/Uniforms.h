@@ -6,6 +6,8 @@
 namespace Uniforms
 {
    void Init();
+   //SceneData is pushed into UniformRing, call between UniformRing::BeginFrame and EndFrame. LightData
+   //and MaterialData are uploaded by UniformBlocks::Update when they have changed.
    void BufferSceneData();
 
    //This structure mirrors the uniform block declared in the shader
@@ -35,11 +37,6 @@ namespace Uniforms
    extern LightUniforms LightData;
    extern MaterialUniforms MaterialData;
 
-   //IDs for the buffer objects holding the uniform block data
-   extern GLuint scene_ubo;
-   extern GLuint light_ubo;
-   extern GLuint material_ubo;
-
    namespace UboBinding
    {
       //These values come from the binding value specified in the shader block layout
@@ -56,6 +53,12 @@ namespace Uniforms
       extern int pass;
       extern int mode;
       extern int pickedID;
-      extern int modmatric;
+      extern int base_instance; //only active without GL_ARB_shader_draw_parameters
+   };
+
+   namespace SsboBinding
+   {
+      //These values come from the binding value specified in the shader storage block layout
+      extern int instances;
    };
 };
@@ -1,12 +1,24 @@
 #version 430
 layout(binding = 0) uniform sampler2D diffuse_tex; 
 layout(binding = 1) uniform sampler2D fbo_tex; 
+layout(binding = 2) uniform sampler2DArray diffuse_array; 
 
 layout(location = 1) uniform float time;
+//PASS and MODE may be compiled in as #defines (see ShaderVariants), which removes the branches below.
+//Without them the uniforms select the code path at runtime.
+#ifdef PASS
+const int pass = PASS;
+#else
 layout(location = 2) uniform int pass;
+#endif
+#ifdef MODE
+const int mode = MODE;
+#else
 layout(location = 3) uniform int mode;
+#endif
 layout(location = 4) uniform int pickedID;
 flat in int InstanceID;
+flat in int Layer;
 
 layout(std140, binding = 0) uniform SceneUniforms
 {
@@ -39,7 +51,7 @@ in VertexData
 
 
 layout (location = 0) out vec4 fragcolor;
-layout (location = 1) out float data;
+layout (location = 1) out uint data; //instance id, 0 is the background
 
 
 vec4 lake();
@@ -54,7 +66,7 @@ void main(void)
 	if(pass == 0)
 	{
 		//Compute per-fragment Phong lighting
-		vec4 ktex = texture(diffuse_tex, inData.tex_coord);
+		vec4 ktex = texture(diffuse_array, vec3(inData.tex_coord, Layer));
 	
 		vec4 ambient_term = ka*ktex*La;
 
@@ -70,7 +82,7 @@ void main(void)
 		vec3 rw = reflect(-lw, nw);	//world-space unit reflection vector
 
 		vec4 specular_term = atten*ks*Ls*pow(max(0.0, dot(rw, vw)), shininess);
-		data = float(InstanceID);
+		data = uint(InstanceID);
 		if(pickedID==InstanceID)
 		{
 			fragcolor = 2*(ambient_term + diffuse_term + specular_term);
@@ -1,8 +1,14 @@
 #version 430            
+#extension GL_ARB_shader_draw_parameters : enable
 layout(location = 0) uniform mat4 M;
 layout(location = 1) uniform float time;
+#ifdef PASS
+const int pass = PASS;
+#else
 layout(location = 2) uniform int pass = 0;
+#endif
 layout(location = 4) uniform int pickedID;
+layout(location = 5) uniform int base_instance = 0; //set before each draw when gl_BaseInstanceARB is missing
 
 
 layout(std140, binding = 0) uniform SceneUniforms
@@ -14,7 +20,26 @@ layout(std140, binding = 0) uniform SceneUniforms
 layout(location = 0) in vec3 pos_attrib; //this variable holds the position of mesh vertices
 layout(location = 1) in vec2 tex_coord_attrib;
 layout(location = 2) in vec3 normal_attrib;  
-layout (location = 3) in mat4 model_matrix;
+
+//Mirrors InstanceBuffer::Instance
+struct Instance
+{
+   mat4 model_matrix;
+   vec4 color;
+   int material;
+   int layer;  //array texture layer
+};
+
+layout(std430, binding = 0) readonly buffer InstanceData
+{
+   Instance instances[];
+};
+
+#ifdef GL_ARB_shader_draw_parameters
+#define BASE_INSTANCE gl_BaseInstanceARB
+#else
+#define BASE_INSTANCE base_instance
+#endif
 
 out VertexData
 {
@@ -23,7 +48,14 @@ out VertexData
    vec3 nw;   //world-space normal vector
 } outData; 
 
+//Redeclared so this stage can be linked as a separable program
+out gl_PerVertex
+{
+   vec4 gl_Position;
+};
+
 flat out int InstanceID;
+flat out int Layer;
 
 const vec4 quad[4] = vec4[] (vec4(-1.0, 1.0, 0.0, 1.0), 
 							vec4(-1.0, -1.0, 0.0, 1.0), 
@@ -34,13 +66,16 @@ void main(void)
 {
 	if(pass==0)
 	{
-	InstanceID = gl_InstanceID+1;
-	vec3 offset=vec3(gl_InstanceID%3-1,0.0,gl_InstanceID/3-1);
+	int index = gl_InstanceID + BASE_INSTANCE; //gl_InstanceID restarts at 0 in each draw
+	Instance instance = instances[index];
+	InstanceID = index+1;
+	Layer = instance.layer;
+	vec3 offset=vec3(index%3-1,0.0,index/3-1);
 	if(pickedID!=InstanceID)
 	{
-	offset.z+=(pos_attrib.x+0.2)*0.1*sin(4*pos_attrib.x+7*time+gl_InstanceID*3);
+	offset.z+=(pos_attrib.x+0.2)*0.1*sin(4*pos_attrib.x+7*time+index*3);
 	}
-	gl_Position = model_matrix*PV*M*vec4(pos_attrib+0.5*offset, 1.0); //transform vertices and send result into pipeline
+	gl_Position = instance.model_matrix*PV*M*vec4(pos_attrib+0.5*offset, 1.0); //transform vertices and send result into pipeline
 	
 	//Use dot notation to access members of the interface block
 	outData.tex_coord = tex_coord_attrib;           //send tex_coord to fragment shader
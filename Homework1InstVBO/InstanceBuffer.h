@@ -0,0 +1,39 @@
+#pragma once
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+//Per-instance data in a shader storage buffer. The vertex shader reads
+//instances[gl_InstanceID + gl_BaseInstance], so instances take no vertex attribute slots and a draw can
+//start anywhere in the array with its base instance. Without GL_ARB_shader_draw_parameters the shader
+//has to get the base instance from a uniform. The CPU copy is the master: Edit marks the
+//instance's page dirty and Update uploads the dirty pages, merged into runs, once per frame.
+namespace InstanceBuffer
+{
+   //Mirrors struct Instance in the shaders. std430 rounds the struct up to the alignment of the mat4.
+   struct Instance
+   {
+      glm::mat4 model_matrix = glm::mat4(1.0f);
+      glm::vec4 color = glm::vec4(1.0f);
+      GLint material = 0;
+      GLint layer = 0;   //array texture layer
+      GLint pad[2] = {};
+   };
+
+   const int PageInstances = 64; //dirty tracking granularity, 6 KB
+
+   void Init(GLuint binding, int count); //count identity instances, bound to the storage block's binding
+
+   int Count();
+   const Instance& Get(int i);
+   Instance& Edit(int i); //marks instance i for the next Update
+
+   void Update(); //once per frame before drawing: uploads the pages edited since the last Update
+
+   //Checks the stride and member offsets of the instance array the program uses. Prints each mismatch
+   //and returns false if there was one.
+   bool Validate(GLuint program);
+
+   int UploadedBytes();  //by the last Update
+   int UploadedRanges(); //glNamedBufferSubData calls of the last Update
+};
@@ -20,7 +20,11 @@
 
 #include "Scene.h"
 #include "Uniforms.h"
+#include "UniformRing.h"   //Per-frame uniform data
+#include "UniformBlocks.h" //Light and material uniform blocks
+#include "InstanceBuffer.h" //Per-instance transforms and colors
 #include "InitShader.h"    //Functions for loading shaders from text files
+#include "ShaderWatcher.h"  //Rebuilds shaders when their files change
 #include "VideoRecorder.h"      //Functions for saving videos
 #include "DebugCallback.h"
 #include "Surf.h"
@@ -41,6 +45,8 @@ surf_vao surface;
 float angle = 0.0f;
 float scale = 0.03f;
 bool recording = false;
+bool offline_capture = false;  //fixed timestep and no vsync while recording
+double capture_start_sec = 0.0;
 
 namespace Scene
 {
@@ -70,7 +76,10 @@ void Scene::Display(GLFWwindow* window)
 
    Camera::V = glm::lookAt(glm::vec3(Uniforms::SceneData.eye_w), glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3(0.0f, 0.0f, 1.0f));
    Uniforms::SceneData.PV = Camera::P * Camera::V;
+   UniformRing::BeginFrame();
    Uniforms::BufferSceneData();
+   UniformBlocks::Update(); //light and material, when the GUI has changed them
+   InstanceBuffer::Update();
 
    glUseProgram(shader_program);
    
@@ -80,19 +89,20 @@ void Scene::Display(GLFWwindow* window)
 
    //Draw a surface from currently selected VAO
    glBindVertexArray(surface.vao);
-   glDrawElementsInstanced(GL_TRIANGLE_STRIP, surface.num_indices, GL_UNSIGNED_INT, 0, 9);
+   glDrawElementsInstanced(GL_TRIANGLE_STRIP, surface.num_indices, GL_UNSIGNED_INT, 0, NUM_INSTANCES);
 
    DrawGui(window);
 
    if (recording == true)
    {
-      glFinish();
       glReadBuffer(GL_BACK);
       int w, h;
       glfwGetFramebufferSize(window, &w, &h);
       VideoRecorder::EncodeBuffer(GL_BACK);
    }
 
+   UniformRing::EndFrame();
+
    /* Swap front and back buffers */
    glfwSwapBuffers(window);
 }
@@ -125,6 +135,11 @@ void Scene::DrawGui(GLFWwindow* window)
          const int fps = 60;
          const int bitrate = 4000000;
          VideoRecorder::Start(video_filename, w, h, fps, bitrate); //Uses ffmpeg
+         if (offline_capture == true)
+         {
+            capture_start_sec = glfwGetTime();
+            glfwSwapInterval(0); //render as fast as the encoder accepts frames
+         }
       }
    }
    else
@@ -133,10 +148,28 @@ void Scene::DrawGui(GLFWwindow* window)
       {
          recording = false;
          VideoRecorder::Stop(); //Uses ffmpeg
+         if (offline_capture == true)
+         {
+            glfwSetTime(capture_start_sec + VideoRecorder::FrameTime()); //carry on from the end of the video
+            glfwSwapInterval(1);
+         }
       }
    }
    ImGui::SameLine();
    ImGui::InputText("Video filename", video_filename, filename_len);
+   if (recording == false)
+   {
+      ImGui::Checkbox("Offline capture (fixed timestep, no vsync)", &offline_capture);
+      ImGui::Checkbox("Convert to YUV on the GPU", &VideoRecorder::ConvertOnGpu);
+   }
+   else
+   {
+      ImGui::Text("Recording: %.1f frames/s, %.3f ms/frame on the render thread, %d frames queued, %d readback buffers",
+         VideoRecorder::CaptureFps(), VideoRecorder::RenderThreadMs(), VideoRecorder::QueuedFrames(), VideoRecorder::ReadbackBuffers());
+      const VideoRecorder::CaptureStats stats = VideoRecorder::Stats();
+      ImGui::Text("   wait %.2f ms, convert %.2f ms, encode %.2f ms, mux %.2f ms, %d dropped, %d at half resolution",
+         stats.wait_ms, stats.convert_ms, stats.encode_ms, stats.mux_ms, stats.dropped, stats.half_res);
+   }
 
 
    ImGui::SliderFloat("View angle", &angle, -glm::pi<float>(), +glm::pi<float>());
@@ -174,21 +207,42 @@ void Scene::DrawGui(GLFWwindow* window)
    ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
 }
 
+//Offline capture advances exactly one video frame per rendered frame, whatever the wall clock says
+static double scene_time()
+{
+   if (recording == true && offline_capture == true)
+   {
+      return capture_start_sec + VideoRecorder::FrameTime();
+   }
+   return glfwGetTime();
+}
+
 void Scene::Idle()
 {
-   float time_sec = static_cast<float>(glfwGetTime());
+   //Frame boundary: rebuild edited shaders and swap in programs that finished linking
+   ShaderWatcher::Poll();
+   PollShaders();
+
+   float time_sec = static_cast<float>(scene_time());
 
    //Pass time_sec value to the shaders
    glUniform1f(Uniforms::UniformLocs::time, time_sec);
 }
 
-void Scene::ReloadShader()
+//Reports C++ structs that don't match the uniform and storage blocks the program declares
+static void ValidateProgram(GLuint program)
 {
-   GLuint new_shader = InitShader(vertex_shader.c_str(), fragment_shader.c_str());
+   if (program == -1) return;
+   UniformBlocks::Validate(program);
+   InstanceBuffer::Validate(program);
+}
 
+//Swap in new_shader once it has linked. If it failed keep rendering with the previous program.
+static void ShaderReady(GLuint new_shader)
+{
    if (new_shader == -1) // loading failed
    {
-      DebugBreak(); //alert user by breaking and showing debugger
+      std::cerr << "Shader build failed, keeping the previous program" << std::endl;
       glClearColor(1.0f, 0.0f, 1.0f, 0.0f); //change clear color if shader can't be compiled
    }
    else
@@ -200,9 +254,17 @@ void Scene::ReloadShader()
          glDeleteProgram(shader_program);
       }
       shader_program = new_shader;
+      ValidateProgram(shader_program);
+      glUseProgram(shader_program);
    }
 }
 
+//Rebuilds in the background. The new program is swapped in by PollShaders() in Idle().
+void Scene::ReloadShader()
+{
+   InitShaderAsync(vertex_shader.c_str(), fragment_shader.c_str(), ShaderReady);
+}
+
 //Initialize OpenGL state. This function only gets called once.
 void Scene::Init()
 {
@@ -241,62 +303,27 @@ void Scene::Init()
    glEnable(GL_DEPTH_TEST);
 
    ReloadShader();
+   WaitShaders();
+   ShaderWatcher::Add({ vertex_shader, fragment_shader }, ReloadShader);
+   ShaderWatcher::Start();
 
  #pragma region VBO and VBO creation
    const int n = 50;
    surface = create_indexed_surf_interleaved_strip_vao(n);
 #pragma endregion
 
-   if (NUM_INSTANCES > 1) {
-
-       glBindVertexArray(surface.vao);
-
-       glm::vec4 color_data[NUM_INSTANCES] = {};
-       for (int i = 0; i < NUM_INSTANCES; i++) {
-           color_data[i] = glm::vec4((i / 3)/2.0, (i % 3)/2.0, ((i + 1) / 3.0), 1.0);
-       }
-
-       int color_loc = glGetAttribLocation(shader_program, "color");
-       int matrix_loc = glGetAttribLocation(shader_program, "model_matrix");
-
-       GLuint color_buffer;
-       glGenBuffers(1, &color_buffer);
-       glBindBuffer(GL_ARRAY_BUFFER, color_buffer);
-       glBufferData(GL_ARRAY_BUFFER,NUM_INSTANCES * sizeof(glm::vec4), color_data,GL_STATIC_DRAW);
-
-       glVertexAttribPointer(color_loc, 4, GL_FLOAT,GL_FALSE, 0, 0);
-       glEnableVertexAttribArray(color_loc);
-       glVertexAttribDivisor(color_loc, 1);
-
-   
-       glm::mat4 modmatric_data[NUM_INSTANCES] = {};
-       for (int n = 0; n < NUM_INSTANCES; n++)
-       {
-           float a = 30 * (n / 3 - 1);
-           float b = 30 * (n % 3 - 1);
-           float c = 0;
-           modmatric_data[n] = glm::translate(glm::vec3(a, b, c));
-}
-
-       GLuint model_matrix_buffer;
-       glGenBuffers(1, &model_matrix_buffer);
-       glBindBuffer(GL_ARRAY_BUFFER, model_matrix_buffer);
-       glBufferData(GL_ARRAY_BUFFER, NUM_INSTANCES * sizeof(glm::mat4), modmatric_data, GL_STATIC_DRAW);
-       // Loop over each column of the matrix...
-       for (int i = 0; i < 4; i++)
-       {
-           // Set up the vertex attribute
-           glVertexAttribPointer(matrix_loc + i,              // Location
-               4, GL_FLOAT, GL_FALSE,       // vec4
-               sizeof(glm::mat4),                // Stride
-               (void*)(sizeof(glm::vec4) * i)); // Start offset
-           // Enable it
-           glEnableVertexAttribArray(matrix_loc + i);
-           // Make it instanced
-           glVertexAttribDivisor(matrix_loc + i, 1);
-       }
-       glBindVertexArray(0);
+   //Per-instance transform and color, read by the vertex shader from a storage buffer
+   InstanceBuffer::Init(Uniforms::SsboBinding::instances, NUM_INSTANCES);
+   for (int n = 0; n < NUM_INSTANCES; n++)
+   {
+       float a = 30 * (n / 3 - 1);
+       float b = 30 * (n % 3 - 1);
+       float c = 0;
+       InstanceBuffer::Instance& instance = InstanceBuffer::Edit(n);
+       instance.model_matrix = glm::translate(glm::vec3(a, b, c));
+       instance.color = glm::vec4((n / 3)/2.0, (n % 3)/2.0, ((n + 1) / 3.0), 1.0);
    }
+   InstanceBuffer::Update();
 
    if (surface.mode == GL_TRIANGLE_STRIP) {
        glEnable(GL_PRIMITIVE_RESTART);
@@ -308,4 +335,5 @@ void Scene::Init()
 
    Camera::UpdateP();
    Uniforms::Init();
+   ValidateProgram(shader_program); //ShaderReady ran before Uniforms::Init described the blocks
 }
\ No newline at end of file
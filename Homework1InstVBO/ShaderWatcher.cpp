@@ -0,0 +1,131 @@
+#include "ShaderWatcher.h"
+
+#include <windows.h>
+#include <atomic>
+#include <iostream>
+#include <mutex>
+#include <thread>
+
+namespace ShaderWatcher
+{
+   struct Watch
+   {
+      std::vector<std::string> files;
+      std::vector<ULONGLONG> write_times;
+      std::function<void()> onChanged;
+      bool changed;
+   };
+
+   std::vector<Watch> watches;
+   std::mutex watch_mutex; //guards watches
+   std::thread watcher;
+   std::atomic<bool> running(false);
+
+   const DWORD wait_ms = 250;    //how often the thread checks whether it should exit
+   const DWORD settle_ms = 50;   //editors may write a file in several steps
+
+   //Stops the thread when the program exits so it isn't destroyed while joinable
+   struct StopOnExit { ~StopOnExit() { Stop(); } } stop_on_exit;
+
+static ULONGLONG last_write_time(const std::string& filename)
+{
+   WIN32_FILE_ATTRIBUTE_DATA data;
+   if (GetFileAttributesExA(filename.c_str(), GetFileExInfoStandard, &data) == 0)
+   {
+      return 0;
+   }
+   return (ULONGLONG(data.ftLastWriteTime.dwHighDateTime) << 32) | data.ftLastWriteTime.dwLowDateTime;
+}
+
+static void check_files()
+{
+   std::lock_guard<std::mutex> lock(watch_mutex);
+   for (Watch& w : watches)
+   {
+      for (size_t i = 0; i < w.files.size(); i++)
+      {
+         const ULONGLONG t = last_write_time(w.files[i]);
+         if (t != 0 && t != w.write_times[i])
+         {
+            w.write_times[i] = t;
+            w.changed = true;
+         }
+      }
+   }
+}
+
+static void watch_thread()
+{
+   //Shader files are loaded relative to the working directory
+   HANDLE change = FindFirstChangeNotificationA(".", FALSE, FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_FILE_NAME);
+   if (change == INVALID_HANDLE_VALUE)
+   {
+      std::cerr << "ShaderWatcher: could not watch the working directory" << std::endl;
+      return;
+   }
+
+   while (running)
+   {
+      if (WaitForSingleObject(change, wait_ms) == WAIT_OBJECT_0)
+      {
+         Sleep(settle_ms);
+         check_files();
+         FindNextChangeNotification(change);
+      }
+   }
+   FindCloseChangeNotification(change);
+}
+
+void Add(const std::vector<std::string>& files, std::function<void()> onChanged)
+{
+   Watch w;
+   w.files = files;
+   w.onChanged = onChanged;
+   w.changed = false;
+   for (const std::string& f : files)
+   {
+      w.write_times.push_back(last_write_time(f));
+   }
+
+   std::lock_guard<std::mutex> lock(watch_mutex);
+   watches.push_back(w);
+}
+
+void Start()
+{
+   if (running) return;
+   running = true;
+   watcher = std::thread(watch_thread);
+}
+
+void Stop()
+{
+   running = false;
+   if (watcher.joinable())
+   {
+      watcher.join();
+   }
+}
+
+void Poll()
+{
+   std::vector<std::function<void()>> callbacks;
+   {
+      std::lock_guard<std::mutex> lock(watch_mutex);
+      for (Watch& w : watches)
+      {
+         if (w.changed)
+         {
+            w.changed = false;
+            callbacks.push_back(w.onChanged);
+         }
+      }
+   }
+
+   for (auto& callback : callbacks)
+   {
+      callback();
+   }
+}
+
+};
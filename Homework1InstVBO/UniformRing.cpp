@@ -0,0 +1,159 @@
+#include "UniformRing.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+namespace UniformRing
+{
+   GLuint buffer = -1;
+   GLubyte* mapped = nullptr;
+   GLsizeiptr frame_size = 0;
+   GLint alignment = 256;
+
+   int region = FramesInFlight - 1;        //region of the current frame
+   GLsync fences[FramesInFlight] = {};     //signal when the GPU is done with a region
+   GLintptr head = 0;                      //next free byte in the current region
+
+   //Buffers replaced by a larger one in the middle of a frame. Draws of that frame may still read them.
+   struct Retired
+   {
+      GLuint buffer;
+      GLsync fence;
+   };
+   std::vector<Retired> retired;
+
+   int blocks = 0;
+   GLsizeiptr frame_bytes = 0;      //pushed this frame, in every buffer it used
+   GLsizeiptr last_frame_bytes = 0;
+   int last_frame_blocks = 0;
+   float wait_ms = 0.0f;
+
+   const GLbitfield map_flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+static GLsizeiptr align(GLsizeiptr offset)
+{
+   return (offset + alignment - 1) / alignment * alignment;
+}
+
+static void create_buffer(GLsizeiptr size)
+{
+   frame_size = align(size);
+   glCreateBuffers(1, &buffer);
+   glNamedBufferStorage(buffer, frame_size * FramesInFlight, nullptr, map_flags);
+   mapped = (GLubyte*)glMapNamedBufferRange(buffer, 0, frame_size * FramesInFlight, map_flags);
+}
+
+void Init(GLsizeiptr size)
+{
+   glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+   create_buffer(size);
+   region = FramesInFlight - 1;
+   head = region * frame_size;
+}
+
+void BeginFrame()
+{
+   region = (region + 1) % FramesInFlight;
+   head = region * frame_size;
+   blocks = 0;
+   frame_bytes = 0;
+
+   if (fences[region] != 0)
+   {
+      //The region can't be written until the GPU has finished the frame that used it, however long that takes
+      auto start = std::chrono::high_resolution_clock::now();
+      GLenum status = glClientWaitSync(fences[region], GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+      while (status == GL_TIMEOUT_EXPIRED)
+      {
+         status = glClientWaitSync(fences[region], 0, 1000000000);
+      }
+      if (status == GL_WAIT_FAILED)
+      {
+         fprintf(stderr, "Uniform ring: waiting for region %d failed, its uniforms may change under draws still reading them\n", region);
+      }
+      glDeleteSync(fences[region]);
+      fences[region] = 0;
+      const float ms = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+      wait_ms = 0.95f * wait_ms + 0.05f * ms;
+   }
+
+   //Fenced at the end of the frame they were replaced in
+   for (size_t i = 0; i < retired.size();)
+   {
+      if (retired[i].fence != 0 && glClientWaitSync(retired[i].fence, 0, 0) != GL_TIMEOUT_EXPIRED)
+      {
+         glDeleteSync(retired[i].fence);
+         glDeleteBuffers(1, &retired[i].buffer);
+         retired.erase(retired.begin() + i);
+      }
+      else
+      {
+         i++;
+      }
+   }
+}
+
+void EndFrame()
+{
+   fences[region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+   for (Retired& r : retired)
+   {
+      if (r.fence == 0) r.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+   }
+   last_frame_bytes = frame_bytes;
+   last_frame_blocks = blocks;
+}
+
+//The current region is full: move to a buffer with room for twice what this frame has pushed so far.
+//Blocks already pushed stay in the old buffer, which is deleted once this frame has finished on the
+//GPU. The new buffer has no draws pending, so its fences start out empty.
+static void grow(GLsizeiptr size)
+{
+   GLsizeiptr new_size = 2 * frame_size;
+   while (new_size < 2 * (frame_bytes + size + alignment)) new_size *= 2;
+
+   glUnmapNamedBuffer(buffer);
+   retired.push_back({ buffer, 0 });
+   for (int i = 0; i < FramesInFlight; i++)
+   {
+      if (fences[i] != 0)
+      {
+         //Older frames' fences cover the old buffer. Keeping them would only make BeginFrame wait for nothing.
+         glDeleteSync(fences[i]);
+         fences[i] = 0;
+      }
+   }
+   create_buffer(new_size);
+   head = region * frame_size;
+}
+
+Block Push(const void* data, GLsizeiptr size)
+{
+   //The bound range has to cover the whole std140 block, which is rounded up to a vec4
+   const GLsizeiptr block_size = (size + 15) / 16 * 16;
+   GLintptr offset = align(head);
+   if (offset + block_size > (region + 1) * frame_size)
+   {
+      grow(block_size);
+      offset = align(head);
+   }
+   memcpy(mapped + offset, data, size);
+   frame_bytes += offset + block_size - head;
+   head = offset + block_size;
+   blocks++;
+   return { buffer, offset, block_size };
+}
+
+void Bind(GLuint binding, const Block& block)
+{
+   glBindBufferRange(GL_UNIFORM_BUFFER, binding, block.buffer, block.offset, block.size);
+}
+
+GLsizeiptr FrameSize() {return frame_size;}
+GLsizeiptr FrameBytes() {return last_frame_bytes;}
+int FrameBlocks() {return last_frame_blocks;}
+float WaitMs() {return wait_ms;}
+};
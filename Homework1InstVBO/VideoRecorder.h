@@ -6,13 +6,133 @@
 #include <string.h>
 #include <math.h>
 #include <GL/glew.h>
+#include <string>
+#include <vector>
 
 
 namespace VideoRecorder
 {
-   int Start(const char *filename, int width, int height, int framerate, int64_t bitrate);
+   //Encoder settings for Start. Codec-specific settings are ignored by codecs that don't have them.
+   struct Options
+   {
+      enum Codec { FORMAT_DEFAULT, H264, H265, MPEG4, FFV1 }; //libx264, libx265, mpeg4, ffv1 (lossless, needs .mkv or .avi)
+      enum Threading { FRAME_THREADS, SLICE_THREADS };       //frame threads add a frame of latency per thread
+      //What EncodeBuffer/EncodeTexture do when every readback buffer is still waiting for the GPU or the encoder:
+      //wait for one, skip the frame (the video keeps its timing, the frame is just missing), or read back and
+      //convert at half resolution while the ring is nearly full. The stream size can't change, so half
+      //resolution frames are scaled back up on the encoder thread.
+      enum Backpressure { BLOCK, DROP_NEWEST, LOWER_RESOLUTION };
+
+      Codec codec = H264;
+      int framerate = 60;
+      int crf = 23;                 //x264/x265 constant rate factor, or -1 to encode at bitrate instead
+      int64_t bitrate = 4000000;    //bits/s, used when crf is -1 or the codec has no crf
+      const char* preset = "veryfast"; //x264/x265 speed preset, "ultrafast" ... "placebo"
+      const char* tune = "";        //x264/x265 tune, e.g. "zerolatency", or "" for none
+      int gop_size = 0;             //frames between keyframes, 0 for one per second
+      int max_b_frames = -1;        //-1 keeps the encoder's default
+      Threading threading = FRAME_THREADS;
+      int threads = 0;              //0 lets the encoder pick from the core count
+      Backpressure backpressure = BLOCK;
+      bool stats_csv = true;        //write per-frame timings to <filename>.csv
+      //Instant replay: when > 0 the recording isn't written. The encoder runs for the whole session but
+      //only the packets of the last replay_seconds, starting at a keyframe, are kept in memory until
+      //SaveReplay. The ring is trimmed a GOP at a time (see gop_size), and sooner if it holds more
+      //than replay_memory bytes. No stats CSV and no length limit in this mode.
+      double replay_seconds = 0.0;
+      int64_t replay_memory = 256 << 20;
+      //Streaming: the filename may be a URL or pipe instead of a file, e.g. udp://127.0.0.1:1234?pkt_size=1316,
+      //unix:///tmp/render.sock, \\.\pipe\render (Windows named pipe) or pipe:1. container names the muxer
+      //("mpegts", "h264", "rtp_mpegts"), "" picks it from the file extension.
+      const char* container = "";
+      bool live = false;             //flush every packet to the protocol, fragmented mp4, no length limit
+      bool frame_timestamps = false; //embed each frame's capture time in the bitstream (x264/x265 SEI)
+      //Raw capture: write the converted YUV420P frames to a Y4M file (use .y4m) instead of encoding, for
+      //when the encoder can't keep up, and encode it later with Transcode. About 3 MB per 1080p frame, so
+      //the disk needs ~180 MB/s at 60 fps. Codec settings are ignored.
+      bool raw = false;
+      int64_t raw_preallocate = int64_t(1) << 30; //bytes reserved ahead of the data, and the step the file grows by
+      //Also mark the reserved space as written (SetFileValidData, needs SeManageVolumePrivilege) so writes
+      //don't stall at the valid data length. The space isn't zeroed: until Stop it exposes old disk contents
+      //to anyone reading the file, and a crash leaves them in it. Only for disks holding nobody else's data.
+      bool raw_valid_data = false;
+   };
+
+   //Settings for streaming and live preview: no B-frames, no lookahead, slice threads
+   Options LowLatencyOptions();
+   //LowLatencyOptions for a live stream to a local player: container, live muxing, frame timestamps and
+   //a keyframe every half second for players that join late
+   Options StreamingOptions(const char* container = "mpegts");
+
+   //Extra file encoded from the same captured frame at a lower resolution, e.g. a small proxy next to the
+   //master recording. The frame is read once; previews come from mip levels of a copy of it, so level 1 is
+   //half width and height, 2 a quarter. The preview always uses the recording's framerate.
+   struct Preview
+   {
+      std::string filename;
+      int level = 1;
+      Options options;
+   };
+
+   int Start(const char *filename, int width, int height, const Options& options,
+      const std::vector<Preview>& previews = std::vector<Preview>());
+   int Start(const char *filename, int width, int height, int framerate, int64_t bitrate); //default options at a fixed bitrate
    void EncodeBuffer(GLint buffer);
    void EncodeTexture(GLint tex, int level=0);
    void Stop();
    bool Recording();
+
+   //EncodeBuffer/EncodeTexture only start an asynchronous readback and hand frames whose readback has
+   //finished to an encoder thread, which converts, encodes and muxes them. No glFinish is needed before
+   //calling them. Stop() waits for queued frames.
+   float RenderThreadMs(); //smoothed render thread cost of EncodeBuffer/EncodeTexture
+   int QueuedFrames();     //frames waiting for the recording's encoder thread
+   int ReadbackBuffers();  //current depth of the recording's fenced pixel pack buffer ring
+
+   //Offline capture: animate from FrameTime() instead of the wall clock and turn vsync off. Each
+   //rendered frame then advances exactly 1/framerate, and frames render as fast as the readback
+   //ring and encoder accept them (EncodeBuffer blocks rather than drops when they fall behind).
+   double FrameTime();     //seconds of video captured since Start: frames captured / framerate
+   float CaptureFps();     //frames captured per second of wall clock time
+
+   //Where capture time goes, smoothed over recent frames. The stats CSV has the per-frame values.
+   struct CaptureStats
+   {
+      float wait_ms;     //render thread waiting for a free readback buffer
+      float convert_ms;  //colorspace conversion on the encoder thread
+      float encode_ms;   //avcodec_send_frame/avcodec_receive_packet, or the raw file write
+      float mux_ms;      //av_interleaved_write_frame
+      int dropped;       //frames dropped by the backpressure policy or because encoding stopped
+      int half_res;      //frames captured at half resolution
+      float latency_ms;  //capture to muxed, the sender's part of glass-to-glass latency
+      float replay_sec;  //video held for SaveReplay
+      int64_t replay_bytes; //memory held by it
+      float write_mb_s;  //raw capture: bytes on disk / time since Start
+   };
+   CaptureStats Stats(int output = 0); //0 is the recording, 1... the previews in the order given to Start
+   int Outputs();                       //files being written, including previews that could be opened
+
+   //Write the instant replay ring to filename on a background thread. The packets are referenced, not
+   //copied, and encoding carries on. Use the container type of the filename passed to Start (its codec
+   //headers are set up for it). Returns false when not recording with replay_seconds.
+   bool SaveReplay(const char* filename);
+
+   //Encode a raw capture (Options::raw) to filename with options, on the calling thread, through the same
+   //encoder setup as a recording. The frame rate comes from the file. Returns 0 on success and 2 while
+   //recording. The FBO demo runs it from the command line, without opening a window:
+   //   --transcode capture.y4m capture.mp4 [crf] [preset]
+   int Transcode(const char* input, const char* filename, const Options& options);
+
+   //Stand-in client for measuring latency: reads the stream at url (the address the stream is sent to) on
+   //a background thread and compares the capture timestamps in it (Options::frame_timestamps) with the
+   //wall clock. This covers capture, readback, encode, mux, transport and demux. The player's decode
+   //and display time come on top. Use it instead of a player when the transport allows one reader (UDP).
+   bool StartLatencyProbe(const char* url);
+   void StopLatencyProbe();
+   float ProbeLatencyMs();  //smoothed
+   int ProbeFrames();       //timestamps received
+
+   //Convert frames to YUV420P with a compute shader before readback (set before Start). Falls back
+   //to BgraToYuv420 on the CPU if the shader can't be built.
+   extern bool ConvertOnGpu;
 };
\ No newline at end of file
@@ -0,0 +1,563 @@
+#include "YuvConvert.h"
+
+extern "C" {
+#include <libswscale/swscale.h>
+}
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define SSE41_TARGET __attribute__((target("sse4.1")))
+#define AVX2_TARGET __attribute__((target("avx2")))
+#else
+#define SSE41_TARGET
+#define AVX2_TARGET
+#endif
+
+//BT.601 limited range coefficients scaled by 2^15, in B, G, R order to match the pixels.
+//Chroma rows sum to 0 so gray stays exactly at 128.
+const int YB = 3208, YG = 16519, YR = 8414;       //219/255 * (0.114, 0.587, 0.299)
+const int UB = 14392, UG = -9535, UR = -4857;     //224/255 * (0.5, -0.331264, -0.168736)
+const int VB = -2340, VG = -12052, VR = 14392;    //224/255 * (-0.081312, -0.418688, 0.5)
+
+//Offset and rounding folded together. Chroma is computed from the sum of a 2x2 block, so
+//it is shifted 2 bits further. Neither sum can go negative or above 255 after the shift.
+const int y_shift = 15;
+const int y_add = (16 << y_shift) + (1 << (y_shift - 1));
+const int c_shift = 17;
+const int c_add = (128 << c_shift) + (1 << (c_shift - 1));
+
+const int rows_per_task = 16;
+
+enum Path { PATH_SCALAR, PATH_SSE41, PATH_AVX2 };
+
+bool HasSse41()
+{
+   static int has_sse41 = -1;
+   if (has_sse41 == -1)
+   {
+#ifdef _MSC_VER
+      int info[4] = { 0 };
+      __cpuid(info, 1);
+      has_sse41 = (info[2] & (1 << 19)) != 0 ? 1 : 0;
+#else
+      has_sse41 = __builtin_cpu_supports("sse4.1") ? 1 : 0;
+#endif
+   }
+   return has_sse41 == 1;
+}
+
+bool HasAvx2()
+{
+   static int has_avx2 = -1;
+   if (has_avx2 == -1)
+   {
+#ifdef _MSC_VER
+      int info[4] = { 0 };
+      __cpuid(info, 1);
+      const bool os_saves_ymm = (info[2] & (1 << 27)) != 0 && (_xgetbv(0) & 6) == 6;
+      __cpuidex(info, 7, 0);
+      const bool avx2 = (info[1] & (1 << 5)) != 0;
+      has_avx2 = (avx2 && os_saves_ymm) ? 1 : 0;
+#else
+      has_avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+#endif
+   }
+   return has_avx2 == 1;
+}
+
+static Path best_path()
+{
+   if (HasAvx2()) return PATH_AVX2;
+   if (HasSse41()) return PATH_SSE41;
+   return PATH_SCALAR;
+}
+
+static inline uint8_t luma(const uint8_t* p)
+{
+   return uint8_t((YB * p[0] + YG * p[1] + YR * p[2] + y_add) >> y_shift);
+}
+
+//Converts pixels [x, width) of a pair of rows
+static void convert_pair_scalar(const uint8_t* s0, const uint8_t* s1, int x, int width,
+                                uint8_t* y0, uint8_t* y1, uint8_t* u, uint8_t* v)
+{
+   for (; x < width; x += 2)
+   {
+      const uint8_t* a = s0 + 4 * x;
+      const uint8_t* b = s1 + 4 * x;
+      y0[x] = luma(a);
+      y0[x + 1] = luma(a + 4);
+      y1[x] = luma(b);
+      y1[x + 1] = luma(b + 4);
+
+      const int sb = a[0] + a[4] + b[0] + b[4];
+      const int sg = a[1] + a[5] + b[1] + b[5];
+      const int sr = a[2] + a[6] + b[2] + b[6];
+      u[x / 2] = uint8_t((UB * sb + UG * sg + UR * sr + c_add) >> c_shift);
+      v[x / 2] = uint8_t((VB * sb + VG * sg + VR * sr + c_add) >> c_shift);
+   }
+}
+
+//4 BGRA pixels to 4 unshifted luma sums
+SSE41_TARGET static inline __m128i luma4_sse41(__m128i px, __m128i coef)
+{
+   const __m128i lo = _mm_cvtepu8_epi16(px);                     //b g r a of pixels 0, 1
+   const __m128i hi = _mm_cvtepu8_epi16(_mm_srli_si128(px, 8));  //pixels 2, 3
+   return _mm_hadd_epi32(_mm_madd_epi16(lo, coef), _mm_madd_epi16(hi, coef));
+}
+
+//Sums the 2x2 blocks of 4 pixels from each of two rows: b g r a of block 0, then block 1
+SSE41_TARGET static inline __m128i sum2x2_sse41(__m128i a, __m128i b)
+{
+   const __m128i lo = _mm_add_epi16(_mm_cvtepu8_epi16(a), _mm_cvtepu8_epi16(b));
+   const __m128i hi = _mm_add_epi16(_mm_cvtepu8_epi16(_mm_srli_si128(a, 8)), _mm_cvtepu8_epi16(_mm_srli_si128(b, 8)));
+   return _mm_unpacklo_epi64(_mm_add_epi16(lo, _mm_srli_si128(lo, 8)), _mm_add_epi16(hi, _mm_srli_si128(hi, 8)));
+}
+
+//4 U and 4 V values from 8 pixels of each of two rows
+SSE41_TARGET static inline void chroma8_sse41(const uint8_t* s0, const uint8_t* s1, uint8_t* u, uint8_t* v)
+{
+   const __m128i ucoef = _mm_setr_epi16(UB, UG, UR, 0, UB, UG, UR, 0);
+   const __m128i vcoef = _mm_setr_epi16(VB, VG, VR, 0, VB, VG, VR, 0);
+   const __m128i add = _mm_set1_epi32(c_add);
+
+   const __m128i q0 = sum2x2_sse41(_mm_loadu_si128((const __m128i*)s0), _mm_loadu_si128((const __m128i*)s1));
+   const __m128i q1 = sum2x2_sse41(_mm_loadu_si128((const __m128i*)(s0 + 16)), _mm_loadu_si128((const __m128i*)(s1 + 16)));
+   __m128i us = _mm_hadd_epi32(_mm_madd_epi16(q0, ucoef), _mm_madd_epi16(q1, ucoef));
+   __m128i vs = _mm_hadd_epi32(_mm_madd_epi16(q0, vcoef), _mm_madd_epi16(q1, vcoef));
+   us = _mm_srai_epi32(_mm_add_epi32(us, add), c_shift);
+   vs = _mm_srai_epi32(_mm_add_epi32(vs, add), c_shift);
+   const __m128i uv = _mm_packus_epi16(_mm_packs_epi32(us, vs), _mm_setzero_si128()); //4 bytes U, 4 bytes V
+
+   const int u4 = _mm_cvtsi128_si32(uv);
+   const int v4 = _mm_cvtsi128_si32(_mm_srli_si128(uv, 4));
+   memcpy(u, &u4, 4);
+   memcpy(v, &v4, 4);
+}
+
+SSE41_TARGET static inline void luma8_sse41(const uint8_t* s, uint8_t* y)
+{
+   const __m128i coef = _mm_setr_epi16(YB, YG, YR, 0, YB, YG, YR, 0);
+   const __m128i add = _mm_set1_epi32(y_add);
+   const __m128i a = _mm_srai_epi32(_mm_add_epi32(luma4_sse41(_mm_loadu_si128((const __m128i*)s), coef), add), y_shift);
+   const __m128i b = _mm_srai_epi32(_mm_add_epi32(luma4_sse41(_mm_loadu_si128((const __m128i*)(s + 16)), coef), add), y_shift);
+   _mm_storel_epi64((__m128i*)y, _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_setzero_si128()));
+}
+
+SSE41_TARGET static void convert_pair_sse41(const uint8_t* s0, const uint8_t* s1, int width,
+                                            uint8_t* y0, uint8_t* y1, uint8_t* u, uint8_t* v)
+{
+   int x = 0;
+   for (; x + 8 <= width; x += 8)
+   {
+      luma8_sse41(s0 + 4 * x, y0 + x);
+      luma8_sse41(s1 + 4 * x, y1 + x);
+      chroma8_sse41(s0 + 4 * x, s1 + 4 * x, u + x / 2, v + x / 2);
+   }
+   convert_pair_scalar(s0, s1, x, width, y0, y1, u, v);
+}
+
+//16 BGRA pixels to 16 luma bytes
+AVX2_TARGET static inline __m128i luma16_avx2(const uint8_t* s)
+{
+   const __m256i coef = _mm256_setr_epi16(YB, YG, YR, 0, YB, YG, YR, 0, YB, YG, YR, 0, YB, YG, YR, 0);
+   const __m256i add = _mm256_set1_epi32(y_add);
+   __m256i sums[2];
+   for (int i = 0; i < 2; i++)
+   {
+      //Each 128-bit lane widens 2 pixels, so hadd leaves pixels in order 0 1 4 5 | 2 3 6 7
+      const __m256i a = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(s + 32 * i)));
+      const __m256i b = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(s + 32 * i + 16)));
+      const __m256i h = _mm256_hadd_epi32(_mm256_madd_epi16(a, coef), _mm256_madd_epi16(b, coef));
+      sums[i] = _mm256_srai_epi32(_mm256_add_epi32(h, add), y_shift);
+   }
+   //Words are now 0 1 4 5 8 9 12 13 | 2 3 6 7 10 11 14 15. Swap the middle qwords, then the
+   //middle dwords of each lane, to restore pixel order before packing to bytes.
+   __m256i w = _mm256_packs_epi32(sums[0], sums[1]);
+   w = _mm256_permute4x64_epi64(w, _MM_SHUFFLE(3, 1, 2, 0));
+   w = _mm256_shuffle_epi32(w, _MM_SHUFFLE(3, 1, 2, 0));
+   const __m256i bytes = _mm256_permute4x64_epi64(_mm256_packus_epi16(w, w), _MM_SHUFFLE(3, 1, 2, 0));
+   return _mm256_castsi256_si128(bytes);
+}
+
+AVX2_TARGET static void convert_pair_avx2(const uint8_t* s0, const uint8_t* s1, int width,
+                                          uint8_t* y0, uint8_t* y1, uint8_t* u, uint8_t* v)
+{
+   int x = 0;
+   for (; x + 16 <= width; x += 16)
+   {
+      _mm_storeu_si128((__m128i*)(y0 + x), luma16_avx2(s0 + 4 * x));
+      _mm_storeu_si128((__m128i*)(y1 + x), luma16_avx2(s1 + 4 * x));
+      chroma8_sse41(s0 + 4 * x, s1 + 4 * x, u + x / 2, v + x / 2);
+      chroma8_sse41(s0 + 4 * x + 32, s1 + 4 * x + 32, u + x / 2 + 4, v + x / 2 + 4);
+   }
+   convert_pair_sse41(s0 + 4 * x, s1 + 4 * x, width - x, y0 + x, y1 + x, u + x / 2, v + x / 2);
+}
+
+//Converts rows [first, last), first and last even
+static void convert_rows(const uint8_t* src, int src_stride, int width, int first, int last,
+                         uint8_t* const dst[3], const int dst_stride[3], Path path)
+{
+   for (int row = first; row < last; row += 2)
+   {
+      const uint8_t* s0 = src + ptrdiff_t(row) * src_stride;
+      const uint8_t* s1 = s0 + src_stride;
+      uint8_t* y0 = dst[0] + ptrdiff_t(row) * dst_stride[0];
+      uint8_t* y1 = y0 + dst_stride[0];
+      uint8_t* u = dst[1] + ptrdiff_t(row / 2) * dst_stride[1];
+      uint8_t* v = dst[2] + ptrdiff_t(row / 2) * dst_stride[2];
+
+      if (path == PATH_AVX2) convert_pair_avx2(s0, s1, width, y0, y1, u, v);
+      else if (path == PATH_SSE41) convert_pair_sse41(s0, s1, width, y0, y1, u, v);
+      else convert_pair_scalar(s0, s1, 0, width, y0, y1, u, v);
+   }
+}
+
+//Persistent workers, so converting a frame doesn't pay for creating threads.
+//Run hands out task indices to the workers and the calling thread, and returns when all are done.
+class RowPool
+{
+public:
+   RowPool() : mTask(nullptr), mCount(0), mNext(0), mBusy(0), mGeneration(0), mQuit(false) {}
+   ~RowPool()
+   {
+      {
+         std::lock_guard<std::mutex> lock(mMutex);
+         mQuit = true;
+      }
+      mStartCv.notify_all();
+      for (std::thread& t : mWorkers) t.join();
+   }
+
+   void Run(int count, const std::function<void(int)>& task)
+   {
+      std::lock_guard<std::mutex> run_lock(mRunMutex); //one frame at a time
+      if (mWorkers.empty())
+      {
+         const int threads = std::min(int(std::thread::hardware_concurrency()), 8);
+         for (int i = 1; i < threads; i++)
+         {
+            mWorkers.push_back(std::thread(&RowPool::worker, this, mGeneration));
+         }
+      }
+      {
+         std::lock_guard<std::mutex> lock(mMutex);
+         mTask = &task;
+         mCount = count;
+         mNext = 0;
+         mBusy = int(mWorkers.size());
+         mGeneration++;
+      }
+      mStartCv.notify_all();
+      work();
+
+      std::unique_lock<std::mutex> lock(mMutex);
+      mDoneCv.wait(lock, [this]() { return mBusy == 0; });
+      mTask = nullptr;
+   }
+
+   int Threads() const { return int(mWorkers.size()) + 1; }
+
+private:
+   void work()
+   {
+      for (int i = mNext++; i < mCount; i = mNext++)
+      {
+         (*mTask)(i);
+      }
+   }
+
+   void worker(unsigned seen)
+   {
+      for (;;)
+      {
+         {
+            std::unique_lock<std::mutex> lock(mMutex);
+            mStartCv.wait(lock, [&]() { return mQuit || mGeneration != seen; });
+            if (mQuit) return;
+            seen = mGeneration;
+         }
+         work();
+         std::lock_guard<std::mutex> lock(mMutex);
+         if (--mBusy == 0) mDoneCv.notify_one();
+      }
+   }
+
+   std::vector<std::thread> mWorkers;
+   std::mutex mRunMutex;
+   std::mutex mMutex; //guards everything below except mNext
+   std::condition_variable mStartCv, mDoneCv;
+   const std::function<void(int)>* mTask;
+   int mCount;
+   std::atomic<int> mNext;
+   int mBusy;
+   unsigned mGeneration;
+   bool mQuit;
+};
+
+static RowPool row_pool;
+
+static void convert(const uint8_t* src, int src_stride, int width, int height,
+                    uint8_t* const dst[3], const int dst_stride[3], Path path, bool threaded)
+{
+   if (threaded == false)
+   {
+      convert_rows(src, src_stride, width, 0, height, dst, dst_stride, path);
+      return;
+   }
+   const int tasks = (height + rows_per_task - 1) / rows_per_task;
+   row_pool.Run(tasks, [&](int i)
+   {
+      const int first = i * rows_per_task;
+      convert_rows(src, src_stride, width, first, std::min(first + rows_per_task, height), dst, dst_stride, path);
+   });
+}
+
+void BgraToYuv420(const uint8_t* src, int src_stride, int width, int height,
+                  uint8_t* const dst[3], const int dst_stride[3])
+{
+   static const Path path = best_path();
+   convert(src, src_stride, width, height, dst, dst_stride, path, true);
+}
+
+void BgraToYuv420Scalar(const uint8_t* src, int src_stride, int width, int height,
+                        uint8_t* const dst[3], const int dst_stride[3])
+{
+   convert(src, src_stride, width, height, dst, dst_stride, PATH_SCALAR, false);
+}
+
+void UpscalePlane2x(const uint8_t* src, int src_stride, int width, int height, uint8_t* dst, int dst_stride)
+{
+   for (int y = 0; y < height; y++)
+   {
+      const uint8_t* s = src + ptrdiff_t(y) * src_stride;
+      uint8_t* d = dst + ptrdiff_t(2 * y) * dst_stride;
+      for (int x = 0; x < width; x++)
+      {
+         d[2 * x] = s[x];
+         d[2 * x + 1] = s[x];
+      }
+      memcpy(d + dst_stride, d, 2 * width);
+   }
+}
+
+void BenchmarkYuvConversion(int width, int height)
+{
+   const int stride = 4 * width;
+   std::vector<uint8_t> bgra(size_t(stride) * height);
+   uint32_t seed = 12345;
+   for (int y = 0; y < height; y++)
+   {
+      for (int x = 0; x < width; x++)
+      {
+         //Smooth gradients with some noise, and saturated values in both corners
+         seed = seed * 1664525u + 1013904223u;
+         uint8_t* p = &bgra[size_t(y) * stride + 4 * x];
+         const int noise = int(seed >> 28) - 8;
+         p[0] = uint8_t(std::min(255, std::max(0, 255 * x / width + noise)));
+         p[1] = uint8_t(std::min(255, std::max(0, 255 * y / height + noise)));
+         p[2] = uint8_t((seed >> 8) & 0xff);
+         p[3] = 255;
+      }
+   }
+   //flip, as on the recording path
+   const uint8_t* src = &bgra[size_t(stride) * (height - 1)];
+
+   const int dst_stride[3] = { width, width / 2, width / 2 };
+   const size_t ysize = size_t(width) * height;
+   std::vector<uint8_t> reference(ysize * 3 / 2), out(ysize * 3 / 2);
+   uint8_t* const ref_planes[3] = { &reference[0], &reference[ysize], &reference[ysize + ysize / 4] };
+   uint8_t* const out_planes[3] = { &out[0], &out[ysize], &out[ysize + ysize / 4] };
+
+   typedef std::chrono::high_resolution_clock clock;
+   const int reps = 5;
+   auto time_ms = [&](auto&& fn)
+   {
+      double best = 1e30;
+      for (int r = 0; r < reps; r++)
+      {
+         auto t0 = clock::now();
+         fn();
+         auto t1 = clock::now();
+         best = std::min(best, std::chrono::duration<double, std::milli>(t1 - t0).count());
+      }
+      return best;
+   };
+
+   const double mpix = double(ysize) / 1.0e6;
+   auto report = [&](std::string name, double ms)
+   {
+      name.resize(19, ' ');
+      std::cout << "   " << name << ms << " ms (" << mpix / (ms * 1e-3) << " Mpixel/s)";
+   };
+
+   std::cout << "BGRA to YUV420P, " << width << "x" << height << ", " << row_pool.Threads() << " threads:" << std::endl;
+   report("scalar:", time_ms([&]() { BgraToYuv420Scalar(src, -stride, width, height, ref_planes, dst_stride); }));
+   std::cout << std::endl;
+
+   const Path paths[] = { PATH_SSE41, PATH_AVX2 };
+   const char* names[] = { "SSE4.1", "AVX2" };
+   const bool supported[] = { HasSse41(), HasAvx2() };
+   for (int i = 0; i < 2; i++)
+   {
+      if (supported[i] == false)
+      {
+         std::cout << "   " << names[i] << ": not supported by this CPU" << std::endl;
+         continue;
+      }
+      for (int threaded = 0; threaded < 2; threaded++)
+      {
+         std::fill(out.begin(), out.end(), 0);
+         const double ms = time_ms([&]() { convert(src, -stride, width, height, out_planes, dst_stride, paths[i], threaded != 0); });
+         report(std::string(names[i]) + (threaded ? ", threaded:" : ":"), ms);
+         std::cout << (out == reference ? "  matches scalar" : "  MISMATCH with scalar") << std::endl;
+      }
+   }
+
+   //swscale rounds and filters chroma differently, so expect small differences there
+   SwsContext* sws = sws_getContext(width, height, AV_PIX_FMT_RGB32, width, height, AV_PIX_FMT_YUV420P, 0, NULL, NULL, NULL);
+   if (sws == nullptr)
+   {
+      std::cout << "   sws_scale: could not create context" << std::endl;
+      return;
+   }
+   const int src_stride[1] = { -stride };
+   report("sws_scale:", time_ms([&]() { sws_scale(sws, &src, src_stride, 0, height, out_planes, dst_stride); }));
+   sws_freeContext(sws);
+
+   int max_diff[3] = { 0, 0, 0 };
+   const size_t plane_begin[4] = { 0, ysize, ysize + ysize / 4, ysize * 3 / 2 };
+   for (int p = 0; p < 3; p++)
+   {
+      for (size_t i = plane_begin[p]; i < plane_begin[p + 1]; i++)
+      {
+         max_diff[p] = std::max(max_diff[p], std::abs(int(out[i]) - int(reference[i])));
+      }
+   }
+   std::cout << "  max difference Y " << max_diff[0] << ", U " << max_diff[1] << ", V " << max_diff[2] << std::endl;
+}
+
+//Fills a test image: 0 smooth gradients, 1 noise in every channel, 2 blocks of saturated colors
+static void fill_test_image(std::vector<uint8_t>& bgra, int width, int height, int pattern)
+{
+   static const uint8_t colors[8][3] = { {0, 0, 0}, {255, 255, 255}, {0, 0, 255}, {0, 255, 0}, {255, 0, 0}, {255, 255, 0}, {0, 255, 255}, {255, 0, 255} };
+   bgra.resize(size_t(4) * width * height);
+   uint32_t seed = 12345;
+   for (int y = 0; y < height; y++)
+   {
+      for (int x = 0; x < width; x++)
+      {
+         seed = seed * 1664525u + 1013904223u;
+         uint8_t* p = &bgra[(size_t(y) * width + x) * 4];
+         if (pattern == 0)
+         {
+            p[0] = uint8_t(255 * x / width);
+            p[1] = uint8_t(255 * y / height);
+            p[2] = uint8_t(255 - 255 * (x + y) / (width + height));
+         }
+         else if (pattern == 1)
+         {
+            p[0] = uint8_t(seed >> 24);
+            p[1] = uint8_t(seed >> 16);
+            p[2] = uint8_t(seed >> 8);
+         }
+         else
+         {
+            const uint8_t* c = colors[(x / 6 + y / 4) % 8];
+            p[0] = c[0];
+            p[1] = c[1];
+            p[2] = c[2];
+         }
+         p[3] = 255;
+      }
+   }
+}
+
+int YuvSelfTest()
+{
+   //Widths that aren't multiples of 8 or 16 exercise the scalar tails of the SIMD paths
+   const int sizes[][2] = { { 1920, 1080 }, { 1282, 722 }, { 38, 6 } };
+   const char* pattern_names[] = { "gradients", "noise", "saturated colors" };
+   const Path paths[] = { PATH_SSE41, PATH_AVX2 };
+   const bool supported[] = { HasSse41(), HasAvx2() };
+   int failures = 0;
+
+   for (const auto& size : sizes)
+   {
+      const int width = size[0], height = size[1];
+      const size_t ysize = size_t(width) * height;
+      const int dst_stride[3] = { width, width / 2, width / 2 };
+      const size_t plane_begin[4] = { 0, ysize, ysize + ysize / 4, ysize * 3 / 2 };
+      std::vector<uint8_t> bgra, reference(ysize * 3 / 2), out(ysize * 3 / 2);
+      uint8_t* const ref_planes[3] = { &reference[0], &reference[ysize], &reference[ysize + ysize / 4] };
+      uint8_t* const out_planes[3] = { &out[0], &out[ysize], &out[ysize + ysize / 4] };
+
+      //Same flags in every run, so a failure here is a change in our kernels or in the library
+      SwsContext* sws = sws_getContext(width, height, AV_PIX_FMT_RGB32, width, height, AV_PIX_FMT_YUV420P,
+                                       SWS_AREA | SWS_ACCURATE_RND | SWS_BITEXACT, NULL, NULL, NULL);
+      if (sws == nullptr)
+      {
+         std::cout << "YUV self-test: could not create a swscale context" << std::endl;
+         return 1;
+      }
+      const int* coefs = sws_getCoefficients(SWS_CS_ITU601);
+      sws_setColorspaceDetails(sws, coefs, 1, coefs, 0, 0, 1 << 16, 1 << 16); //full range RGB in, limited range YUV out
+
+      for (int pattern = 0; pattern < 3; pattern++)
+      {
+         fill_test_image(bgra, width, height, pattern);
+         const uint8_t* src = &bgra[size_t(4) * width * (height - 1)]; //flipped, as on the recording path
+         const int src_stride = -4 * width;
+         BgraToYuv420Scalar(src, src_stride, width, height, ref_planes, dst_stride);
+
+         for (int i = 0; i < 2; i++)
+         {
+            for (int threaded = 0; threaded < 2 && supported[i]; threaded++)
+            {
+               std::fill(out.begin(), out.end(), 0);
+               convert(src, src_stride, width, height, out_planes, dst_stride, paths[i], threaded != 0);
+               if (out != reference)
+               {
+                  std::cout << "FAIL " << width << "x" << height << " " << pattern_names[pattern] << ": path " << i
+                            << (threaded ? " threaded" : "") << " differs from scalar" << std::endl;
+                  failures++;
+               }
+            }
+         }
+
+         sws_scale(sws, &src, &src_stride, 0, height, out_planes, dst_stride);
+         int max_diff[3] = { 0, 0, 0 };
+         for (int p = 0; p < 3; p++)
+         {
+            for (size_t j = plane_begin[p]; j < plane_begin[p + 1]; j++)
+            {
+               max_diff[p] = std::max(max_diff[p], std::abs(int(out[j]) - int(reference[j])));
+            }
+         }
+         const bool ok = std::max(max_diff[0], std::max(max_diff[1], max_diff[2])) <= YuvTolerance;
+         std::cout << (ok ? "ok   " : "FAIL ") << width << "x" << height << " " << pattern_names[pattern]
+                   << ": max difference from sws_scale Y " << max_diff[0] << ", U " << max_diff[1] << ", V " << max_diff[2] << std::endl;
+         failures += ok ? 0 : 1;
+      }
+      sws_freeContext(sws);
+   }
+
+   std::cout << (failures == 0 ? "YUV self-test passed" : "YUV self-test FAILED") << std::endl;
+   return failures == 0 ? 0 : 1;
+}
@@ -1,4 +1,5 @@
 #version 430            
+#extension GL_ARB_shader_draw_parameters : enable
 layout(location = 0) uniform mat4 M;
 layout(location = 1) uniform float time;
 
@@ -11,8 +12,26 @@ layout(std140, binding = 0) uniform SceneUniforms
 layout(location = 0) in vec3 pos_attrib; //this variable holds the position of mesh vertices
 layout(location = 1) in vec2 tex_coord_attrib;
 layout(location = 2) in vec3 normal_attrib;  
-layout (location = 3) in vec4 color;
-layout (location = 4) in mat4 model_matrix;
+
+//Mirrors InstanceBuffer::Instance
+struct Instance
+{
+   mat4 model_matrix;
+   vec4 color;
+   int material;
+   int layer;
+};
+
+layout(std430, binding = 0) readonly buffer InstanceData
+{
+   Instance instances[];
+};
+
+#ifdef GL_ARB_shader_draw_parameters
+#define BASE_INSTANCE gl_BaseInstanceARB
+#else
+#define BASE_INSTANCE 0 //Scene draws all instances in one call starting at instance 0. More draws would need the base instance passed in a uniform, as in the FBO demo.
+#endif
 
 out vec4 instcolor;
 
@@ -25,12 +44,13 @@ out VertexData
 
 void main(void)
 {
-	gl_Position = PV*M*model_matrix*vec4(pos_attrib, 1.0); //transform vertices and send result into pipeline
+	Instance instance = instances[gl_InstanceID + BASE_INSTANCE];
+	gl_Position = PV*M*instance.model_matrix*vec4(pos_attrib, 1.0); //transform vertices and send result into pipeline
 	//gl_Position = PV*M*vec4(pos_attrib.x+3*color.x,pos_attrib.y+3*color.y,pos_attrib.z+3*color.z, 1.0);
 	//Use dot notation to access members of the interface block
 	outData.tex_coord = tex_coord_attrib;           //send tex_coord to fragment shader
 	outData.pw = vec3(M*vec4(pos_attrib, 1.0));		//world-space vertex position
 	outData.nw = vec3(M*vec4(normal_attrib, 0.0));	//world-space normal vector
 
-	instcolor=color;
+	instcolor=instance.color;
 }
\ No newline at end of file
@@ -1,7 +1,13 @@
 #version 430
 layout(binding = 0) uniform sampler2D diffuse_tex; 
+layout(binding = 1) uniform sampler2D environment_tex; //equirectangular HDR map, nothing bound turns it off
 layout(location = 1) uniform float time;
+//MODE may be compiled in as a #define (see ShaderVariants), which removes the branches on mode.
+#ifdef MODE
+const int mode = MODE;
+#else
 layout(location = 2) uniform int mode;
+#endif
 
 layout(std140, binding = 0) uniform SceneUniforms
 {
@@ -35,6 +41,14 @@ in VertexData
 
 out vec4 fragcolor; //the output color for this fragment    
 
+//Radiance from direction dir (world space, y up). Coarser mip levels stand in for blurrier lobes.
+vec4 environment(vec3 dir, float lod)
+{
+   const float pi = 3.1415926535;
+   vec2 uv = vec2(atan(dir.z, dir.x)/(2.0*pi) + 0.5, asin(clamp(dir.y, -1.0, 1.0))/pi + 0.5);
+   return textureLod(environment_tex, uv, lod); //explicit lod, so no seam where atan wraps
+}
+
 void main(void)
 {   
    //Compute per-fragment Phong lighting
@@ -72,6 +86,11 @@ void main(void)
 	  specular_term *= G;
    }
 
-   fragcolor = ambient_term + diffuse_term + specular_term;
+   //Image based lighting: a very blurred level for the diffuse part, sharper levels for smoother surfaces
+   float levels = float(textureQueryLevels(environment_tex));
+   vec4 Fenv = F0+(1-F0)*pow(1-max(0.0,dot(nw,vw)),5);
+   vec4 environment_term = kd*environment(nw, levels-3.0) + Fenv*ks*environment(reflect(-vw, nw), m*(levels-1.0));
+
+   fragcolor = ambient_term + diffuse_term + specular_term + environment_term;
 }
 
@@ -1,5 +1,4 @@
 #version 430            
-layout(location = 0) uniform mat4 M;
 layout(location = 1) uniform float time;
 
 layout(std140, binding = 0) uniform SceneUniforms
@@ -8,6 +7,11 @@ layout(std140, binding = 0) uniform SceneUniforms
    vec4 eye_w;	//world-space eye position
 };
 
+layout(std140, binding = 3) uniform ObjectUniforms
+{
+   mat4 M;	//model matrix, streamed through UniformRing per draw
+};
+
 layout(location = 0) in vec3 pos_attrib; //this variable holds the position of mesh vertices
 layout(location = 1) in vec2 tex_coord_attrib;
 layout(location = 2) in vec3 normal_attrib;  
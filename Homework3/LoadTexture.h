@@ -2,11 +2,23 @@
 #define __LOADTEXTURE_H__
 
 #include <string>
+#include <vector>
 #include <windows.h>
 #include "GL/glew.h"
 #include "GL/gl.h"
 
+//Both texture loaders return 0, which binds no texture, if the file could not be loaded
 GLuint LoadTexture(const std::string& fname);
 
+//Decode an image file to tightly packed 32-bit BGRA rows. Returns false if the file could not be loaded.
+bool LoadImageBGRA(const std::string& fname, std::vector<GLubyte>& bytes, GLuint& w, GLuint& h);
+
+//Load a floating point image (e.g. .hdr or .exr). internal_format may be GL_RGBA16F, GL_RGB9_E5 or GL_RGBA32F.
+//GL_RGBA16F halves memory compared to GL_RGBA32F, GL_RGB9_E5 quarters it but drops alpha and negative values.
+GLuint LoadHdrTexture(const std::string& fname, GLenum internal_format = GL_RGBA16F);
+
+//Decode an image file to 32-bit float RGBA pixels. Returns false if the file could not be loaded.
+bool LoadImageRGBAF(const std::string& fname, std::vector<float>& pixels, GLuint& w, GLuint& h);
+
 
 #endif
\ No newline at end of file
@@ -1,6 +1,7 @@
 
 
 #include <windows.h>
+#include "TextureStreaming.h" //includes glew, which has to come before gl.h
 #include "Callbacks.h"
 #include "Scene.h"
 
@@ -55,6 +56,7 @@ int main(int argc, char **argv)
       /* Poll for and process events */
       glfwPollEvents();
    }
+   TextureStreaming::Shutdown(); //waits for loads in flight and frees the textures while the context still exists
 
     // Cleanup ImGui
     ImGui_ImplOpenGL3_Shutdown();
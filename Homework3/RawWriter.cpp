@@ -0,0 +1,229 @@
+#include "RawWriter.h"
+
+#include <windows.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+struct RawWriter::Chunk
+{
+   uint8_t* data;          //ChunkSize bytes, page aligned
+   OVERLAPPED overlapped;
+   HANDLE event;           //signaled when the write finishes
+   bool pending;           //write in flight
+};
+
+//SetFileValidData needs SE_MANAGE_VOLUME_NAME. Administrators hold it, but it isn't enabled by default.
+static bool enable_manage_volume_privilege()
+{
+   static int enabled = -1;
+   if (enabled != -1) return enabled == 1;
+
+   enabled = 0;
+   HANDLE token;
+   if (OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token))
+   {
+      TOKEN_PRIVILEGES privileges = {};
+      privileges.PrivilegeCount = 1;
+      privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+      //AdjustTokenPrivileges succeeds without assigning privileges the token doesn't have
+      if (LookupPrivilegeValueA(NULL, "SeManageVolumePrivilege", &privileges.Privileges[0].Luid) &&
+         AdjustTokenPrivileges(token, FALSE, &privileges, 0, NULL, NULL) && GetLastError() == ERROR_SUCCESS)
+      {
+         enabled = 1;
+      }
+      CloseHandle(token);
+   }
+   return enabled == 1;
+}
+
+RawWriter::RawWriter() : mFile(nullptr), mChunks(nullptr), mCurrent(0), mFill(0), mOffset(0), mReserved(0),
+   mPreallocate(0), mUnbuffered(false), mValidData(false), mFailed(false), mBytes(0), mCompleted(0),
+   mWaitMs(0.0f), mSeconds(0.0f)
+{
+}
+
+RawWriter::~RawWriter()
+{
+   Close();
+}
+
+bool RawWriter::Open(const char* filename, int64_t preallocate, bool valid_data)
+{
+   Close();
+
+   HANDLE file = CreateFileA(filename, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS,
+      FILE_FLAG_OVERLAPPED | FILE_FLAG_NO_BUFFERING | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+   mUnbuffered = (file != INVALID_HANDLE_VALUE);
+   if (file == INVALID_HANDLE_VALUE)
+   {
+      //e.g. a network share that doesn't report its sector size
+      file = CreateFileA(filename, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_FLAG_OVERLAPPED, NULL);
+   }
+   if (file == INVALID_HANDLE_VALUE)
+   {
+      fprintf(stderr, "Could not open '%s' for raw capture (error %lu)\n", filename, (unsigned long)GetLastError());
+      return false;
+   }
+
+   mFile = file;
+   mChunks = new Chunk[NumChunks];
+   for (int i = 0; i < NumChunks; i++)
+   {
+      Chunk& chunk = mChunks[i];
+      chunk.data = (uint8_t*)VirtualAlloc(NULL, ChunkSize, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+      chunk.event = CreateEventA(NULL, TRUE, FALSE, NULL);
+      chunk.pending = false;
+   }
+   mCurrent = 0;
+   mFill = 0;
+   mOffset = 0;
+   mReserved = 0;
+   mPreallocate = std::max<int64_t>(preallocate, ChunkSize);
+   mValidData = (valid_data == true && enable_manage_volume_privilege());
+   mFailed = false;
+   mBytes = 0;
+   mCompleted = 0;
+   mWaitMs = 0.0f;
+   mSeconds = 0.0f;
+   mStart = std::chrono::steady_clock::now();
+   reserve(mPreallocate);
+   if (valid_data == true && mValidData == false)
+   {
+      printf("'%s': SeManageVolumePrivilege unavailable, raw writes past the written data complete synchronously\n", filename);
+   }
+   return true;
+}
+
+//Writes that extend the file, or go past its valid data length (the bytes it guarantees to have
+//zeroed or written), complete synchronously however they are issued. Moving both ahead of the data
+//keeps the writes overlapped. By default, or without the privilege, only the end of file moves, which
+//still saves the file system from allocating every chunk separately.
+bool RawWriter::reserve(int64_t size)
+{
+   FILE_END_OF_FILE_INFO end_of_file;
+   end_of_file.EndOfFile.QuadPart = size;
+   if (!SetFileInformationByHandle(mFile, FileEndOfFileInfo, &end_of_file, sizeof(end_of_file)))
+   {
+      return false;
+   }
+   if (mValidData == true)
+   {
+      mValidData = (SetFileValidData(mFile, size) != 0);
+   }
+   mReserved = size;
+   return true;
+}
+
+bool RawWriter::Write(const void* data, size_t size)
+{
+   if (mFile == nullptr || mFailed == true) return false;
+
+   const uint8_t* src = (const uint8_t*)data;
+   while (size > 0)
+   {
+      const size_t n = std::min(size, ChunkSize - mFill);
+      memcpy(mChunks[mCurrent].data + mFill, src, n);
+      mFill += n;
+      src += n;
+      size -= n;
+      mBytes += n;
+      if (mFill == ChunkSize && submit(ChunkSize) == false)
+      {
+         return false;
+      }
+   }
+   return true;
+}
+
+//Start writing the current chunk, then make the next one current. Unbuffered writes must be whole
+//sectors, so a partial chunk (the end of the file) is padded and Close cuts the file back.
+bool RawWriter::submit(size_t size)
+{
+   Chunk& chunk = mChunks[mCurrent];
+   const size_t aligned = (size + Alignment - 1) & ~(Alignment - 1);
+   memset(chunk.data + size, 0, aligned - size);
+   if (mOffset + int64_t(aligned) > mReserved)
+   {
+      reserve(mReserved + mPreallocate);
+   }
+
+   memset(&chunk.overlapped, 0, sizeof(chunk.overlapped));
+   chunk.overlapped.Offset = DWORD(mOffset);
+   chunk.overlapped.OffsetHigh = DWORD(mOffset >> 32);
+   chunk.overlapped.hEvent = chunk.event;
+   ResetEvent(chunk.event);
+   if (!WriteFile(mFile, chunk.data, DWORD(aligned), NULL, &chunk.overlapped) && GetLastError() != ERROR_IO_PENDING)
+   {
+      fprintf(stderr, "Raw capture write failed at %lld bytes (error %lu)\n", (long long)mOffset, (unsigned long)GetLastError());
+      mFailed = true;
+      return false;
+   }
+   chunk.pending = true;
+   mOffset += aligned;
+
+   mCurrent = (mCurrent + 1) % NumChunks;
+   mFill = 0;
+   return complete(mChunks[mCurrent]);
+}
+
+//Wait for the chunk's write, if one is in flight
+bool RawWriter::complete(Chunk& chunk)
+{
+   if (chunk.pending == false) return true;
+
+   const auto wait_start = std::chrono::steady_clock::now();
+   DWORD written = 0;
+   const BOOL ok = GetOverlappedResult(mFile, &chunk.overlapped, &written, TRUE);
+   chunk.pending = false;
+   mWaitMs = mWaitMs + std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - wait_start).count();
+   mCompleted += written;
+   if (!ok)
+   {
+      fprintf(stderr, "Raw capture write failed (error %lu)\n", (unsigned long)GetLastError());
+      mFailed = true;
+      return false;
+   }
+   return true;
+}
+
+bool RawWriter::Close()
+{
+   if (mFile == nullptr) return true;
+
+   if (mFill > 0 && mFailed == false)
+   {
+      submit(mFill);
+   }
+   for (int i = 0; i < NumChunks; i++)
+   {
+      complete(mChunks[i]);
+   }
+   mSeconds = std::chrono::duration<float>(std::chrono::steady_clock::now() - mStart).count();
+
+   //Drop the padding and the space reserved ahead
+   FILE_END_OF_FILE_INFO end_of_file;
+   end_of_file.EndOfFile.QuadPart = mBytes;
+   SetFileInformationByHandle(mFile, FileEndOfFileInfo, &end_of_file, sizeof(end_of_file));
+   CloseHandle(mFile);
+   mFile = nullptr;
+
+   for (int i = 0; i < NumChunks; i++)
+   {
+      VirtualFree(mChunks[i].data, 0, MEM_RELEASE);
+      CloseHandle(mChunks[i].event);
+   }
+   delete[] mChunks;
+   mChunks = nullptr;
+   return mFailed == false;
+}
+
+float RawWriter::MBPerSec() const
+{
+   float seconds = mSeconds;
+   if (mFile != nullptr)
+   {
+      seconds = std::chrono::duration<float>(std::chrono::steady_clock::now() - mStart).count();
+   }
+   return seconds > 0.0f ? float(mCompleted / 1048576.0 / seconds) : 0.0f;
+}
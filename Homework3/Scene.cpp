@@ -18,12 +18,18 @@
 #include <fstream>
 #include <sstream>
 #include <string>
+#include <vector>
 
 #include "Scene.h"
 #include "Uniforms.h"
+#include "UniformRing.h"   //Per-frame uniform data
+#include "UniformBlocks.h" //Light and material uniform blocks
 #include "InitShader.h"    //Functions for loading shaders from text files
+#include "ShaderWatcher.h"  //Rebuilds shaders when their files change
 #include "LoadMesh.h"      //Functions for creating OpenGL buffers from mesh files
 #include "LoadTexture.h"   //Functions for creating OpenGL textures from image files
+#include "TextureStreaming.h" //Streams texture mip levels based on screen size
+#include "HalfFloat.h"     //Float to half conversion for HDR textures
 #include "VideoRecorder.h"      //Functions for saving videos
 #include "DebugCallback.h"
 
@@ -34,16 +40,32 @@ static const std::string vertex_shader("Homework3_vs.glsl");
 static const std::string fragment_shader("Homework3_fs.glsl");
 GLuint shader_program = -1;
 
+//Reports C++ structs that don't match the uniform blocks the program declares
+static void ValidateProgram(GLuint program)
+{
+   if (program == -1) return;
+   UniformBlocks::Validate(program);
+}
+
+//Specialized programs with the lighting mode compiled in. shader_program branches on the mode uniform instead.
+ShaderVariants shader_variants(vertex_shader, fragment_shader, ValidateProgram);
+bool use_variants = true;
+
 static const std::string mesh_name = "teapot.obj";
 static const std::string texture_name = "AmagoT.bmp";
+static const std::string environment_name = "environment.hdr";
 
-GLuint texture_id = -1; //Texture map for mesh
+int texture_handle = -1; //Streamed texture map for mesh
+GLuint environment_tex = 0; //HDR lighting, GL_RGB9_E5
+bool use_environment = true;
 MeshData mesh_data;
 
 int light_mode = 0;
 float angle = 0.0f;
 float scale = 1.0f;
 bool recording = false;
+bool offline_capture = false;  //fixed timestep and no vsync while recording
+double capture_start_sec = 0.0;
 
 namespace Scene
 {
@@ -73,15 +95,41 @@ void Scene::Display(GLFWwindow* window)
 
    Camera::V = glm::lookAt(glm::vec3(Uniforms::SceneData.eye_w), glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
    Uniforms::SceneData.PV = Camera::P * Camera::V;
+   UniformRing::BeginFrame();
    Uniforms::BufferSceneData();
+   UniformBlocks::Update(); //light and material, when the GUI has changed them
 
-   glUseProgram(shader_program);
-   //Note that we don't need to set the value of a uniform here. The value is set with the "binding" in the layout qualifier
-   glBindTextureUnit(0, texture_id);
+   GLuint program = -1;
+   if (use_variants == true)
+   {
+      program = shader_variants.Get({ "MODE " + std::to_string(light_mode) });
+   }
+   if (program == -1)
+   {
+      program = shader_program;
+   }
+   glUseProgram(program);
+   if (program == shader_program)
+   {
+      glUniform1i(Uniforms::UniformLocs::mode, light_mode);
+   }
 
    //Set uniforms
    glm::mat4 M = glm::translate(glm::vec3(0.0f, -0.5f, 0.0f))*glm::rotate(angle, glm::vec3(0.0f, 1.0f, 0.0f)) * glm::scale(glm::vec3(scale * mesh_data.mScaleFactor));
-   glUniformMatrix4fv(Uniforms::UniformLocs::M, 1, false, glm::value_ptr(M));
+
+   //Only keep the mip levels the mesh needs at its current size on screen
+   int w, h;
+   glfwGetFramebufferSize(window, &w, &h);
+   glm::vec3 bb_min(mesh_data.mBbMin.x, mesh_data.mBbMin.y, mesh_data.mBbMin.z);
+   glm::vec3 bb_max(mesh_data.mBbMax.x, mesh_data.mBbMax.y, mesh_data.mBbMax.z);
+   TextureStreaming::Request(texture_handle, TextureStreaming::EstimateLod(texture_handle, bb_min, bb_max, Uniforms::SceneData.PV * M, w, h));
+   TextureStreaming::Update();
+
+   //Note that we don't need to set the value of a uniform here. The value is set with the "binding" in the layout qualifier
+   glBindTextureUnit(0, TextureStreaming::TextureId(texture_handle));
+   glBindTextureUnit(1, use_environment == true ? environment_tex : 0); //0 if it failed to load
+   Uniforms::ObjectData.M = M;
+   Uniforms::BufferObjectData(); //the same for every variant, unlike a uniform set on the program
 
    glBindVertexArray(mesh_data.mVao);
    mesh_data.DrawMesh();
@@ -91,13 +139,14 @@ void Scene::Display(GLFWwindow* window)
 
    if (recording == true)
    {
-      glFinish();
       glReadBuffer(GL_BACK);
       int w, h;
       glfwGetFramebufferSize(window, &w, &h);
       VideoRecorder::EncodeBuffer(GL_BACK);
    }
 
+   UniformRing::EndFrame();
+
    /* Swap front and back buffers */
    glfwSwapBuffers(window);
 }
@@ -130,6 +179,11 @@ void Scene::DrawGui(GLFWwindow* window)
          const int fps = 60;
          const int bitrate = 4000000;
          VideoRecorder::Start(video_filename, w, h, fps, bitrate); //Uses ffmpeg
+         if (offline_capture == true)
+         {
+            capture_start_sec = glfwGetTime();
+            glfwSwapInterval(0); //render as fast as the encoder accepts frames
+         }
       }
    }
    else
@@ -138,40 +192,75 @@ void Scene::DrawGui(GLFWwindow* window)
       {
          recording = false;
          VideoRecorder::Stop(); //Uses ffmpeg
+         if (offline_capture == true)
+         {
+            glfwSetTime(capture_start_sec + VideoRecorder::FrameTime()); //carry on from the end of the video
+            glfwSwapInterval(1);
+         }
       }
    }
    ImGui::SameLine();
    ImGui::InputText("Video filename", video_filename, filename_len);
+   if (recording == false)
+   {
+      ImGui::Checkbox("Offline capture (fixed timestep, no vsync)", &offline_capture);
+      ImGui::Checkbox("Convert to YUV on the GPU", &VideoRecorder::ConvertOnGpu);
+   }
+   else
+   {
+      ImGui::Text("Recording: %.1f frames/s, %.3f ms/frame on the render thread, %d frames queued, %d readback buffers",
+         VideoRecorder::CaptureFps(), VideoRecorder::RenderThreadMs(), VideoRecorder::QueuedFrames(), VideoRecorder::ReadbackBuffers());
+      const VideoRecorder::CaptureStats stats = VideoRecorder::Stats();
+      ImGui::Text("   wait %.2f ms, convert %.2f ms, encode %.2f ms, mux %.2f ms, %d dropped, %d at half resolution",
+         stats.wait_ms, stats.convert_ms, stats.encode_ms, stats.mux_ms, stats.dropped, stats.half_res);
+   }
 
 
    ImGui::SliderFloat("View angle", &angle, -glm::pi<float>(), +glm::pi<float>());
    ImGui::SliderFloat("Scale", &scale, -10.0f, +10.0f);
 
-   if (ImGui::ColorEdit4("Ka", &Uniforms::MaterialData.ka[0])) {
-       Uniforms::BufferMaterialData();
-   }
+   ImGui::ColorEdit4("Ka", &Uniforms::MaterialData.ka[0]);
 
-   if (ImGui::ColorEdit4("Kd", &Uniforms::MaterialData.kd[0])) {
-       Uniforms::BufferMaterialData();
-   }
+   ImGui::ColorEdit4("Kd", &Uniforms::MaterialData.kd[0]);
 
-   if (ImGui::ColorEdit4("Ks", &Uniforms::MaterialData.ks[0])) {
-       Uniforms::BufferMaterialData();
-   }
+   ImGui::ColorEdit4("Ks", &Uniforms::MaterialData.ks[0]);
 
    ImGui::Text("Mode ="); ImGui::SameLine();
    ImGui::RadioButton("full lighting", &light_mode, 0); ImGui::SameLine();
    ImGui::RadioButton("Only F", &light_mode, 1); ImGui::SameLine();
    ImGui::RadioButton("Only D", &light_mode, 2); ImGui::SameLine();
    ImGui::RadioButton("Only G", &light_mode, 3);
-   glUniform1i(Uniforms::UniformLocs::mode, light_mode);
+   ImGui::Checkbox("Specialized shader variants", &use_variants);
+   ImGui::SameLine();
+   ImGui::Text("(%d built, %d compiling)", shader_variants.NumVariants(), shader_variants.NumPending());
+   ImGui::Checkbox("HDR environment lighting", &use_environment);
 
-   if (ImGui::ColorEdit4("F0", &Uniforms::MaterialData.F0[0])) {
-       Uniforms::BufferMaterialData();
+   ImGui::ColorEdit4("F0", &Uniforms::MaterialData.F0[0]);
+
+   ImGui::SliderFloat("m", &Uniforms::MaterialData.m, 0.0f, +1.0f);
+
+   if (ImGui::CollapsingHeader("Texture streaming"))
+   {
+      const float mb = 1.0f / (1024.0f * 1024.0f);
+      static float budget_mb = TextureStreaming::GetBudget() * mb;
+      if (ImGui::SliderFloat("Budget (MB)", &budget_mb, 0.0f, 256.0f))
+      {
+         TextureStreaming::SetBudget(size_t(budget_mb / mb));
+      }
+      ImGui::Text("Resident: %.2f MB", TextureStreaming::ResidentBytes() * mb);
+
+      std::vector<TextureStreaming::Stats> stats;
+      TextureStreaming::GetStats(stats);
+      for (const TextureStreaming::Stats& s : stats)
+      {
+         ImGui::Text("%s (%dx%d): level %d of %d, requested %d", s.filename.c_str(), s.width, s.height, s.resident_level, s.num_levels, s.requested_level);
+         ImGui::Text("   resident %.2f MB, requested %.2f MB", s.resident_bytes * mb, s.requested_bytes * mb);
+      }
    }
 
-   if (ImGui::SliderFloat("m", &Uniforms::MaterialData.m, 0.0f, +1.0f)) {
-       Uniforms::BufferMaterialData();
+   if (ImGui::Button("Benchmark HDR conversion"))
+   {
+      BenchmarkHalfConversion(2048, 1024); //size of a typical equirectangular environment map
    }
 
    if (ImGui::Button("Show ImGui Demo Window"))
@@ -192,21 +281,34 @@ void Scene::DrawGui(GLFWwindow* window)
    ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
 }
 
+//Offline capture advances exactly one video frame per rendered frame, whatever the wall clock says
+static double scene_time()
+{
+   if (recording == true && offline_capture == true)
+   {
+      return capture_start_sec + VideoRecorder::FrameTime();
+   }
+   return glfwGetTime();
+}
+
 void Scene::Idle()
 {
-   float time_sec = static_cast<float>(glfwGetTime());
+   //Frame boundary: rebuild edited shaders and swap in programs that finished linking
+   ShaderWatcher::Poll();
+   PollShaders();
+
+   float time_sec = static_cast<float>(scene_time());
 
    //Pass time_sec value to the shaders
    glUniform1f(Uniforms::UniformLocs::time, time_sec);
 }
 
-void Scene::ReloadShader()
+//Swap in new_shader once it has linked. If it failed keep rendering with the previous program.
+static void ShaderReady(GLuint new_shader)
 {
-   GLuint new_shader = InitShader(vertex_shader.c_str(), fragment_shader.c_str());
-
    if (new_shader == -1) // loading failed
    {
-      DebugBreak(); //alert user by breaking and showing debugger
+      std::cerr << "Shader build failed, keeping the previous program" << std::endl;
       glClearColor(1.0f, 0.0f, 1.0f, 0.0f); //change clear color if shader can't be compiled
    }
    else
@@ -218,9 +320,20 @@ void Scene::ReloadShader()
          glDeleteProgram(shader_program);
       }
       shader_program = new_shader;
+      ValidateProgram(shader_program);
+      glUseProgram(shader_program);
+
+      //Variants are rebuilt from the edited files the next time they are used
+      shader_variants.Clear();
    }
 }
 
+//Rebuilds in the background. The new program is swapped in by PollShaders() in Idle().
+void Scene::ReloadShader()
+{
+   InitShaderAsync(vertex_shader.c_str(), fragment_shader.c_str(), ShaderReady);
+}
+
 //Initialize OpenGL state. This function only gets called once.
 void Scene::Init()
 {
@@ -261,9 +374,20 @@ void Scene::Init()
    glEnable(GL_DEPTH_TEST);
 
    ReloadShader();
+   WaitShaders();
+   //Build the specialized variants in the background, shader_program draws until they have linked
+   for (int mode = 0; mode < 4; mode++)
+   {
+      shader_variants.Queue({ "MODE " + std::to_string(mode) });
+   }
+   ShaderWatcher::Add({ vertex_shader, fragment_shader }, ReloadShader);
+   ShaderWatcher::Start();
    mesh_data = LoadMesh(mesh_name);
-   texture_id = LoadTexture(texture_name);
+   texture_handle = TextureStreaming::Load(texture_name);
+   //The map has no alpha and no negative values, so the shared exponent format costs a quarter of RGBA32F
+   environment_tex = LoadHdrTexture(environment_name, GL_RGB9_E5);
 
    Camera::UpdateP();
    Uniforms::Init();
+   ValidateProgram(shader_program); //ShaderReady ran before Uniforms::Init described the blocks
 }
\ No newline at end of file
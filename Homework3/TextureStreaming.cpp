@@ -0,0 +1,366 @@
+#include "TextureStreaming.h"
+#include "LoadTexture.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <future>
+#include <iostream>
+#include <memory>
+
+namespace TextureStreaming
+{
+   struct MipLevel
+   {
+      GLuint w;
+      GLuint h;
+      std::vector<GLubyte> bytes; //BGRA
+   };
+
+   struct StreamedTexture
+   {
+      std::string filename;
+      GLuint tex_id = -1;
+
+      //Written by the loader thread, read by the render thread once decoded is set
+      std::vector<MipLevel> levels;
+      std::atomic<bool> decoded{false};
+      bool failed = false;
+      std::future<void> loader;
+
+      bool initialized = false;  //placeholder replaced by the real level layout
+      int resident_level = 0;    //finest resident level. == num levels when nothing is resident
+      int requested_level = -1;  //finest level requested this frame, -1 when not requested
+      int last_requested_level = 0;
+
+      int NumLevels() const { return int(levels.size()); }
+   };
+
+   std::vector<std::unique_ptr<StreamedTexture>> textures;
+   size_t budget = 64 * 1024 * 1024; //bytes of texture memory for all streamed textures
+   const size_t upload_bytes_per_frame = 4 * 1024 * 1024; //limits hitches when many levels are missing
+
+static size_t level_bytes(const MipLevel& level)
+{
+   return size_t(level.w) * level.h * 4;
+}
+
+static size_t bytes_from_level(const StreamedTexture& t, int first_level)
+{
+   size_t bytes = 0;
+   for (int i = std::max(0, first_level); i < t.NumLevels(); i++)
+   {
+      bytes += level_bytes(t.levels[i]);
+   }
+   return bytes;
+}
+
+//Build the full mip chain on the CPU with a 2x2 box filter. Level sizes follow the GL rule max(1, size/2).
+static void build_mip_chain(StreamedTexture* t, std::vector<GLubyte>& bytes, GLuint w, GLuint h)
+{
+   t->levels.push_back({ w, h, std::move(bytes) });
+   while (t->levels.back().w > 1 || t->levels.back().h > 1)
+   {
+      const MipLevel& src = t->levels.back();
+      MipLevel dst;
+      dst.w = std::max(1u, src.w / 2);
+      dst.h = std::max(1u, src.h / 2);
+      dst.bytes.resize(size_t(dst.w) * dst.h * 4);
+
+      for (GLuint y = 0; y < dst.h; y++)
+      {
+         const GLuint y0 = std::min(2 * y, src.h - 1);
+         const GLuint y1 = std::min(2 * y + 1, src.h - 1);
+         for (GLuint x = 0; x < dst.w; x++)
+         {
+            const GLuint x0 = std::min(2 * x, src.w - 1);
+            const GLuint x1 = std::min(2 * x + 1, src.w - 1);
+            for (int c = 0; c < 4; c++)
+            {
+               const unsigned int sum = src.bytes[4 * (y0 * src.w + x0) + c] + src.bytes[4 * (y0 * src.w + x1) + c]
+                                      + src.bytes[4 * (y1 * src.w + x0) + c] + src.bytes[4 * (y1 * src.w + x1) + c];
+               dst.bytes[4 * (y * dst.w + x) + c] = GLubyte((sum + 2) / 4);
+            }
+         }
+      }
+      t->levels.push_back(std::move(dst));
+   }
+}
+
+int Load(const std::string& fname)
+{
+   std::unique_ptr<StreamedTexture> t(new StreamedTexture());
+   t->filename = fname;
+
+   //Single texel placeholder so the texture can be bound before anything has streamed in
+   const GLubyte grey[4] = { 128, 128, 128, 255 };
+   glGenTextures(1, &t->tex_id);
+   glBindTexture(GL_TEXTURE_2D, t->tex_id);
+   glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, 1, 1, 0, GL_BGRA, GL_UNSIGNED_BYTE, grey);
+   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
+   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+   glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+   glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+   glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+   glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+   glBindTexture(GL_TEXTURE_2D, 0);
+
+   StreamedTexture* pt = t.get();
+   pt->loader = std::async(std::launch::async, [pt]()
+   {
+      std::vector<GLubyte> bytes;
+      GLuint w = 0;
+      GLuint h = 0;
+      if (LoadImageBGRA(pt->filename, bytes, w, h) == false || w == 0 || h == 0)
+      {
+         pt->failed = true;
+      }
+      else
+      {
+         build_mip_chain(pt, bytes, w, h);
+      }
+      pt->decoded.store(true, std::memory_order_release);
+   });
+
+   textures.push_back(std::move(t));
+   return int(textures.size()) - 1;
+}
+
+GLuint TextureId(int handle)
+{
+   if (handle < 0 || handle >= int(textures.size())) return -1;
+   return textures[handle]->tex_id;
+}
+
+int EstimateLod(int handle, const glm::vec3& bb_min, const glm::vec3& bb_max, const glm::mat4& PVM, int viewport_w, int viewport_h)
+{
+   if (handle < 0 || handle >= int(textures.size())) return 0;
+   StreamedTexture& t = *textures[handle];
+   if (t.initialized == false) return 0;
+
+   //Project the corners of the bounding box to find its extent in pixels
+   glm::vec2 smin(1e10f);
+   glm::vec2 smax(-1e10f);
+   for (int i = 0; i < 8; i++)
+   {
+      glm::vec4 corner((i & 1) ? bb_max.x : bb_min.x, (i & 2) ? bb_max.y : bb_min.y, (i & 4) ? bb_max.z : bb_min.z, 1.0f);
+      glm::vec4 clip = PVM * corner;
+      if (clip.w <= 1e-6f)
+      {
+         return 0; //box crosses the eye plane, assume it fills the screen
+      }
+      glm::vec2 ndc = glm::vec2(clip) / clip.w;
+      smin = glm::min(smin, ndc);
+      smax = glm::max(smax, ndc);
+   }
+   smin = glm::clamp(smin, glm::vec2(-1.0f), glm::vec2(1.0f));
+   smax = glm::clamp(smax, glm::vec2(-1.0f), glm::vec2(1.0f));
+   const float pixels = std::max(0.5f * (smax.x - smin.x) * viewport_w, 0.5f * (smax.y - smin.y) * viewport_h);
+
+   //The texture is assumed to be spread once over the object
+   const float texels = float(std::max(t.levels[0].w, t.levels[0].h));
+   const float lod = std::log2(texels / std::max(pixels, 1.0f));
+   return glm::clamp(int(std::floor(lod)), 0, t.NumLevels() - 1);
+}
+
+void Request(int handle, int level)
+{
+   if (handle < 0 || handle >= int(textures.size())) return;
+   StreamedTexture& t = *textures[handle];
+   if (t.requested_level < 0)
+   {
+      t.requested_level = level;
+   }
+   else
+   {
+      t.requested_level = std::min(t.requested_level, level);
+   }
+}
+
+static void initialize(StreamedTexture& t)
+{
+   glBindTexture(GL_TEXTURE_2D, t.tex_id);
+   if (t.failed)
+   {
+      std::cerr << "Failed to load " << t.filename << std::endl;
+   }
+   else
+   {
+      //Drop the placeholder. Nothing is resident until Update uploads the coarsest level.
+      glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, 0, 0, 0, GL_BGRA, GL_UNSIGNED_BYTE, nullptr);
+      t.resident_level = t.NumLevels();
+      t.last_requested_level = t.NumLevels() - 1;
+   }
+   glBindTexture(GL_TEXTURE_2D, 0);
+   t.initialized = true;
+}
+
+//Upload level (resident_level-1) and make it the new base level
+static void upload_next_level(StreamedTexture& t)
+{
+   const int level = t.resident_level - 1;
+   const MipLevel& mip = t.levels[level];
+
+   glBindTexture(GL_TEXTURE_2D, t.tex_id);
+   glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+   glTexImage2D(GL_TEXTURE_2D, level, GL_RGBA8, mip.w, mip.h, 0, GL_BGRA, GL_UNSIGNED_BYTE, mip.bytes.data());
+   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, t.NumLevels() - 1);
+   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, level);
+   glBindTexture(GL_TEXTURE_2D, 0);
+
+   t.resident_level = level;
+}
+
+//Clamp sampling to target_level, then release the finer levels. Only levels
+//between base and max level count for completeness, so the texture stays usable.
+static void evict_to_level(StreamedTexture& t, int target_level)
+{
+   glBindTexture(GL_TEXTURE_2D, t.tex_id);
+   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, target_level);
+   for (int level = t.resident_level; level < target_level; level++)
+   {
+      glTexImage2D(GL_TEXTURE_2D, level, GL_RGBA8, 0, 0, 0, GL_BGRA, GL_UNSIGNED_BYTE, nullptr);
+   }
+   glBindTexture(GL_TEXTURE_2D, 0);
+
+   t.resident_level = target_level;
+}
+
+void Update()
+{
+   std::vector<StreamedTexture*> ready;
+   for (auto& pt : textures)
+   {
+      StreamedTexture& t = *pt;
+      if (t.initialized == false && t.decoded.load(std::memory_order_acquire))
+      {
+         initialize(t);
+      }
+      if (t.initialized && t.failed == false)
+      {
+         ready.push_back(&t);
+      }
+   }
+
+   //Decide the target level of each texture. Textures not requested this frame keep only their coarsest level.
+   std::vector<int> target(ready.size());
+   size_t total = 0;
+   for (size_t i = 0; i < ready.size(); i++)
+   {
+      StreamedTexture& t = *ready[i];
+      target[i] = (t.requested_level >= 0) ? std::min(t.requested_level, t.NumLevels() - 1) : t.NumLevels() - 1;
+      t.last_requested_level = target[i];
+      total += bytes_from_level(t, target[i]);
+   }
+
+   //Over budget: coarsen the texture whose finest target level costs the most until everything fits
+   while (total > budget)
+   {
+      int worst = -1;
+      size_t worst_bytes = 0;
+      for (size_t i = 0; i < ready.size(); i++)
+      {
+         if (target[i] >= ready[i]->NumLevels() - 1) continue;
+         const size_t bytes = level_bytes(ready[i]->levels[target[i]]);
+         if (bytes > worst_bytes)
+         {
+            worst = int(i);
+            worst_bytes = bytes;
+         }
+      }
+      if (worst < 0) break;
+      target[worst]++;
+      total -= worst_bytes;
+   }
+
+   //Evict first so uploads don't push memory over budget
+   for (size_t i = 0; i < ready.size(); i++)
+   {
+      if (ready[i]->resident_level < target[i])
+      {
+         evict_to_level(*ready[i], target[i]);
+      }
+   }
+
+   //Upload missing levels, coarsest first, until this frame's upload budget is spent
+   size_t uploaded = 0;
+   bool progress = true;
+   while (progress && uploaded < upload_bytes_per_frame)
+   {
+      progress = false;
+      for (size_t i = 0; i < ready.size() && uploaded < upload_bytes_per_frame; i++)
+      {
+         StreamedTexture& t = *ready[i];
+         if (t.resident_level > target[i])
+         {
+            uploaded += level_bytes(t.levels[t.resident_level - 1]);
+            upload_next_level(t);
+            progress = true;
+         }
+      }
+   }
+
+   for (auto& pt : textures)
+   {
+      pt->requested_level = -1;
+   }
+}
+
+void SetBudget(size_t bytes)
+{
+   budget = bytes;
+}
+
+size_t GetBudget()
+{
+   return budget;
+}
+
+size_t ResidentBytes()
+{
+   size_t bytes = 0;
+   for (auto& pt : textures)
+   {
+      if (pt->initialized && pt->failed == false)
+      {
+         bytes += bytes_from_level(*pt, pt->resident_level);
+      }
+   }
+   return bytes;
+}
+
+void GetStats(std::vector<Stats>& stats)
+{
+   stats.clear();
+   for (auto& pt : textures)
+   {
+      const StreamedTexture& t = *pt;
+      Stats s = { t.filename, 0, 0, 0, 0, 0, 0, 0 };
+      if (t.initialized && t.failed == false)
+      {
+         s.width = t.levels[0].w;
+         s.height = t.levels[0].h;
+         s.num_levels = t.NumLevels();
+         s.resident_level = t.resident_level;
+         s.requested_level = t.last_requested_level;
+         s.resident_bytes = bytes_from_level(t, t.resident_level);
+         s.requested_bytes = bytes_from_level(t, t.last_requested_level);
+      }
+      stats.push_back(s);
+   }
+}
+
+void Shutdown()
+{
+   for (auto& pt : textures)
+   {
+      if (pt->loader.valid())
+      {
+         pt->loader.wait();
+      }
+      glDeleteTextures(1, &pt->tex_id);
+   }
+   textures.clear();
+}
+
+};
\ No newline at end of file
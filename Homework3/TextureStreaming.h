@@ -0,0 +1,52 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+/*
+Streams texture mip levels based on how large the textured object appears on screen.
+
+Each frame the scene estimates the finest mip level a texture needs (EstimateLod) and
+requests it (Request). Update() then uploads missing levels a few at a time and releases
+levels that are no longer needed, keeping the total under a global memory budget. Sampling
+is clamped to the resident levels with GL_TEXTURE_BASE_LEVEL, so the texture is always
+complete and usable, just blurrier until finer levels arrive.
+
+Images are decoded and their mip chains built on a worker thread. Until that finishes the
+texture holds a single grey texel.
+*/
+
+namespace TextureStreaming
+{
+   struct Stats
+   {
+      std::string filename;
+      int width;
+      int height;
+      int num_levels;
+      int resident_level;  //finest level currently in GPU memory
+      int requested_level; //finest level asked for this frame
+      size_t resident_bytes;
+      size_t requested_bytes;
+   };
+
+   //Returns a handle. The GL texture is created immediately; its levels stream in later.
+   int Load(const std::string& fname);
+   GLuint TextureId(int handle);
+
+   //Estimate the finest mip level needed to texture a box with the given model-space bounds.
+   int EstimateLod(int handle, const glm::vec3& bb_min, const glm::vec3& bb_max, const glm::mat4& PVM, int viewport_w, int viewport_h);
+   void Request(int handle, int level);
+
+   //Call once per frame: uploads and evicts levels and clears this frame's requests.
+   void Update();
+
+   void SetBudget(size_t bytes);
+   size_t GetBudget();
+   size_t ResidentBytes();
+   void GetStats(std::vector<Stats>& stats);
+
+   void Shutdown();
+};
\ No newline at end of file
@@ -1,74 +1,58 @@
 #include "Uniforms.h"
+#include "UniformRing.h"
+#include "UniformBlocks.h"
 #include <GL/glew.h>
 
 
 namespace Uniforms
 {
    SceneUniforms SceneData;
+   ObjectUniforms ObjectData;
    LightUniforms LightData;
    MaterialUniforms MaterialData;
 
-   //IDs for the buffer objects holding the uniform block data
-   GLuint scene_ubo = -1;
-   GLuint light_ubo = -1;
-   GLuint material_ubo = -1;
-
    namespace UboBinding
    {
       //These values come from the binding value specified in the shader block layout
       int scene = 0;
       int light = 1;
       int material = 2;
+      int object = 3;
    };
 
    //Locations for the uniforms which are not in uniform blocks
    namespace UniformLocs
    {
-      int M = 0; //model matrix
       int time = 1;
       int mode = 2;
    };
 
    void Init()
    {
-      //Create and initialize uniform buffers
-      glGenBuffers(1, &Uniforms::scene_ubo);
-      glBindBuffer(GL_UNIFORM_BUFFER, scene_ubo);
-      glBufferData(GL_UNIFORM_BUFFER, sizeof(SceneUniforms), nullptr, GL_STREAM_DRAW); //Allocate memory for the buffer, but don't copy (since pointer is null).
-      glBindBufferBase(GL_UNIFORM_BUFFER, UboBinding::scene, scene_ubo); //Associate this uniform buffer with the uniform block in the shader that has the same binding.
-
-      glGenBuffers(1, &light_ubo);
-      glBindBuffer(GL_UNIFORM_BUFFER, light_ubo);
-      glBufferData(GL_UNIFORM_BUFFER, sizeof(LightUniforms), &LightData, GL_STREAM_DRAW); //Allocate memory for the buffer, but don't copy (since pointer is null).
-      glBindBufferBase(GL_UNIFORM_BUFFER, UboBinding::light, light_ubo); //Associate this uniform buffer with the uniform block in the shader that has the same binding.
-
-      glGenBuffers(1, &material_ubo);
-      glBindBuffer(GL_UNIFORM_BUFFER, material_ubo);
-      glBufferData(GL_UNIFORM_BUFFER, sizeof(MaterialUniforms), &MaterialData, GL_STREAM_DRAW); //Allocate memory for the buffer, but don't copy (since pointer is null).
-      glBindBufferBase(GL_UNIFORM_BUFFER, UboBinding::material, material_ubo); //Associate this uniform buffer with the uniform block in the shader that has the same binding.
-
-      glBindBuffer(GL_UNIFORM_BUFFER, 0);
-
+      //Data that changes every frame is streamed through the ring
+      UniformRing::Init();
+
+      //Light and material share one buffer and are uploaded when they change. Every block's layout is
+      //checked against the linked programs (UniformBlocks::Validate).
+      UniformBlocks::Describe("SceneUniforms", UboBinding::scene, sizeof(SceneUniforms), { UNIFORM_MEMBER(SceneUniforms, PV), UNIFORM_MEMBER(SceneUniforms, eye_w) });
+      UniformBlocks::Describe("ObjectUniforms", UboBinding::object, sizeof(ObjectUniforms), { UNIFORM_MEMBER(ObjectUniforms, M) });
+      UniformBlocks::Add("LightUniforms", UboBinding::light, LightData,
+         { UNIFORM_MEMBER(LightUniforms, La), UNIFORM_MEMBER(LightUniforms, Ld), UNIFORM_MEMBER(LightUniforms, Ls), UNIFORM_MEMBER(LightUniforms, light_w) });
+      UniformBlocks::Add("MaterialUniforms", UboBinding::material, MaterialData,
+         { UNIFORM_MEMBER(MaterialUniforms, ka), UNIFORM_MEMBER(MaterialUniforms, kd), UNIFORM_MEMBER(MaterialUniforms, ks),
+           UNIFORM_MEMBER(MaterialUniforms, F0), UNIFORM_MEMBER(MaterialUniforms, m) });
+      UniformBlocks::Init();
    }
 
    void BufferSceneData()
    {
-      glBindBuffer(GL_UNIFORM_BUFFER, scene_ubo); //Bind the OpenGL UBO before we update the data.
-      glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(SceneData), &SceneData); //Upload the new uniform values.
-      glBindBuffer(GL_UNIFORM_BUFFER, 0); //unbind the ubo
-   }
-
-   void BufferLightData()
-   {
-       glBindBuffer(GL_UNIFORM_BUFFER, light_ubo); //Bind the OpenGL UBO before we update the data.
-       glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(LightData), &LightData); //Upload the new uniform values.
-       glBindBuffer(GL_UNIFORM_BUFFER, 0); //unbind the ubo
+      //A new copy in this frame's part of the ring: draws still reading the last frame's copy don't hold up the update
+      UniformRing::Bind(UboBinding::scene, SceneData);
    }
 
-   void BufferMaterialData()
+   void BufferObjectData()
    {
-       glBindBuffer(GL_UNIFORM_BUFFER, material_ubo); //Bind the OpenGL UBO before we update the data.
-       glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(MaterialData), &MaterialData); //Upload the new uniform values.
-       glBindBuffer(GL_UNIFORM_BUFFER, 0); //unbind the ubo
+      //Each draw gets its own copy, so the next draw's update doesn't overwrite data this one still reads
+      UniformRing::Bind(UboBinding::object, ObjectData);
    }
-};
+};
\ No newline at end of file
@@ -6,9 +6,11 @@
 namespace Uniforms
 {
    void Init();
+   //SceneData is pushed into UniformRing, call between UniformRing::BeginFrame and EndFrame. LightData
+   //and MaterialData are uploaded by UniformBlocks::Update when they have changed.
    void BufferSceneData();
-   void BufferLightData();
-   void BufferMaterialData();
+   //ObjectData is pushed into UniformRing too, once per draw after it was set for that draw
+   void BufferObjectData();
 
    //This structure mirrors the uniform block declared in the shader
    struct SceneUniforms
@@ -17,6 +19,12 @@ namespace Uniforms
       glm::vec4 eye_w = glm::vec4(0.0f, 0.0f, 3.0f, 1.0f);	//world-space eye position
    };
 
+   //Per-draw data
+   struct ObjectUniforms
+   {
+      glm::mat4 M;	//model matrix
+   };
+
    struct LightUniforms
    {
       glm::vec4 La = glm::vec4(0.65f, 0.7f, 0.7f, 1.0f);	//ambient light color
@@ -35,26 +43,22 @@ namespace Uniforms
    };
 
    extern SceneUniforms SceneData;
+   extern ObjectUniforms ObjectData;
    extern LightUniforms LightData;
    extern MaterialUniforms MaterialData;
 
-   //IDs for the buffer objects holding the uniform block data
-   extern GLuint scene_ubo;
-   extern GLuint light_ubo;
-   extern GLuint material_ubo;
-
    namespace UboBinding
    {
       //These values come from the binding value specified in the shader block layout
       extern int scene;
       extern int light;
       extern int material;
+      extern int object;
    };
 
    //Locations for the uniforms which are not in uniform blocks
    namespace UniformLocs
    {
-      extern int M; //model matrix
       extern int time;
       extern int mode;
    };
@@ -0,0 +1,43 @@
+#ifndef __YUVCONVERT_H__
+#define __YUVCONVERT_H__
+
+#include <stdint.h>
+
+/*
+Converts BGRA pixels (glReadPixels with GL_BGRA / GL_UNSIGNED_BYTE, AV_PIX_FMT_RGB32 in
+ffmpeg terms) to YUV420P, BT.601 limited range. This replaces sws_scale on the recording
+path when frames aren't converted on the GPU.
+
+Luma and the 2x2 chroma average are computed in one pass over the source, with 15-bit
+fixed point coefficients. Rows are split across a small pool of worker threads, and each
+thread uses AVX2 or SSE4.1 when the CPU supports them. All paths give identical output.
+
+A negative src_stride flips the image for free: pass a pointer to the last row to convert
+GL's bottom-up rows to the top-down order the encoder wants.
+width and height must be even.
+*/
+
+bool HasSse41();
+bool HasAvx2();
+
+void BgraToYuv420(const uint8_t* src, int src_stride, int width, int height,
+                  uint8_t* const dst[3], const int dst_stride[3]);
+
+//Single threaded, no SIMD. Reference for the other paths.
+void BgraToYuv420Scalar(const uint8_t* src, int src_stride, int width, int height,
+                        uint8_t* const dst[3], const int dst_stride[3]);
+
+//Nearest neighbor 2x upscale of one 8-bit plane. dst must hold 2*width x 2*height.
+void UpscalePlane2x(const uint8_t* src, int src_stride, int width, int height, uint8_t* dst, int dst_stride);
+
+//Checks that every path matches the scalar reference, compares against sws_scale and
+//prints throughput at the given size
+void BenchmarkYuvConversion(int width, int height);
+
+//Converts noise, gradients and saturated colors at a few sizes. Fails if a SIMD or threaded path differs
+//from the scalar reference at all, or if a plane differs from sws_scale (BT.601 limited range, area
+//filter, accurate rounding) by more than YuvTolerance. Returns the exit code for main.
+const int YuvTolerance = 1;
+int YuvSelfTest();
+
+#endif
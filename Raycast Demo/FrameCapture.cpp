@@ -0,0 +1,477 @@
+#include "FrameCapture.h"
+#include "FreeImage.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace FrameCapture
+{
+   //What a worker needs to write one file
+   struct Job
+   {
+      int buffer;
+      std::string path;
+      Format format;
+      int width, height;
+      bool integer;  //read from an unsigned integer texture. EXR and RAW convert the values to float.
+   };
+
+   //Pixel pack buffer with the fence that signals when its readback has landed. The render thread owns
+   //a buffer until the fence signals, then a worker owns it until it has copied the pixels out.
+   struct ReadbackBuffer
+   {
+      GLuint pbo;
+      GLubyte* data;  //mapped pointer. Stays valid while the buffer exists when persistently mapped.
+      GLsync fence;
+      int size;
+      Job job;
+   };
+
+   //Enough for a burst to run ahead of the workers by a few frames. Beyond that frames are skipped
+   //instead of stalling the render thread.
+   const int max_buffers = 24;
+   ReadbackBuffer buffers[max_buffers] = {};
+   int num_buffers = 0;
+   std::vector<int> free_buffers;
+   std::deque<int> reading;          //readbacks in flight, oldest first
+   bool persistent_mapping = false;  //GL 4.4 buffer storage
+
+   //Worker pool. Jobs are taken in order by whichever worker is free.
+   std::vector<std::thread> workers;
+   std::deque<Job> jobs;
+   std::mutex jobs_mutex;
+   std::condition_variable jobs_ready;
+   bool stopping = false;
+   std::vector<int> returned;        //buffers the workers are finished with, guarded by returned_mutex
+   std::mutex returned_mutex;
+
+   std::atomic<int> pending(0);
+   int skipped = 0;
+
+   //Current burst
+   std::string burst_path;
+   Format burst_format = PNG;
+   int burst_frames = 0;
+   int burst_index = 0;
+   GLuint burst_texture = -1;
+
+static void worker_thread();
+
+int Pending() {return pending;}
+int Skipped() {return skipped;}
+bool BurstActive() {return burst_index < burst_frames;}
+
+static int bytes_per_pixel(Format format)
+{
+   return (format == PNG) ? 4 : 16;
+}
+
+static void start_workers()
+{
+   if (workers.empty() == false) return;
+   persistent_mapping = (GLEW_ARB_buffer_storage == GL_TRUE);
+   stopping = false;
+   //Leave the other half of the cores for rendering and video encoding
+   const int count = std::max(1, std::min(8, int(std::thread::hardware_concurrency()) / 2));
+   for (int i = 0; i < count; i++)
+   {
+      workers.push_back(std::thread(worker_thread));
+   }
+}
+
+static void create_buffer(int index, int size)
+{
+   ReadbackBuffer& b = buffers[index];
+   glCreateBuffers(1, &b.pbo);
+   if (persistent_mapping == true)
+   {
+      const GLbitfield flags = GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+      glNamedBufferStorage(b.pbo, size, nullptr, flags);
+      b.data = (GLubyte*)glMapNamedBufferRange(b.pbo, 0, size, flags);
+   }
+   else
+   {
+      glNamedBufferData(b.pbo, size, nullptr, GL_STREAM_READ);
+      b.data = nullptr;
+   }
+   b.fence = 0;
+   b.size = size;
+   num_buffers++;
+}
+
+static void delete_buffer(int index)
+{
+   ReadbackBuffer& b = buffers[index];
+   if (b.fence != 0)
+   {
+      glDeleteSync(b.fence);
+   }
+   if (b.data != nullptr)
+   {
+      glUnmapNamedBuffer(b.pbo);
+   }
+   glDeleteBuffers(1, &b.pbo);
+   b = ReadbackBuffer();
+   num_buffers--;
+}
+
+static void reclaim_buffers()
+{
+   std::vector<int> done;
+   {
+      std::lock_guard<std::mutex> lock(returned_mutex);
+      done.swap(returned);
+   }
+   for (int index : done)
+   {
+      if (persistent_mapping == false)
+      {
+         glUnmapNamedBuffer(buffers[index].pbo);
+         buffers[index].data = nullptr;
+      }
+      free_buffers.push_back(index);
+   }
+}
+
+//Hand readbacks whose fences have signaled to the workers, in the order they were issued. With wait
+//every readback is waited for.
+static void queue_finished_readbacks(bool wait)
+{
+   while (reading.empty() == false)
+   {
+      const int index = reading.front();
+      ReadbackBuffer& b = buffers[index];
+      const GLenum status = glClientWaitSync(b.fence, wait ? GL_SYNC_FLUSH_COMMANDS_BIT : 0, wait ? 1000000000 : 0);
+      if (status == GL_TIMEOUT_EXPIRED) break;
+
+      reading.pop_front();
+      glDeleteSync(b.fence);
+      b.fence = 0;
+
+      if (persistent_mapping == false)
+      {
+         //Doesn't stall: the data is already in the buffer
+         b.data = (GLubyte*)glMapNamedBufferRange(b.pbo, 0, b.size, GL_MAP_READ_BIT);
+      }
+      if (b.data == nullptr || status == GL_WAIT_FAILED)
+      {
+         fprintf(stderr, "Readback for '%s' failed\n", b.job.path.c_str());
+         if (persistent_mapping == false)
+         {
+            glUnmapNamedBuffer(b.pbo);
+         }
+         free_buffers.push_back(index);
+         pending--;
+         continue;
+      }
+      {
+         std::lock_guard<std::mutex> lock(jobs_mutex);
+         jobs.push_back(b.job);
+      }
+      jobs_ready.notify_one();
+   }
+}
+
+//Get a free buffer of at least size bytes, or -1 if all are in use
+static int acquire_buffer(int size)
+{
+   reclaim_buffers();
+   for (size_t i = 0; i < free_buffers.size(); i++)
+   {
+      const int index = free_buffers[i];
+      if (buffers[index].size >= size)
+      {
+         free_buffers.erase(free_buffers.begin() + i);
+         return index;
+      }
+   }
+   //Buffer storage is immutable, replace a free buffer that is too small
+   if (free_buffers.empty() == false)
+   {
+      const int index = free_buffers.back();
+      free_buffers.pop_back();
+      delete_buffer(index);
+      create_buffer(index, size);
+      return index;
+   }
+   if (num_buffers < max_buffers)
+   {
+      for (int i = 0; i < max_buffers; i++)
+      {
+         if (buffers[i].pbo == 0)
+         {
+            create_buffer(i, size);
+            return i;
+         }
+      }
+   }
+   return -1;
+}
+
+//e.g. a pick id attachment
+static bool is_unsigned_integer(GLint internal_format)
+{
+   switch (internal_format)
+   {
+   case GL_R8UI: case GL_R16UI: case GL_R32UI:
+   case GL_RG8UI: case GL_RG16UI: case GL_RG32UI:
+   case GL_RGBA8UI: case GL_RGBA16UI: case GL_RGBA32UI:
+      return true;
+   }
+   return false;
+}
+
+//Start the readback of the current read buffer, or texture if it isn't -1
+static bool capture(GLint texture, int level, const std::string& path, Format format)
+{
+   start_workers();
+
+   int width = 0, height = 0;
+   bool integer = false;
+   if (texture == -1)
+   {
+      GLint viewport[4];
+      glGetIntegerv(GL_VIEWPORT, viewport);
+      width = viewport[2];
+      height = viewport[3];
+   }
+   else
+   {
+      glGetTextureLevelParameteriv(texture, level, GL_TEXTURE_WIDTH, &width);
+      glGetTextureLevelParameteriv(texture, level, GL_TEXTURE_HEIGHT, &height);
+      GLint internal_format = 0;
+      glGetTextureLevelParameteriv(texture, level, GL_TEXTURE_INTERNAL_FORMAT, &internal_format);
+      integer = is_unsigned_integer(internal_format);
+   }
+   if (width <= 0 || height <= 0) return false;
+
+   const int size = bytes_per_pixel(format) * width * height;
+   const int index = acquire_buffer(size);
+   if (index == -1)
+   {
+      skipped++;
+      return false;
+   }
+
+   ReadbackBuffer& b = buffers[index];
+   b.job.buffer = index;
+   b.job.path = path;
+   b.job.format = format;
+   b.job.width = width;
+   b.job.height = height;
+   b.job.integer = integer;
+
+   //Integer textures can only be read with an integer format. PNG clamps the values to 255.
+   GLenum pixel_format = (format == PNG) ? GL_BGRA : GL_RGBA;
+   GLenum type = (format == PNG) ? GL_UNSIGNED_BYTE : GL_FLOAT;
+   if (integer == true)
+   {
+      pixel_format = (format == PNG) ? GL_BGRA_INTEGER : GL_RGBA_INTEGER;
+      type = (format == PNG) ? GL_UNSIGNED_BYTE : GL_UNSIGNED_INT;
+   }
+   glPixelStorei(GL_PACK_ALIGNMENT, 4);
+   glBindBuffer(GL_PIXEL_PACK_BUFFER, b.pbo);
+   if (texture == -1)
+   {
+      glReadPixels(0, 0, width, height, pixel_format, type, 0);
+   }
+   else
+   {
+      glGetTextureSubImage(texture, level, 0, 0, 0, width, height, 1, pixel_format, type, size, nullptr);
+   }
+   glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+   b.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+   reading.push_back(index);
+   pending++;
+   return true;
+}
+
+bool CaptureFrame(const std::string& path, Format format)
+{
+   return capture(-1, 0, path, format);
+}
+
+bool CaptureTexture(GLuint texture, const std::string& path, Format format, int level)
+{
+   return capture(texture, level, path, format);
+}
+
+void StartBurst(const std::string& path, Format format, int frames, GLuint texture)
+{
+   burst_path = path;
+   burst_format = format;
+   burst_frames = frames;
+   burst_index = 0;
+   burst_texture = texture;
+}
+
+void Update()
+{
+   if (BurstActive())
+   {
+      std::string path = burst_path;
+      if (burst_frames > 1)
+      {
+         //frame.png -> frame_0000.png
+         const size_t dot = burst_path.find_last_of('.');
+         const size_t slash = burst_path.find_last_of("/\\");
+         const bool has_extension = (dot != std::string::npos && (slash == std::string::npos || dot > slash));
+         char number[16];
+         snprintf(number, sizeof(number), "_%04d", burst_index);
+         path.insert(has_extension ? dot : path.size(), number);
+      }
+      capture(burst_texture, 0, path, burst_format);
+      burst_index++;
+   }
+   reclaim_buffers();
+   queue_finished_readbacks(false);
+}
+
+void Shutdown()
+{
+   burst_frames = 0;
+   queue_finished_readbacks(true);
+   {
+      std::lock_guard<std::mutex> lock(jobs_mutex);
+      stopping = true;
+   }
+   jobs_ready.notify_all();
+   for (std::thread& worker : workers)
+   {
+      worker.join();
+   }
+   workers.clear();
+   reclaim_buffers();
+
+   for (int i = 0; i < max_buffers; i++)
+   {
+      if (buffers[i].pbo != 0)
+      {
+         delete_buffer(i);
+      }
+   }
+   free_buffers.clear();
+}
+
+//Give the buffer back to the render thread once its pixels have been copied out
+static void release(const Job& job)
+{
+   std::lock_guard<std::mutex> lock(returned_mutex);
+   returned.push_back(job.buffer);
+}
+
+static bool save_png(const Job& job, const GLubyte* data)
+{
+   //GL and FreeImage rows both start at the bottom
+   FIBITMAP* img = FreeImage_Allocate(job.width, job.height, 24);
+   for (int y = 0; y < job.height; y++)
+   {
+      const GLubyte* src = data + size_t(4) * job.width * y;
+      BYTE* dst = FreeImage_GetScanLine(img, y);
+      for (int x = 0; x < job.width; x++)
+      {
+         dst[3 * x + FI_RGBA_BLUE] = src[4 * x + 0];
+         dst[3 * x + FI_RGBA_GREEN] = src[4 * x + 1];
+         dst[3 * x + FI_RGBA_RED] = src[4 * x + 2];
+      }
+   }
+   release(job);
+   const BOOL saved = FreeImage_Save(FIF_PNG, img, job.path.c_str(), PNG_Z_BEST_SPEED);
+   FreeImage_Unload(img);
+   return saved == TRUE;
+}
+
+//Integer values as floats, exact up to 2^24
+static void convert_row(const Job& job, const GLubyte* src, float* dst)
+{
+   const GLuint* values = (const GLuint*)src;
+   for (int i = 0; i < 4 * job.width; i++)
+   {
+      dst[i] = float(values[i]);
+   }
+}
+
+static bool save_exr(const Job& job, const GLubyte* data)
+{
+   FIBITMAP* img = FreeImage_AllocateT(FIT_RGBAF, job.width, job.height, 128);
+   const size_t row_bytes = size_t(16) * job.width;
+   for (int y = 0; y < job.height; y++)
+   {
+      if (job.integer == true)
+      {
+         convert_row(job, data + row_bytes * y, (float*)FreeImage_GetScanLine(img, y));
+      }
+      else
+      {
+         memcpy(FreeImage_GetScanLine(img, y), data + row_bytes * y, row_bytes);
+      }
+   }
+   release(job);
+   const BOOL saved = FreeImage_Save(FIF_EXR, img, job.path.c_str(), EXR_FLOAT | EXR_ZIP);
+   FreeImage_Unload(img);
+   return saved == TRUE;
+}
+
+static bool save_raw(const Job& job, const GLubyte* data)
+{
+   FILE* file = fopen(job.path.c_str(), "wb");
+   if (file == nullptr)
+   {
+      release(job);
+      return false;
+   }
+   //Straight from the mapped buffer, flipped to top row first
+   const size_t row_bytes = size_t(16) * job.width;
+   std::vector<float> row(job.integer ? 4 * job.width : 0);
+   bool written = true;
+   for (int y = job.height - 1; y >= 0 && written; y--)
+   {
+      const GLubyte* src = data + row_bytes * y;
+      if (job.integer == true)
+      {
+         convert_row(job, src, row.data());
+         src = (const GLubyte*)row.data();
+      }
+      written = (fwrite(src, 1, row_bytes, file) == row_bytes);
+   }
+   release(job);
+   return (fclose(file) == 0 && written);
+}
+
+static void worker_thread()
+{
+   for (;;)
+   {
+      Job job;
+      {
+         std::unique_lock<std::mutex> lock(jobs_mutex);
+         jobs_ready.wait(lock, [] {return stopping == true || jobs.empty() == false;});
+         if (jobs.empty()) return; //stopping and drained
+         job = jobs.front();
+         jobs.pop_front();
+      }
+
+      const GLubyte* data = buffers[job.buffer].data;
+      bool saved = false;
+      switch (job.format)
+      {
+         case PNG: saved = save_png(job, data); break;
+         case EXR: saved = save_exr(job, data); break;
+         case RAW: saved = save_raw(job, data); break;
+      }
+      if (saved == false)
+      {
+         fprintf(stderr, "Could not write '%s'\n", job.path.c_str());
+      }
+      pending--;
+   }
+}
+
+};
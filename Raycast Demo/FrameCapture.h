@@ -0,0 +1,39 @@
+#pragma once
+
+#include <string>
+#include <GL/glew.h>
+
+//Screenshots and frame dumps that don't stall the render thread. A capture starts a readback into a
+//pixel pack buffer followed by a fence. Update() hands readbacks whose fence has signaled to a pool of
+//worker threads, which copy the pixels out of the mapped buffer and compress and write the file.
+namespace FrameCapture
+{
+   enum Format
+   {
+      PNG, //8-bit RGB, fast zlib level
+      EXR, //32-bit float RGBA, keeps values outside [0,1] and exact ids (e.g. pick_tex)
+      RAW  //32-bit float RGBA, width*height*16 bytes, top row first, no header
+   };
+
+   //Read back the current read buffer (size of the current viewport). Returns false if the frame was
+   //skipped because every readback buffer is still in use.
+   bool CaptureFrame(const std::string& path, Format format);
+   //Read back a level of a texture, e.g. an FBO color attachment. Unsigned integer textures (pick ids)
+   //are written as float values.
+   bool CaptureTexture(GLuint texture, const std::string& path, Format format, int level = 0);
+
+   //Capture every frame for the next frames calls to Update(): the current read buffer if texture is -1,
+   //otherwise the texture. Files get _0000, _0001, ... inserted before the extension. A burst of one frame
+   //is a screenshot taken at the end of the frame, e.g. from a GUI button, and keeps path as it is.
+   void StartBurst(const std::string& path, Format format, int frames, GLuint texture = -1);
+   bool BurstActive();
+
+   //Call once per frame after the frame is complete (before glfwSwapBuffers). Takes the burst frame and
+   //passes finished readbacks to the workers. Never waits for the GPU or the workers.
+   void Update();
+   //Wait until every capture is written and free the buffers. Call before the GL context is destroyed.
+   void Shutdown();
+
+   int Pending();  //captures not yet written
+   int Skipped();  //captures skipped because no readback buffer was free
+};
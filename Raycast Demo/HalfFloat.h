@@ -0,0 +1,28 @@
+#ifndef __HALFFLOAT_H__
+#define __HALFFLOAT_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+Conversions used to upload float images in compact formats:
+GL_RGBA16F (IEEE half floats) and GL_RGB9_E5 (shared exponent, no alpha).
+
+FloatToHalf uses F16C instructions (8 floats per instruction) when the CPU supports them
+and falls back to a scalar conversion otherwise. Both round to nearest even.
+*/
+
+bool HasF16C();
+
+uint16_t FloatToHalf(float f);
+void FloatToHalf(const float* src, uint16_t* dst, size_t n);
+void FloatToHalfScalar(const float* src, uint16_t* dst, size_t n);
+
+//src holds npixels pixels with src_channels floats each (3 or 4). Alpha is dropped.
+uint32_t FloatToRGB9E5(float r, float g, float b);
+void FloatToRGB9E5(const float* src, uint32_t* dst, size_t npixels, int src_channels);
+
+//Prints conversion throughput and the memory saved versus GL_RGBA32F uploads
+void BenchmarkHalfConversion(int width, int height);
+
+#endif
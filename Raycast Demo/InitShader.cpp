@@ -1,7 +1,15 @@
 #include <GL/glew.h>
 
+#include <algorithm>
+#include <chrono>
 #include <fstream>
+#include <functional>
 #include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+#include "InitShader.h"
+#include "ShaderCache.h"
 using namespace std;
 
 //Adapted from Edward Angels InitShader code
@@ -23,6 +31,45 @@ static char* readShaderSource(const char* shaderFile)
    return NULL;
 }
 
+// Turn "NAME" or "NAME VALUE" entries into #define lines
+static std::string defineLines(const std::vector<std::string>& defines)
+{
+   std::string lines;
+   for (const std::string& d : defines)
+   {
+      lines += "#define " + d + "\n";
+   }
+   return lines;
+}
+
+// Insert the #define lines right after the #version directive, which must stay first.
+// A #line directive follows them so compile errors still report line numbers of the file.
+static char* injectDefines(char* source, const std::string& defines)
+{
+   if (source == NULL || defines.empty()) return source;
+
+   std::string src(source);
+   size_t insertAt = 0;
+   size_t version = src.find("#version");
+   if (version != std::string::npos)
+   {
+      size_t eol = src.find('\n', version);
+      if (eol == std::string::npos)
+      {
+         src += '\n';
+         eol = src.size() - 1;
+      }
+      insertAt = eol + 1;
+   }
+   const int nextLine = 1 + int(std::count(src.begin(), src.begin() + insertAt, '\n'));
+   src.insert(insertAt, defines + "#line " + std::to_string(nextLine) + "\n");
+
+   delete[] source;
+   char* bytes = new char[src.size() + 1];
+   memcpy(bytes, src.c_str(), src.size() + 1);
+   return bytes;
+}
+
 void printShaderCompileError(GLuint shader)
 {
    GLint  logSize;
@@ -44,30 +91,63 @@ void printProgramLinkError(GLuint program)
    delete[] logMsg;
 }
 
-GLuint InitShader(const char* computeShaderFile)
+struct Shader
+{
+   const char*  filename;
+   GLenum       type;
+   GLchar*      source;
+};
+
+// Compile and link the given stages. Tries the program binary cache first.
+// Separable programs hold a single stage and are combined with program pipeline objects.
+static GLuint initProgram(Shader* shaders, int numShaders, bool bindAttribLocs, const std::string& defines = std::string(), bool separable = false)
 {
    bool error = false;
-   struct Shader
-   {
-      const char*  filename;
-      GLenum       type;
-      GLchar*      source;
-   }  shaders[1] =
-   {
-      { computeShaderFile, GL_COMPUTE_SHADER, NULL }
-   };
-
-   GLuint program = glCreateProgram();
+   auto start = std::chrono::high_resolution_clock::now();
 
-   for (int i = 0; i < 1; ++i)
+   uint64_t key = ShaderCache::BeginKey();
+   for (int i = 0; i < numShaders; ++i)
    {
       Shader& s = shaders[i];
-      s.source = readShaderSource(s.filename);
-      if (shaders[i].source == NULL)
+      s.source = injectDefines(readShaderSource(s.filename), defines);
+      if (s.source == NULL)
       {
          std::cerr << "Failed to read " << s.filename << std::endl;
          error = true;
       }
+      key = ShaderCache::AddSource(key, s.type, s.source);
+   }
+   if (separable == true)
+   {
+      key = ShaderCache::AddString(key, "separable");
+   }
+
+   if (error == false)
+   {
+      GLuint program = ShaderCache::LoadProgram(key, separable);
+      if (program != -1)
+      {
+         for (int i = 0; i < numShaders; ++i)
+         {
+            delete[] shaders[i].source;
+         }
+         auto stop = std::chrono::high_resolution_clock::now();
+         std::cout << shaders[numShaders-1].filename << ": program loaded from cache in "
+                   << std::chrono::duration<double, std::milli>(stop - start).count() << " ms" << std::endl;
+         if (separable == false)
+         {
+            glUseProgram(program);
+         }
+         return program;
+      }
+   }
+
+   GLuint program = glCreateProgram();
+
+   for (int i = 0; i < numShaders; ++i)
+   {
+      Shader& s = shaders[i];
+      if (s.source == NULL) continue;
 
       GLuint shader = glCreateShader(s.type);
       glShaderSource(shader, 1, (const GLchar**)&s.source, NULL);
@@ -85,9 +165,27 @@ GLuint InitShader(const char* computeShaderFile)
       delete[] s.source;
 
       glAttachShader(program, shader);
+      glDeleteShader(shader); //flagged for deletion, freed when the program is deleted
+   }
+
+   if (bindAttribLocs == true)
+   {
+      //set shader attrib locations
+      const int pos_loc = 0;
+      const int tex_coord_loc = 1;
+      const int normal_loc = 2;
+
+      glBindAttribLocation(program, pos_loc, "pos_attrib");
+      glBindAttribLocation(program, tex_coord_loc, "tex_coord_attrib");
+      glBindAttribLocation(program, normal_loc, "normal_attrib");
    }
 
    /* link  and error check */
+   glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+   if (separable == true)
+   {
+      glProgramParameteri(program, GL_PROGRAM_SEPARABLE, GL_TRUE);
+   }
    glLinkProgram(program);
 
    GLint  linked;
@@ -102,169 +200,491 @@ GLuint InitShader(const char* computeShaderFile)
 
    if (error == true)
    {
+      glDeleteProgram(program);
       return -1;
    }
 
-   /* use program object */
-   glUseProgram(program);
+   ShaderCache::SaveProgram(key, program);
+
+   auto stop = std::chrono::high_resolution_clock::now();
+   std::cout << shaders[numShaders-1].filename << ": program compiled in "
+             << std::chrono::duration<double, std::milli>(stop - start).count() << " ms" << std::endl;
+
+   /* use program object. Separable stages are bound through a pipeline instead. */
+   if (separable == false)
+   {
+      glUseProgram(program);
+   }
 
    return program;
 }
 
+GLuint InitShader(const char* computeShaderFile)
+{
+   Shader shaders[1] =
+   {
+      { computeShaderFile, GL_COMPUTE_SHADER, NULL }
+   };
+   return initProgram(shaders, 1, false);
+}
+
 
 // Create a GLSL program object from vertex and fragment shader files
 GLuint InitShader(const char* vShaderFile, const char* fShaderFile)
 {
+   Shader shaders[2] =
+   {
+      { vShaderFile, GL_VERTEX_SHADER, NULL },
+      { fShaderFile, GL_FRAGMENT_SHADER, NULL }
+   };
+   return initProgram(shaders, 2, true);
+}
 
-   bool error = false;
-   struct Shader
+// Create a GLSL program object from vertex, geometry and fragment shader files
+GLuint InitShader(const char* vShaderFile, const char* gShaderFile, const char* fShaderFile)
+{
+   Shader shaders[3] =
    {
-      const char*  filename;
-      GLenum       type;
-      GLchar*      source;
-   }  shaders[2] =
+      { vShaderFile, GL_VERTEX_SHADER, NULL },
+      { gShaderFile, GL_GEOMETRY_SHADER, NULL },
+      { fShaderFile, GL_FRAGMENT_SHADER, NULL }
+   };
+   return initProgram(shaders, 3, true);
+}
+
+// Create a GLSL program object with the given #defines inserted into both stages
+GLuint InitShader(const char* vShaderFile, const char* fShaderFile, const std::vector<std::string>& defines)
+{
+   Shader shaders[2] =
    {
       { vShaderFile, GL_VERTEX_SHADER, NULL },
       { fShaderFile, GL_FRAGMENT_SHADER, NULL }
    };
+   return initProgram(shaders, 2, true, defineLines(defines));
+}
 
-   GLuint program = glCreateProgram();
 
-   for (int i = 0; i < 2; ++i)
+/////////////////////////////////////////////////////////////////////////////
+// Shader permutations
+/////////////////////////////////////////////////////////////////////////////
+
+ShaderVariants::ShaderVariants(const std::string& vertexShaderFile, const std::string& fragmentShaderFile, std::function<void(GLuint)> onReady)
+   : mVertexFile(vertexShaderFile), mFragmentFile(fragmentShaderFile), mGeneration(0), mOnReady(onReady)
+{
+}
+
+GLuint ShaderVariants::Get(const std::vector<std::string>& defines)
+{
+   const std::string key = defineLines(defines);
+   auto found = mPrograms.find(key);
+   if (found != mPrograms.end())
    {
-      Shader& s = shaders[i];
-      s.source = readShaderSource(s.filename);
-      if (shaders[i].source == NULL)
+      return found->second;
+   }
+
+   Queue(defines);
+   return -1;
+}
+
+void ShaderVariants::Queue(const std::vector<std::string>& defines)
+{
+   const std::string key = defineLines(defines);
+   if (mPrograms.count(key) > 0 || mPending.count(key) > 0) return;
+
+   mPending.insert(key);
+   const int generation = mGeneration;
+   InitShaderAsync(mVertexFile.c_str(), mFragmentFile.c_str(), defines, [this, key, generation](GLuint program)
+   {
+      if (generation != mGeneration)
       {
-         std::cerr << "Failed to read " << s.filename << std::endl;
-         error = true;
+         //Built from files that have been edited since
+         if (program != -1) glDeleteProgram(program);
+         return;
       }
+      //Failures are remembered too, so a broken variant isn't recompiled every frame
+      mPending.erase(key);
+      mPrograms[key] = program;
+      if (program != -1 && mOnReady) mOnReady(program);
+   });
+}
 
-      GLuint shader = glCreateShader(s.type);
-      glShaderSource(shader, 1, (const GLchar**)&s.source, NULL);
-      glCompileShader(shader);
-
-      GLint  compiled;
-      glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
-      if (!compiled)
+void ShaderVariants::Clear()
+{
+   for (auto& variant : mPrograms)
+   {
+      if (variant.second != -1)
       {
-         std::cerr << s.filename << " failed to compile:" << std::endl;
-         printShaderCompileError(shader);
-         error = true;
+         glDeleteProgram(variant.second);
       }
+   }
+   mPrograms.clear();
+   mPending.clear();
+   mGeneration++;
+}
 
-      delete[] s.source;
+int ShaderVariants::NumVariants() const
+{
+   return int(mPrograms.size());
+}
 
-      glAttachShader(program, shader);
-   }
+int ShaderVariants::NumPending() const
+{
+   return int(mPending.size());
+}
 
-   //set shader attrib locations
-   const int pos_loc = 0;
-   const int tex_coord_loc = 1;
-   const int normal_loc = 2;
 
-   glBindAttribLocation(program, pos_loc, "pos_attrib");
-   glBindAttribLocation(program, tex_coord_loc, "tex_coord_attrib");
-   glBindAttribLocation(program, normal_loc, "normal_attrib");
+/////////////////////////////////////////////////////////////////////////////
+// Separable programs and pipelines
+/////////////////////////////////////////////////////////////////////////////
 
-   /* link  and error check */
-   glLinkProgram(program);
+static std::map<std::string, GLuint> stagePrograms;   //keyed by stage, filename and defines
+static std::set<std::string> pendingStages;           //queued by InitStageProgramAsync, not linked yet
+static int stageGeneration = 0;                       //bumped by DeleteStagePrograms
+static std::map<std::pair<GLuint, GLuint>, GLuint> pipelines; //keyed by (vertex, fragment) program
 
-   GLint  linked;
-   glGetProgramiv(program, GL_LINK_STATUS, &linked);
-   if (!linked)
+static std::string stageKey(GLenum type, const char* shaderFile, const std::vector<std::string>& defines)
+{
+   return std::to_string(type) + ":" + shaderFile + "\n" + defineLines(defines);
+}
+
+GLuint InitStageProgram(GLenum type, const char* shaderFile, const std::vector<std::string>& defines)
+{
+   const std::string key = stageKey(type, shaderFile, defines);
+   auto found = stagePrograms.find(key);
+   if (found != stagePrograms.end())
    {
-      std::cerr << "Shader program failed to link" << std::endl;
-      printProgramLinkError(program);
+      return found->second;
+   }
 
-      error = true;
+   Shader shaders[1] =
+   {
+      { shaderFile, type, NULL }
+   };
+   GLuint program = initProgram(shaders, 1, type == GL_VERTEX_SHADER, defineLines(defines), true);
+
+   //Failures are remembered too, so a broken stage isn't recompiled every frame
+   stagePrograms[key] = program;
+   return program;
+}
+
+GLuint InitPipeline(GLuint vertexProgram, GLuint fragmentProgram)
+{
+   if (vertexProgram == -1 || fragmentProgram == -1) return -1;
+
+   auto key = std::make_pair(vertexProgram, fragmentProgram);
+   auto found = pipelines.find(key);
+   if (found != pipelines.end())
+   {
+      return found->second;
    }
 
-   if (error == true)
+   GLuint pipeline = -1;
+   glCreateProgramPipelines(1, &pipeline);
+   glUseProgramStages(pipeline, GL_VERTEX_SHADER_BIT, vertexProgram);
+   glUseProgramStages(pipeline, GL_FRAGMENT_SHADER_BIT, fragmentProgram);
+
+   //Catches mismatched interfaces between the stages. Only a warning: the result also depends on current state.
+   glValidateProgramPipeline(pipeline);
+   GLint valid = GL_FALSE;
+   glGetProgramPipelineiv(pipeline, GL_VALIDATE_STATUS, &valid);
+   if (!valid)
    {
-      return -1;
+      GLint logSize = 0;
+      glGetProgramPipelineiv(pipeline, GL_INFO_LOG_LENGTH, &logSize);
+      std::vector<char> logMsg(logSize + 1, '\0');
+      glGetProgramPipelineInfoLog(pipeline, logSize, NULL, logMsg.data());
+      std::cerr << "Program pipeline failed to validate: " << logMsg.data() << std::endl;
    }
 
-   /* use program object */
-   glUseProgram(program);
-   return program;
+   pipelines[key] = pipeline;
+   return pipeline;
 }
 
-// Create a GLSL program object from vertex and fragment shader files
-GLuint InitShader(const char* vShaderFile, const char* gShaderFile, const char* fShaderFile)
+void DeleteStagePrograms()
 {
-   bool error = false;
-   struct Shader
+   for (auto& p : pipelines)
    {
-      const char*  filename;
-      GLenum       type;
-      GLchar*      source;
-   }  shaders[3] =
+      glDeleteProgramPipelines(1, &p.second);
+   }
+   pipelines.clear();
+
+   for (auto& s : stagePrograms)
    {
-      { vShaderFile, GL_VERTEX_SHADER, NULL },
-      { gShaderFile, GL_GEOMETRY_SHADER, NULL },
-      { fShaderFile, GL_FRAGMENT_SHADER, NULL }
-   };
+      if (s.second != -1)
+      {
+         glDeleteProgram(s.second);
+      }
+   }
+   stagePrograms.clear();
+   pendingStages.clear();
+   stageGeneration++;
+}
 
-   GLuint program = glCreateProgram();
 
-   for (int i = 0; i < 3; ++i)
+/////////////////////////////////////////////////////////////////////////////
+// Asynchronous program creation
+/////////////////////////////////////////////////////////////////////////////
+
+struct PendingProgram
+{
+   GLuint program;
+   std::vector<GLuint> shaders;
+   std::vector<const char*> filenames;
+   uint64_t key;
+   std::function<void(GLuint)> onReady;
+   bool failed;   //failed before linking (e.g. a file could not be read)
+   bool fromCache;
+};
+
+static std::vector<PendingProgram> pendingPrograms;
+static int parallelCompile = -1; //-1: not checked yet
+
+static bool parallelCompileSupported()
+{
+   if (parallelCompile == -1)
+   {
+      parallelCompile = 0;
+      //0xFFFFFFFF lets the driver pick the number of compiler threads
+      if (GLEW_KHR_parallel_shader_compile)
+      {
+         glMaxShaderCompilerThreadsKHR(0xFFFFFFFF);
+         parallelCompile = 1;
+      }
+      else if (GLEW_ARB_parallel_shader_compile)
+      {
+         glMaxShaderCompilerThreadsARB(0xFFFFFFFF);
+         parallelCompile = 1;
+      }
+   }
+   return parallelCompile == 1;
+}
+
+static void queueProgram(Shader* shaders, int numShaders, bool bindAttribLocs, std::function<void(GLuint)> onReady, const std::string& defines = std::string(), bool separable = false)
+{
+   parallelCompileSupported();
+
+   PendingProgram p;
+   p.program = -1;
+   p.onReady = onReady;
+   p.failed = false;
+   p.fromCache = false;
+
+   p.key = ShaderCache::BeginKey();
+   for (int i = 0; i < numShaders; ++i)
    {
       Shader& s = shaders[i];
-      s.source = readShaderSource(s.filename);
-      if (shaders[i].source == NULL)
+      p.filenames.push_back(s.filename);
+      s.source = injectDefines(readShaderSource(s.filename), defines);
+      if (s.source == NULL)
       {
          std::cerr << "Failed to read " << s.filename << std::endl;
-         error = true;
+         p.failed = true;
       }
+      p.key = ShaderCache::AddSource(p.key, s.type, s.source);
+   }
+   if (separable == true)
+   {
+      p.key = ShaderCache::AddString(p.key, "separable");
+   }
 
-      GLuint shader = glCreateShader(s.type);
-      glShaderSource(shader, 1, (const GLchar**)&s.source, NULL);
-      glCompileShader(shader);
+   if (p.failed == false)
+   {
+      p.program = ShaderCache::LoadProgram(p.key, separable);
+      p.fromCache = (p.program != -1);
+   }
 
-      GLint  compiled;
-      glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
-      if (!compiled)
+   if (p.failed == false && p.fromCache == false)
+   {
+      //Issue all compiles and the link back to back without querying status
+      p.program = glCreateProgram();
+      for (int i = 0; i < numShaders; ++i)
       {
-         std::cerr << s.filename << " failed to compile:" << std::endl;
-         printShaderCompileError(shader);
-         error = true;
+         GLuint shader = glCreateShader(shaders[i].type);
+         glShaderSource(shader, 1, (const GLchar**)&shaders[i].source, NULL);
+         glCompileShader(shader);
+         glAttachShader(p.program, shader);
+         p.shaders.push_back(shader);
       }
 
-      delete[] s.source;
+      if (bindAttribLocs == true)
+      {
+         glBindAttribLocation(p.program, 0, "pos_attrib");
+         glBindAttribLocation(p.program, 1, "tex_coord_attrib");
+         glBindAttribLocation(p.program, 2, "normal_attrib");
+      }
+      glProgramParameteri(p.program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+      if (separable == true)
+      {
+         glProgramParameteri(p.program, GL_PROGRAM_SEPARABLE, GL_TRUE);
+      }
+      glLinkProgram(p.program);
+   }
 
-      glAttachShader(program, shader);
+   for (int i = 0; i < numShaders; ++i)
+   {
+      delete[] shaders[i].source;
    }
 
-   //set shader attrib locations
-   const int pos_loc = 0;
-   const int tex_coord_loc = 1;
-   const int normal_loc = 2;
+   pendingPrograms.push_back(p);
+}
 
-   glBindAttribLocation(program, pos_loc, "pos_attrib");
-   glBindAttribLocation(program, tex_coord_loc, "tex_coord_attrib");
-   glBindAttribLocation(program, normal_loc, "normal_attrib");
+static bool isComplete(const PendingProgram& p)
+{
+   if (p.failed || p.fromCache || parallelCompileSupported() == false) return true;
 
-   /* link  and error check */
-   glLinkProgram(program);
+   GLint complete = GL_FALSE;
+   glGetProgramiv(p.program, GL_COMPLETION_STATUS_KHR, &complete);
+   return complete == GL_TRUE;
+}
 
-   GLint  linked;
-   glGetProgramiv(program, GL_LINK_STATUS, &linked);
+//Check status of a finished program. Returns the program or -1.
+static GLuint finishProgram(PendingProgram& p)
+{
+   if (p.failed) return -1;
+   if (p.fromCache) return p.program;
+
+   GLint linked;
+   glGetProgramiv(p.program, GL_LINK_STATUS, &linked);
    if (!linked)
    {
+      //Only look at the individual stages when something went wrong
+      for (size_t i = 0; i < p.shaders.size(); ++i)
+      {
+         GLint compiled;
+         glGetShaderiv(p.shaders[i], GL_COMPILE_STATUS, &compiled);
+         if (!compiled)
+         {
+            std::cerr << p.filenames[i] << " failed to compile:" << std::endl;
+            printShaderCompileError(p.shaders[i]);
+         }
+      }
       std::cerr << "Shader program failed to link" << std::endl;
-      printProgramLinkError(program);
+      printProgramLinkError(p.program);
+   }
 
-      error = true;
+   for (size_t i = 0; i < p.shaders.size(); ++i)
+   {
+      glDetachShader(p.program, p.shaders[i]);
+      glDeleteShader(p.shaders[i]);
    }
 
-   if (error == true)
+   if (!linked)
    {
+      glDeleteProgram(p.program);
       return -1;
    }
 
-   /* use program object */
-   glUseProgram(program);
+   ShaderCache::SaveProgram(p.key, p.program);
+   return p.program;
+}
 
-   return program;
+void InitShaderAsync(const char* computeShaderFile, std::function<void(GLuint)> onReady)
+{
+   Shader shaders[1] =
+   {
+      { computeShaderFile, GL_COMPUTE_SHADER, NULL }
+   };
+   queueProgram(shaders, 1, false, onReady);
+}
+
+void InitShaderAsync(const char* vShaderFile, const char* fShaderFile, std::function<void(GLuint)> onReady)
+{
+   Shader shaders[2] =
+   {
+      { vShaderFile, GL_VERTEX_SHADER, NULL },
+      { fShaderFile, GL_FRAGMENT_SHADER, NULL }
+   };
+   queueProgram(shaders, 2, true, onReady);
+}
+
+void InitShaderAsync(const char* vShaderFile, const char* gShaderFile, const char* fShaderFile, std::function<void(GLuint)> onReady)
+{
+   Shader shaders[3] =
+   {
+      { vShaderFile, GL_VERTEX_SHADER, NULL },
+      { gShaderFile, GL_GEOMETRY_SHADER, NULL },
+      { fShaderFile, GL_FRAGMENT_SHADER, NULL }
+   };
+   queueProgram(shaders, 3, true, onReady);
+}
+
+void InitShaderAsync(const char* vShaderFile, const char* fShaderFile, const std::vector<std::string>& defines, std::function<void(GLuint)> onReady)
+{
+   Shader shaders[2] =
+   {
+      { vShaderFile, GL_VERTEX_SHADER, NULL },
+      { fShaderFile, GL_FRAGMENT_SHADER, NULL }
+   };
+   queueProgram(shaders, 2, true, onReady, defineLines(defines));
+}
+
+GLuint InitStageProgramAsync(GLenum type, const char* shaderFile, const std::vector<std::string>& defines, std::function<void(GLuint)> onReady)
+{
+   const std::string key = stageKey(type, shaderFile, defines);
+   auto found = stagePrograms.find(key);
+   if (found != stagePrograms.end())
+   {
+      return found->second;
+   }
+   if (pendingStages.count(key) > 0) return -1;
+
+   pendingStages.insert(key);
+   const int generation = stageGeneration;
+   Shader shaders[1] =
+   {
+      { shaderFile, type, NULL }
+   };
+   queueProgram(shaders, 1, type == GL_VERTEX_SHADER, [key, generation, onReady](GLuint program)
+   {
+      if (generation != stageGeneration)
+      {
+         //Built from files that have been edited since
+         if (program != -1) glDeleteProgram(program);
+         return;
+      }
+      //Failures are remembered too, so a broken stage isn't recompiled every frame
+      pendingStages.erase(key);
+      stagePrograms[key] = program;
+      if (program != -1 && onReady) onReady(program);
+   }, defineLines(defines), true);
+   return -1;
+}
+
+static int pollShaders(bool wait)
+{
+   //Take finished programs out of the list before calling back, since callbacks may queue more
+   std::vector<PendingProgram> ready;
+   for (size_t i = 0; i < pendingPrograms.size();)
+   {
+      if (wait || isComplete(pendingPrograms[i]))
+      {
+         ready.push_back(pendingPrograms[i]);
+         pendingPrograms.erase(pendingPrograms.begin() + i);
+      }
+      else
+      {
+         ++i;
+      }
+   }
+
+   for (size_t i = 0; i < ready.size(); ++i)
+   {
+      GLuint program = finishProgram(ready[i]);
+      if (ready[i].onReady)
+      {
+         ready[i].onReady(program);
+      }
+   }
+   return int(pendingPrograms.size());
+}
+
+int PollShaders()
+{
+   return pollShaders(false);
+}
+
+void WaitShaders()
+{
+   //Querying link status blocks until the driver is done, no need to spin
+   while (pollShaders(true) > 0) {}
 }
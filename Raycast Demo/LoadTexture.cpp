@@ -1,34 +1,126 @@
 #include "LoadTexture.h"
+#include "HalfFloat.h"
 #include "FreeImage.h"
+#include <cstring>
+#include <iostream>
 
 
-GLuint LoadTexture(const std::string& fname)
+bool LoadImageBGRA(const std::string& fname, std::vector<GLubyte>& bytes, GLuint& w, GLuint& h)
 {
-   GLuint tex_id;
-
    FIBITMAP* tempImg = FreeImage_Load(FreeImage_GetFileType(fname.c_str(), 0), fname.c_str());
+   if (tempImg == NULL)
+   {
+      return false;
+   }
    FIBITMAP* img = FreeImage_ConvertTo32Bits(tempImg);
 
    FreeImage_Unload(tempImg);
 
-   GLuint w = FreeImage_GetWidth(img);
-   GLuint h = FreeImage_GetHeight(img);
+   w = FreeImage_GetWidth(img);
+   h = FreeImage_GetHeight(img);
    GLuint scanW = FreeImage_GetPitch(img);
 
-   GLubyte* byteImg = new GLubyte[h*scanW];
-   FreeImage_ConvertToRawBits(byteImg, img, scanW, 32, FI_RGBA_RED_MASK, FI_RGBA_GREEN_MASK, FI_RGBA_BLUE_MASK, FALSE);
+   bytes.resize(h*scanW);
+   FreeImage_ConvertToRawBits(bytes.data(), img, scanW, 32, FI_RGBA_RED_MASK, FI_RGBA_GREEN_MASK, FI_RGBA_BLUE_MASK, FALSE);
+   FreeImage_Unload(img);
+
+   return true;
+}
+
+bool LoadImageRGBAF(const std::string& fname, std::vector<float>& pixels, GLuint& w, GLuint& h)
+{
+   FIBITMAP* tempImg = FreeImage_Load(FreeImage_GetFileType(fname.c_str(), 0), fname.c_str());
+   if (tempImg == NULL)
+   {
+      return false;
+   }
+   FIBITMAP* img = FreeImage_ConvertToRGBAF(tempImg);
+   FreeImage_Unload(tempImg);
+   if (img == NULL)
+   {
+      return false;
+   }
+
+   w = FreeImage_GetWidth(img);
+   h = FreeImage_GetHeight(img);
+
+   //FreeImage scanlines are padded, copy them into a tightly packed array
+   pixels.resize(size_t(4) * w * h);
+   for (GLuint y = 0; y < h; y++)
+   {
+      const float* scanline = (const float*)FreeImage_GetScanLine(img, y);
+      memcpy(&pixels[size_t(4) * w * y], scanline, size_t(4) * w * sizeof(float));
+   }
    FreeImage_Unload(img);
 
+   return true;
+}
+
+GLuint LoadHdrTexture(const std::string& fname, GLenum internal_format)
+{
+   GLuint w = 0;
+   GLuint h = 0;
+   std::vector<float> pixels;
+   if (LoadImageRGBAF(fname, pixels, w, h) == false)
+   {
+      std::cerr << "Failed to load " << fname << std::endl;
+      return 0;
+   }
+
+   GLuint tex_id;
    glGenTextures(1, &tex_id);
    glBindTexture(GL_TEXTURE_2D, tex_id);
-   glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, w, h, 0, GL_BGRA, GL_UNSIGNED_BYTE, byteImg);
+   glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+   if (internal_format == GL_RGB9_E5)
+   {
+      std::vector<GLuint> packed(size_t(w) * h);
+      FloatToRGB9E5(pixels.data(), packed.data(), packed.size(), 4);
+      glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB9_E5, w, h, 0, GL_RGB, GL_UNSIGNED_INT_5_9_9_9_REV, packed.data());
+   }
+   else if (internal_format == GL_RGBA32F)
+   {
+      glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, w, h, 0, GL_RGBA, GL_FLOAT, pixels.data());
+   }
+   else
+   {
+      //Convert on the CPU so the driver uploads half the bytes and doesn't convert itself
+      std::vector<uint16_t> half(pixels.size());
+      FloatToHalf(pixels.data(), half.data(), pixels.size());
+      glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, w, h, 0, GL_RGBA, GL_HALF_FLOAT, half.data());
+   }
+
    glGenerateMipmap(GL_TEXTURE_2D);
    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+   glBindTexture(GL_TEXTURE_2D, 0);
+
+   return tex_id;
+}
+
+GLuint LoadTexture(const std::string& fname)
+{
+   GLuint tex_id;
+
+   GLuint w = 0;
+   GLuint h = 0;
+   std::vector<GLubyte> byteImg;
+   if (LoadImageBGRA(fname, byteImg, w, h) == false)
+   {
+      std::cerr << "Failed to load " << fname << std::endl;
+      return 0;
+   }
 
-   delete byteImg;
+   glGenTextures(1, &tex_id);
+   glBindTexture(GL_TEXTURE_2D, tex_id);
+   glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, w, h, 0, GL_BGRA, GL_UNSIGNED_BYTE, byteImg.data());
+   glGenerateMipmap(GL_TEXTURE_2D);
+   glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+   glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+   glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+   glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 
    return tex_id;
 }
\ No newline at end of file
@@ -1,6 +1,7 @@
 
 
 #include <windows.h>
+#include "FrameCapture.h" //includes glew, which has to come before gl.h
 #include "Callbacks.h"
 #include "Scene.h"
 
@@ -55,6 +56,7 @@ int main(int argc, char **argv)
       /* Poll for and process events */
       glfwPollEvents();
    }
+   FrameCapture::Shutdown(); //finish writing screenshots while the context still exists
 
     // Cleanup ImGui
     ImGui_ImplOpenGL3_Shutdown();
@@ -20,10 +20,14 @@
 
 #include "Scene.h"
 #include "Uniforms.h"
+#include "UniformRing.h"   //Per-frame uniform data
+#include "UniformBlocks.h" //Light and material uniform blocks
 #include "InitShader.h"    //Functions for loading shaders from text files
+#include "ShaderWatcher.h"  //Rebuilds shaders when their files change
 #include "LoadMesh.h"      //Functions for creating OpenGL buffers from mesh files
 #include "LoadTexture.h"   //Functions for creating OpenGL textures from image files
 #include "VideoRecorder.h"      //Functions for saving videos
+#include "FrameCapture.h"       //Asynchronous screenshots and frame dumps
 #include "DebugCallback.h"
 #include "AttriblessRendering.h"
 
@@ -34,6 +38,19 @@ static const std::string vertex_shader("raycast_vs.glsl");
 static const std::string fragment_shader("raycast_fs.glsl");
 GLuint shader_program = -1;
 
+//Reports C++ structs that don't match the uniform blocks the program declares
+static void ValidateProgram(GLuint program)
+{
+   if (program == -1) return;
+   UniformBlocks::Validate(program);
+}
+
+//Specialized programs with the raycast mode compiled in. shader_program branches on the mode uniform instead.
+ShaderVariants shader_variants(vertex_shader, fragment_shader, ValidateProgram);
+bool use_variants = true;
+glm::vec4 slider(1.0f);
+float time_sec = 0.0f;
+
 static const std::string mesh_name = "Amago0.obj";
 static const std::string texture_name = "AmagoT.bmp";
 
@@ -43,6 +60,8 @@ GLuint fbo_tex = -1;
 float view_angle = 0.0f;
 float aspect = 1.0f;
 bool recording = false;
+bool offline_capture = false;  //fixed timestep and no vsync while recording
+double capture_start_sec = 0.0;
 
 enum MODES
 {
@@ -81,13 +100,30 @@ void Scene::Display(GLFWwindow* window)
    Camera::V = glm::lookAt(glm::vec3(Uniforms::SceneData.eye_w), glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f))*glm::rotate(view_angle, glm::vec3(0.0f, 1.0f, 0.0f));
    Uniforms::SceneData.PV = Camera::P * Camera::V;
    Uniforms::SceneData.PVinv = glm::inverse(Uniforms::SceneData.PV);
+   UniformRing::BeginFrame();
    Uniforms::BufferSceneData();
+   UniformBlocks::Update(); //light and material, when the GUI has changed them
 
-   glUseProgram(shader_program);
+   GLuint program = -1;
+   if (use_variants == true)
+   {
+      program = shader_variants.Get({ "MODE " + std::to_string(mode) });
+   }
+   if (program == -1)
+   {
+      program = shader_program;
+   }
+   glUseProgram(program);
 
-   //Set uniforms
+   //Set uniforms. Each variant is a separate program, so they are set every frame.
    glm::mat4 M = glm::mat4(1.0f);
    glUniformMatrix4fv(Uniforms::UniformLocs::M, 1, false, glm::value_ptr(M));
+   glUniform1f(Uniforms::UniformLocs::time, time_sec);
+   glUniform4fv(Uniforms::UniformLocs::slider, 1, &slider.x);
+   if (program == shader_program)
+   {
+      glUniform1i(Uniforms::UniformLocs::mode, mode);
+   }
 
    /////////////////////////////////////////////////////////////
    // Begin pass 0: render proxy geometry back faces to texture.
@@ -117,15 +153,20 @@ void Scene::Display(GLFWwindow* window)
 
    DrawGui(window);
 
+   //Screenshots and frame dumps of the finished frame
+   glReadBuffer(GL_BACK);
+   FrameCapture::Update();
+
    if (recording == true)
    {
-      glFinish();
       glReadBuffer(GL_BACK);
       int w, h;
       glfwGetFramebufferSize(window, &w, &h);
       VideoRecorder::EncodeBuffer(GL_BACK);
    }
 
+   UniformRing::EndFrame();
+
    /* Swap front and back buffers */
    glfwSwapBuffers(window);
 }
@@ -158,6 +199,11 @@ void Scene::DrawGui(GLFWwindow* window)
          const int fps = 60;
          const int bitrate = 4000000;
          VideoRecorder::Start(video_filename, w, h, fps, bitrate); //Uses ffmpeg
+         if (offline_capture == true)
+         {
+            capture_start_sec = glfwGetTime();
+            glfwSwapInterval(0); //render as fast as the encoder accepts frames
+         }
       }
    }
    else
@@ -166,12 +212,54 @@ void Scene::DrawGui(GLFWwindow* window)
       {
          recording = false;
          VideoRecorder::Stop(); //Uses ffmpeg
+         if (offline_capture == true)
+         {
+            glfwSetTime(capture_start_sec + VideoRecorder::FrameTime()); //carry on from the end of the video
+            glfwSwapInterval(1);
+         }
       }
    }
    ImGui::SameLine();
    ImGui::InputText("Video filename", video_filename, filename_len);
+   if (recording == false)
+   {
+      ImGui::Checkbox("Offline capture (fixed timestep, no vsync)", &offline_capture);
+      ImGui::Checkbox("Convert to YUV on the GPU", &VideoRecorder::ConvertOnGpu);
+   }
+   else
+   {
+      ImGui::Text("Recording: %.1f frames/s, %.3f ms/frame on the render thread, %d frames queued, %d readback buffers",
+         VideoRecorder::CaptureFps(), VideoRecorder::RenderThreadMs(), VideoRecorder::QueuedFrames(), VideoRecorder::ReadbackBuffers());
+      const VideoRecorder::CaptureStats stats = VideoRecorder::Stats();
+      ImGui::Text("   wait %.2f ms, convert %.2f ms, encode %.2f ms, mux %.2f ms, %d dropped, %d at half resolution",
+         stats.wait_ms, stats.convert_ms, stats.encode_ms, stats.mux_ms, stats.dropped, stats.half_res);
+   }
 
 
+   static char screenshot_filename[filename_len] = "screenshot.png";
+   static int screenshot_format = FrameCapture::PNG;
+   static int screenshot_source = 0;
+   static int dump_frames = 300;
+   const GLuint screenshot_textures[] = { GLuint(-1), fbo_tex };
+   if (ImGui::Button("Save screenshot"))
+   {
+      FrameCapture::StartBurst(screenshot_filename, FrameCapture::Format(screenshot_format), 1, screenshot_textures[screenshot_source]);
+   }
+   ImGui::SameLine();
+   if (ImGui::Button("Dump frames"))
+   {
+      FrameCapture::StartBurst(screenshot_filename, FrameCapture::Format(screenshot_format), dump_frames, screenshot_textures[screenshot_source]);
+   }
+   ImGui::SameLine();
+   ImGui::InputText("Screenshot filename", screenshot_filename, filename_len);
+   ImGui::Combo("Screenshot format", &screenshot_format, "PNG\0EXR (float)\0Raw float RGBA\0");
+   ImGui::Combo("Screenshot source", &screenshot_source, "Back buffer\0fbo_tex\0");
+   ImGui::SliderInt("Frames to dump", &dump_frames, 2, 1000);
+   if (FrameCapture::BurstActive() || FrameCapture::Pending() > 0 || FrameCapture::Skipped() > 0)
+   {
+      ImGui::Text("Screenshots: %d being written, %d skipped (no free readback buffer)", FrameCapture::Pending(), FrameCapture::Skipped());
+   }
+
    ImGui::Image((ImTextureID)(intptr_t)fbo_tex, ImVec2(128.0f, 128.0f), ImVec2(0.0, 1.0), ImVec2(1.0, 0.0));
    static bool wireframe = false;
    if(ImGui::Checkbox("Wireframe", &wireframe))
@@ -188,16 +276,14 @@ void Scene::DrawGui(GLFWwindow* window)
    
    ImGui::RadioButton("Outside looking in", &mode, OUTSIDE_LOOKING_IN); ImGui::SameLine();
    ImGui::RadioButton("Inside looking out", &mode, INSIDE_LOOKING_OUT);
-   glUniform1i(Uniforms::UniformLocs::mode, mode);
+   ImGui::Checkbox("Specialized shader variants", &use_variants);
+   ImGui::SameLine();
+   ImGui::Text("(%d built, %d compiling)", shader_variants.NumVariants(), shader_variants.NumPending());
 
    ImGui::SliderFloat("View angle", &view_angle, -glm::pi<float>(), +glm::pi<float>());
    ImGui::SliderFloat("View Dist", &Uniforms::SceneData.eye_w.z, 3.0f, 10.0f);
 
-   static glm::vec4 slider(1.0f);
-   if(ImGui::SliderFloat4("Slider", &slider.x, -1.0f, +2.0f))
-   {
-      glUniform4fv(Uniforms::UniformLocs::slider, 1, &slider.x);
-   }
+   ImGui::SliderFloat4("Slider", &slider.x, -1.0f, +2.0f);
 
    ImGui::Text("Application average %.3f ms/frame (%.1f FPS)", 1000.0f / ImGui::GetIO().Framerate, ImGui::GetIO().Framerate);
 
@@ -213,21 +299,32 @@ void Scene::DrawGui(GLFWwindow* window)
    ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
 }
 
+//Offline capture advances exactly one video frame per rendered frame, whatever the wall clock says
+static double scene_time()
+{
+   if (recording == true && offline_capture == true)
+   {
+      return capture_start_sec + VideoRecorder::FrameTime();
+   }
+   return glfwGetTime();
+}
+
 void Scene::Idle()
 {
-   float time_sec = static_cast<float>(glfwGetTime());
+   //Frame boundary: rebuild edited shaders and swap in programs that finished linking
+   ShaderWatcher::Poll();
+   PollShaders();
 
-   //Pass time_sec value to the shaders
-   glUniform1f(Uniforms::UniformLocs::time, time_sec);
+   //Passed to the shaders in Display, since the program depends on the mode
+   time_sec = static_cast<float>(scene_time());
 }
 
-void Scene::ReloadShader()
+//Swap in new_shader once it has linked. If it failed keep rendering with the previous program.
+static void ShaderReady(GLuint new_shader)
 {
-   GLuint new_shader = InitShader(vertex_shader.c_str(), fragment_shader.c_str());
-
    if (new_shader == -1) // loading failed
    {
-      DebugBreak(); //alert user by breaking and showing debugger
+      std::cerr << "Shader build failed, keeping the previous program" << std::endl;
       glClearColor(1.0f, 0.0f, 1.0f, 0.0f); //change clear color if shader can't be compiled
    }
    else
@@ -239,9 +336,20 @@ void Scene::ReloadShader()
          glDeleteProgram(shader_program);
       }
       shader_program = new_shader;
+      ValidateProgram(shader_program);
+      glUseProgram(shader_program);
+
+      //Variants are rebuilt from the edited files the next time they are used
+      shader_variants.Clear();
    }
 }
 
+//Rebuilds in the background. The new program is swapped in by PollShaders() in Idle().
+void Scene::ReloadShader()
+{
+   InitShaderAsync(vertex_shader.c_str(), fragment_shader.c_str(), ShaderReady);
+}
+
 //Initialize OpenGL state. This function only gets called once.
 void Scene::Init()
 {
@@ -281,7 +389,10 @@ void Scene::Init()
    glEnable(GL_CULL_FACE);
    glFrontFace(GL_CW);
 
+   //Start compiling without waiting so the driver works on it while assets load
    ReloadShader();
+   ShaderWatcher::Add({ vertex_shader, fragment_shader }, ReloadShader);
+   ShaderWatcher::Start();
 
    //Create a texture object and set initial wrapping and filtering state.
    //For raycasting create a floating point texture so we have high precision storage for ray endpoints.
@@ -303,6 +414,13 @@ void Scene::Init()
 
    //unbind the fbo
    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+   WaitShaders(); //only blocks for whatever compiling is left
+   glUseProgram(shader_program);
+   //Build the specialized variants in the background, shader_program draws until they have linked
+   shader_variants.Queue({ "MODE " + std::to_string(OUTSIDE_LOOKING_IN) });
+   shader_variants.Queue({ "MODE " + std::to_string(INSIDE_LOOKING_OUT) });
+
    Camera::UpdateP();
    Uniforms::Init();
+   ValidateProgram(shader_program); //ShaderReady ran before Uniforms::Init described the blocks
 }
\ No newline at end of file
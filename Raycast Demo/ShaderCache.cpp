@@ -0,0 +1,129 @@
+#include "ShaderCache.h"
+
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <vector>
+
+namespace ShaderCache
+{
+   bool Enabled = true;
+
+   const char* cache_dir = "shader_cache";
+   const uint32_t file_magic = 0x42504c47; //"GLPB"
+   const uint32_t file_version = 1;
+
+   //64-bit FNV-1a
+   static uint64_t hash_bytes(uint64_t h, const void* data, size_t size)
+   {
+      const unsigned char* p = (const unsigned char*)data;
+      for (size_t i = 0; i < size; i++)
+      {
+         h ^= p[i];
+         h *= 0x100000001b3ull;
+      }
+      return h;
+   }
+
+   static bool binaries_supported()
+   {
+      GLint num_formats = 0;
+      glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &num_formats);
+      return num_formats > 0;
+   }
+
+   static std::string cache_filename(uint64_t key)
+   {
+      std::ostringstream oss;
+      oss << cache_dir << "/" << std::hex << key << ".bin";
+      return oss.str();
+   }
+
+   uint64_t AddString(uint64_t key, const char* str)
+   {
+      if (str == nullptr) return key;
+      //Include the terminator so ("ab","c") and ("a","bc") hash differently
+      return hash_bytes(key, str, strlen(str) + 1);
+   }
+
+   uint64_t BeginKey()
+   {
+      uint64_t key = 0xcbf29ce484222325ull;
+      key = hash_bytes(key, &file_version, sizeof(file_version));
+      key = AddString(key, (const char*)glGetString(GL_VENDOR));
+      key = AddString(key, (const char*)glGetString(GL_RENDERER));
+      key = AddString(key, (const char*)glGetString(GL_VERSION));
+      return key;
+   }
+
+   uint64_t AddSource(uint64_t key, GLenum type, const char* source)
+   {
+      key = hash_bytes(key, &type, sizeof(type));
+      return AddString(key, source);
+   }
+
+   GLuint LoadProgram(uint64_t key, bool separable)
+   {
+      if (Enabled == false || binaries_supported() == false) return -1;
+
+      std::ifstream ifs(cache_filename(key), std::ios::in | std::ios::binary);
+      if (!ifs.is_open()) return -1;
+
+      uint32_t magic = 0, version = 0, format = 0, length = 0;
+      ifs.read((char*)&magic, sizeof(magic));
+      ifs.read((char*)&version, sizeof(version));
+      ifs.read((char*)&format, sizeof(format));
+      ifs.read((char*)&length, sizeof(length));
+      if (!ifs || magic != file_magic || version != file_version || length == 0) return -1;
+
+      std::vector<char> binary(length);
+      ifs.read(binary.data(), length);
+      if (!ifs) return -1;
+
+      GLuint program = glCreateProgram();
+      if (separable == true)
+      {
+         glProgramParameteri(program, GL_PROGRAM_SEPARABLE, GL_TRUE);
+      }
+      glProgramBinary(program, format, binary.data(), length);
+
+      GLint linked = 0;
+      glGetProgramiv(program, GL_LINK_STATUS, &linked);
+      if (!linked)
+      {
+         //Driver rejected the binary (e.g. after a driver update with the same version string)
+         glDeleteProgram(program);
+         return -1;
+      }
+      return program;
+   }
+
+   void SaveProgram(uint64_t key, GLuint program)
+   {
+      if (Enabled == false || binaries_supported() == false) return;
+
+      GLint length = 0;
+      glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+      if (length <= 0) return;
+
+      std::vector<char> binary(length);
+      GLenum format = 0;
+      glGetProgramBinary(program, length, nullptr, &format, binary.data());
+
+      CreateDirectoryA(cache_dir, NULL); //fails harmlessly if it already exists
+      std::ofstream ofs(cache_filename(key), std::ios::out | std::ios::binary | std::ios::trunc);
+      if (!ofs.is_open())
+      {
+         std::cerr << "Could not write shader cache file " << cache_filename(key) << std::endl;
+         return;
+      }
+      const uint32_t format32 = format;
+      const uint32_t length32 = length;
+      ofs.write((const char*)&file_magic, sizeof(file_magic));
+      ofs.write((const char*)&file_version, sizeof(file_version));
+      ofs.write((const char*)&format32, sizeof(format32));
+      ofs.write((const char*)&length32, sizeof(length32));
+      ofs.write(binary.data(), length);
+   }
+};
@@ -0,0 +1,32 @@
+#ifndef __SHADERCACHE_H__
+#define __SHADERCACHE_H__
+
+#include <stdint.h>
+#include <windows.h>
+#include <GL/glew.h>
+
+/*
+On-disk cache of linked program binaries (glGetProgramBinary / glProgramBinary).
+
+Programs are keyed by a hash of every stage's type and source text together with
+GL_VENDOR, GL_RENDERER and GL_VERSION, so editing a shader or updating the driver
+simply misses the cache. Drivers may still reject a stored binary, in which case
+LoadProgram returns -1 and the caller compiles from source as usual.
+
+InitShader uses this automatically. Files are written to the shader_cache directory.
+*/
+
+namespace ShaderCache
+{
+   extern bool Enabled;
+
+   //Start a key. Call AddSource once per stage, then pass the key to LoadProgram/SaveProgram.
+   uint64_t BeginKey();
+   uint64_t AddSource(uint64_t key, GLenum type, const char* source);
+   uint64_t AddString(uint64_t key, const char* str);
+
+   GLuint LoadProgram(uint64_t key, bool separable = false); //returns a linked program or -1
+   void SaveProgram(uint64_t key, GLuint program);
+};
+
+#endif
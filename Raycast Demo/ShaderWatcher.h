@@ -0,0 +1,24 @@
+#pragma once
+
+#include <functional>
+#include <string>
+#include <vector>
+
+/*
+Watches shader source files and reports edits so programs can be rebuilt while the app runs.
+
+A background thread waits on a directory change notification and compares the last-write
+times of the watched files. Callbacks are never run on that thread: Poll() runs them on the
+render thread, where they can queue an InitShaderAsync rebuild. Combined with PollShaders()
+the new program replaces the old one at a frame boundary only after it links, and the old
+program keeps rendering in the meantime.
+*/
+
+namespace ShaderWatcher
+{
+   //onChanged is called (from Poll) after any of the files is saved
+   void Add(const std::vector<std::string>& files, std::function<void()> onChanged);
+   void Start();
+   void Stop();
+   void Poll(); //call once per frame on the render thread
+};
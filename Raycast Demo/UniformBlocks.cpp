@@ -0,0 +1,202 @@
+#include "UniformBlocks.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+
+namespace UniformBlocks
+{
+   struct Block
+   {
+      std::string name;
+      GLuint binding;
+      const GLubyte* data;         //nullptr for described blocks
+      GLsizeiptr size;
+      std::vector<Member> members;
+      GLintptr offset;             //in buffer
+      std::vector<GLubyte> shadow; //the bytes last uploaded
+   };
+
+   std::vector<Block> blocks;
+   GLuint buffer = -1;
+   int uploaded_bytes = 0;
+
+   //Changed ranges are widened to this many bytes, a vec4
+   const GLsizeiptr granularity = 16;
+
+void Add(const char* name, GLuint binding, const void* data, GLsizeiptr size, const std::vector<Member>& members)
+{
+   blocks.push_back({ name, binding, (const GLubyte*)data, size, members, 0 });
+}
+
+void Describe(const char* name, GLuint binding, GLsizeiptr size, const std::vector<Member>& members)
+{
+   blocks.push_back({ name, binding, nullptr, size, members, 0 });
+}
+
+//std140 rounds a block up to a vec4, and the bound range must cover the whole block. The C++ struct
+//may stop at its last member (e.g. a float after three vec4s).
+static GLsizeiptr bound_size(GLsizeiptr size)
+{
+   return (size + 15) / 16 * 16;
+}
+
+void Init()
+{
+   GLint alignment = 256;
+   glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+   GLsizeiptr buffer_size = 0;
+   for (Block& b : blocks)
+   {
+      if (b.data == nullptr) continue;
+      b.offset = (buffer_size + alignment - 1) / alignment * alignment;
+      buffer_size = b.offset + bound_size(b.size);
+   }
+
+   //Written only by Update, so it doesn't need to be mappable
+   glCreateBuffers(1, &buffer);
+   glNamedBufferStorage(buffer, buffer_size, nullptr, GL_DYNAMIC_STORAGE_BIT);
+   for (Block& b : blocks)
+   {
+      if (b.data == nullptr) continue;
+      glNamedBufferSubData(buffer, b.offset, b.size, b.data);
+      b.shadow.assign(b.data, b.data + b.size);
+      glBindBufferRange(GL_UNIFORM_BUFFER, b.binding, buffer, b.offset, bound_size(b.size));
+   }
+}
+
+void Update()
+{
+   uploaded_bytes = 0;
+   for (Block& b : blocks)
+   {
+      if (b.data == nullptr) continue;
+
+      //One range per block, from the first to the last changed vec4. The blocks are small, and a
+      //GUI edit changes a member or two, so finer ranges wouldn't pay for the extra calls.
+      GLsizeiptr first = -1, last = -1;
+      for (GLsizeiptr i = 0; i < b.size; i += granularity)
+      {
+         const GLsizeiptr n = (b.size - i < granularity) ? b.size - i : granularity;
+         if (memcmp(b.data + i, &b.shadow[i], n) != 0)
+         {
+            if (first == -1) first = i;
+            last = i + n;
+         }
+      }
+      if (first == -1) continue;
+
+      glNamedBufferSubData(buffer, b.offset + first, last - first, b.data + first);
+      memcpy(&b.shadow[first], b.data + first, last - first);
+      uploaded_bytes += int(last - first);
+   }
+}
+
+int UploadedBytes() {return uploaded_bytes;}
+
+//Bytes a member takes in a std140 block, including the padding of array elements and matrix columns
+static GLint std140_size(GLenum type, GLint array_size, GLint array_stride, GLint matrix_stride)
+{
+   if (array_stride > 0) return array_stride * array_size;
+
+   GLint components = 1, columns = 1;
+   switch (type)
+   {
+   case GL_FLOAT_VEC2: case GL_INT_VEC2: case GL_UNSIGNED_INT_VEC2: case GL_BOOL_VEC2: components = 2; break;
+   case GL_FLOAT_VEC3: case GL_INT_VEC3: case GL_UNSIGNED_INT_VEC3: case GL_BOOL_VEC3: components = 3; break;
+   case GL_FLOAT_VEC4: case GL_INT_VEC4: case GL_UNSIGNED_INT_VEC4: case GL_BOOL_VEC4: components = 4; break;
+   case GL_FLOAT_MAT2: columns = 2; break;
+   case GL_FLOAT_MAT3: columns = 3; break;
+   case GL_FLOAT_MAT4: columns = 4; break;
+   case GL_FLOAT_MAT2x3: case GL_FLOAT_MAT2x4: columns = 2; break;
+   case GL_FLOAT_MAT3x2: case GL_FLOAT_MAT3x4: columns = 3; break;
+   case GL_FLOAT_MAT4x2: case GL_FLOAT_MAT4x3: columns = 4; break;
+   }
+   if (matrix_stride > 0) return matrix_stride * columns;
+   return 4 * components;
+}
+
+//"LightUniforms.La" for blocks with an instance name, "lights[0]" for arrays: keep the member name
+static std::string member_name(const char* reflected)
+{
+   std::string name = reflected;
+   const size_t dot = name.find_last_of('.');
+   if (dot != std::string::npos) name = name.substr(dot + 1);
+   const size_t bracket = name.find('[');
+   if (bracket != std::string::npos) name = name.substr(0, bracket);
+   return name;
+}
+
+bool Validate(GLuint program)
+{
+   bool valid = true;
+   for (const Block& b : blocks)
+   {
+      const GLuint index = glGetUniformBlockIndex(program, b.name.c_str());
+      if (index == GL_INVALID_INDEX) continue; //not used by this program
+
+      GLint data_size = 0, binding = 0, count = 0;
+      glGetActiveUniformBlockiv(program, index, GL_UNIFORM_BLOCK_DATA_SIZE, &data_size);
+      glGetActiveUniformBlockiv(program, index, GL_UNIFORM_BLOCK_BINDING, &binding);
+      glGetActiveUniformBlockiv(program, index, GL_UNIFORM_BLOCK_ACTIVE_UNIFORMS, &count);
+      if (GLuint(binding) != b.binding)
+      {
+         fprintf(stderr, "%s: binding %d in the shader, %d in C++\n", b.name.c_str(), binding, b.binding);
+         valid = false;
+      }
+      //Drivers may or may not count the padding after the last member
+      if (data_size < b.size || data_size > bound_size(b.size))
+      {
+         fprintf(stderr, "%s: %d bytes in the shader, %d in C++\n", b.name.c_str(), data_size, int(b.size));
+         valid = false;
+      }
+      if (count == 0) continue;
+
+      std::vector<GLint> indices(count);
+      glGetActiveUniformBlockiv(program, index, GL_UNIFORM_BLOCK_ACTIVE_UNIFORM_INDICES, indices.data());
+      const GLuint* uniforms = (const GLuint*)indices.data();
+      std::vector<GLint> offsets(count), types(count), array_sizes(count), array_strides(count), matrix_strides(count);
+      glGetActiveUniformsiv(program, count, uniforms, GL_UNIFORM_OFFSET, offsets.data());
+      glGetActiveUniformsiv(program, count, uniforms, GL_UNIFORM_TYPE, types.data());
+      glGetActiveUniformsiv(program, count, uniforms, GL_UNIFORM_SIZE, array_sizes.data());
+      glGetActiveUniformsiv(program, count, uniforms, GL_UNIFORM_ARRAY_STRIDE, array_strides.data());
+      glGetActiveUniformsiv(program, count, uniforms, GL_UNIFORM_MATRIX_STRIDE, matrix_strides.data());
+
+      std::vector<bool> found(b.members.size(), false);
+      for (int i = 0; i < count; i++)
+      {
+         char reflected[256];
+         glGetActiveUniformName(program, uniforms[i], sizeof(reflected), nullptr, reflected);
+         const std::string name = member_name(reflected);
+         const GLint size = std140_size(types[i], array_sizes[i], array_strides[i], matrix_strides[i]);
+
+         size_t m = 0;
+         while (m < b.members.size() && name != b.members[m].name) m++;
+         if (m == b.members.size())
+         {
+            fprintf(stderr, "%s: %s (offset %d) has no C++ member\n", b.name.c_str(), name.c_str(), offsets[i]);
+            valid = false;
+            continue;
+         }
+         found[m] = true;
+         const Member& member = b.members[m];
+         if (member.offset != offsets[i] || member.size != size)
+         {
+            fprintf(stderr, "%s: %s is %d bytes at offset %d in the shader, %d bytes at offset %d in C++\n",
+               b.name.c_str(), name.c_str(), size, offsets[i], member.size, member.offset);
+            valid = false;
+         }
+      }
+      //Every member of a std140 block is active, so a missing one isn't in the GLSL block
+      for (size_t m = 0; m < b.members.size(); m++)
+      {
+         if (found[m] == false)
+         {
+            fprintf(stderr, "%s: C++ member %s is not in the shader\n", b.name.c_str(), b.members[m].name);
+            valid = false;
+         }
+      }
+   }
+   return valid;
+}
+};
@@ -2,6 +2,7 @@
 extern "C" {
 #include <libavutil/avassert.h>
 #include <libavutil/channel_layout.h>
+#include <libavutil/imgutils.h>
 #include <libavutil/opt.h>
 #include <libavutil/mathematics.h>
 #include <libavutil/timestamp.h>
@@ -13,6 +14,20 @@ extern "C" {
 }
 
 #include "VideoRecorder.h"
+#include "RawWriter.h"
+#include "SpscQueue.h"
+#include "YuvConvert.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
 
 //Modified from the muxing.c example at https://ffmpeg.org/doxygen/trunk/muxing_8c-source.html
 
@@ -22,6 +37,8 @@ extern "C" {
 
 namespace VideoRecorder
 {
+   struct ReplayRing;
+
    // a wrapper around a single output AVStream
    struct OutputStream {
       AVStream* st;
@@ -34,88 +51,448 @@ namespace VideoRecorder
       float t, tincr, tincr2;
       struct SwsContext* sws_ctx;
       struct SwrContext* swr_ctx;
+      ReplayRing* replay; //encoded packets go here instead of to the file
+      bool unlimited;     //no STREAM_DURATION limit: replay rings and live streams run for the whole session
    };
 
-   OutputStream video_st = { 0 }, audio_st = { 0 };
-   const AVOutputFormat *fmt = 0;
-   AVFormatContext *oc = 0;
-   const AVCodec *audio_codec = 0;
-   const AVCodec *video_codec = 0;
-   int have_video = 0, have_audio = 0;
-   int encode_video = 0, encode_audio = 0;
    AVDictionary *opt = NULL;
 
    bool enable_logging = false;
    bool recording = false;
 
-   //Pixel buffer objects for transfer from OpenGL framebuffer
-   const int num_buffers = 2;
-   GLuint pixel_buffers[num_buffers] = {-1};
-   GLubyte* rgb[num_buffers] = {nullptr};
-   int buffer_index = 0;
-   int read_index = num_buffers-1;
+   //Pixel buffer objects for transfer from OpenGL framebuffer. Every readback is followed by a fence
+   //and the buffer is only mapped after the fence has signaled, so the render thread doesn't wait for
+   //the GPU. Once queued, a buffer belongs to the encoder thread until it comes back through done_queue.
+   struct ReadbackBuffer
+   {
+      GLuint pbo;
+      GLubyte* rgb;  //mapped pointer. Stays valid while the buffer exists when persistently mapped.
+      GLsync fence;  //signals when the readback has landed
+
+      //Set by the render thread for the frame in the buffer
+      int64_t frame;  //capture index, used as the pts so dropped frames leave a gap instead of speeding up the video
+      float wait_ms;  //render thread time spent waiting for a free buffer
+      int queued;     //frames waiting for the encoder when this one was read back
+      bool half_res;  //read back at half width and height
+      int64_t capture_us; //wall clock time of the capture, for latency
+   };
+
+   const int max_buffers = 8;
+   const int min_buffers = 2;
+   const int initial_buffers = 3;
+   const int resize_interval = 120; //frames between attempts to shrink the ring
+   bool persistent_mapping = false;  //GL 4.4 buffer storage
+
+   //One encoded file. outputs[0] is the recording passed to Start, the rest are previews read from
+   //mip levels of the same captured frame. Each output has its own readback ring and encoder thread,
+   //so a slow encoder only holds up its own file.
+   struct Output
+   {
+      std::string filename;
+      OutputStream video_st = { 0 }, audio_st = { 0 };
+      const AVOutputFormat *fmt = 0;
+      AVFormatContext *oc = 0;
+      const AVCodec *audio_codec = 0;
+      const AVCodec *video_codec = 0;
+      int have_video = 0, have_audio = 0;
+      int encode_video = 0, encode_audio = 0;
+
+      int level = 0;              //mip level of the capture this output reads, 0 is full size
+      int width = 0, height = 0;  //encoded size
+
+      ReadbackBuffer buffers[max_buffers] = {};
+      int num_buffers = 0;
+      std::vector<int> free_buffers;
+      std::deque<int> reading;          //readbacks in flight, oldest first
+      int buffer_size = 0;
+      int frames_since_resize = 0;
+      int peak_buffers_in_use = 0;
+
+      //Backpressure policy. Half resolution needs even half-size planes.
+      Options::Backpressure backpressure = Options::BLOCK;
+      bool half_res_mode = false;
+      bool frame_timestamps = false;  //Options::frame_timestamps
+
+      //The render thread only reads back and maps. Conversion, encoding and muxing run on the encoder thread.
+      SpscQueue<int, max_buffers> encode_queue; //render -> encoder: mapped buffers holding a frame
+      SpscQueue<int, max_buffers> done_queue;   //encoder -> render: buffers that can be reused
+      std::thread encoder;
+      std::atomic<bool> encoder_running{ false };
+      std::mutex wake_mutex;
+      std::condition_variable wake;
+
+      //Pipeline instrumentation. Averages are written by the encoder thread and read by the GUI.
+      float wait_ms = 0.0f;
+      std::atomic<float> convert_ms{ 0.0f }, encode_ms{ 0.0f }, mux_ms{ 0.0f };
+      std::atomic<float> latency_ms{ 0.0f };
+      std::atomic<int> dropped_frames{ 0 };
+      std::atomic<int> dropped_since_row{ 0 }; //drops since the last CSV row
+      int half_res_frames = 0;
+      FILE* stats_file = nullptr;             //encoder thread writes, Start/Stop open and close
+      std::vector<uint8_t> half_planes;       //encoder thread: YUV planes of a half resolution frame
+      std::unique_ptr<ReplayRing> replay;     //recording only, with Options::replay_seconds
+      std::unique_ptr<RawWriter> raw;         //Options::raw: frames go to a .y4m file instead of the encoder
+   };
+   //Instant replay: the last seconds of encoded packets, starting at a keyframe. The encoder thread
+   //appends and trims whole GOPs from the front, SaveReplay takes references to the packets.
+   struct ReplayRing
+   {
+      std::mutex mutex;
+      std::deque<AVPacket*> packets;  //decode order, packets[0] is a keyframe
+      AVCodecParameters* codecpar = nullptr;
+      AVRational time_base;           //of the packets: the encoder's
+      int64_t max_duration = 0;       //in time_base units
+      int64_t max_bytes = 0;
+      std::atomic<int64_t> bytes{ 0 };
+      std::atomic<int64_t> duration{ 0 };
+      int64_t peak_bytes = 0;
+
+      ~ReplayRing()
+      {
+         for (AVPacket* pkt : packets)
+         {
+            av_packet_free(&pkt);
+         }
+         avcodec_parameters_free(&codecpar);
+      }
+   };
+   std::vector<std::thread> replay_writers;
+
+   //Latency probe: a stand-in client that reads the stream and compares the capture timestamps carried
+   //in it with the wall clock
+   std::thread probe;
+   std::atomic<bool> probe_running(false);
+   std::atomic<float> probe_latency_ms(0.0f);
+   std::atomic<int> probe_frames(0);
+
+   //Identifies the SEI user data (H.264/H.265 "user data unregistered") that carries a frame's capture
+   //time: these 16 bytes followed by the microseconds since the epoch, little endian
+   const uint8_t timestamp_uuid[16] = { 0x3c, 0x8e, 0x41, 0x27, 0x9b, 0x55, 0x4d, 0x1a, 0xa6, 0x0f, 0x72, 0xd4, 0xe9, 0x13, 0x58, 0xb0 };
+
+   const int max_outputs = 8;
+   std::vector<std::unique_ptr<Output>> outputs;
+
+   //GPU colorspace conversion. The compute shader writes the flipped Y, U and V planes straight into
+   //the readback buffers (bound as a shader storage buffer), 1.5 bytes/pixel instead of 4.
+   bool ConvertOnGpu = true;
+   bool gpu_conversion = false;  //in use for the current recording
+   GLuint yuv_program = -1;
+
+   //Copy of the captured frame with a mip chain, read by every output when there are previews, by
+   //half resolution readbacks, and by the GPU conversion when it can't sample the source directly
+   GLuint capture_tex = -1;
+   GLuint capture_fbo = -1;
+   GLuint source_fbo = -1;       //reads EncodeTexture's texture when it has to be copied
+   int capture_width = 0, capture_height = 0;
+   int capture_levels = 0;
+
+   //Texture and buffer bindings used by the conversion, chosen to stay clear of the demos' own
+   const int yuv_texture_unit = 15;
+   const int yuv_buffer_binding = 7;
+
+   //One invocation converts an 8x2 block: two rows of 8 luma bytes and 4 bytes each of U and V
+   const char* yuv_compute_shader = R"(#version 430
+layout(local_size_x = 8, local_size_y = 8) in;
+layout(binding = 15) uniform sampler2D rgb_tex;
+layout(location = 0) uniform ivec2 size;
+layout(location = 1) uniform int level;
+layout(std430, binding = 7) writeonly buffer Planes { uint planes[]; };
+
+//BT.601 limited range, the swscale default for YUV420P
+float luma(vec3 c) { return 16.0 + 219.0*dot(c, vec3(0.299, 0.587, 0.114)); }
+float cb(vec3 c) { return 128.0 + 224.0*dot(c, vec3(-0.168736, -0.331264, 0.5)); }
+float cr(vec3 c) { return 128.0 + 224.0*dot(c, vec3(0.5, -0.418688, -0.081312)); }
+uint to_byte(float v) { return uint(clamp(round(v), 0.0, 255.0)); }
+
+void main()
+{
+   int x0 = int(gl_GlobalInvocationID.x)*8;
+   int y0 = int(gl_GlobalInvocationID.y)*2;
+   if(x0 >= size.x || y0 >= size.y) return;
+
+   int y_stride = (size.x + 7)/8*8;
+   int c_stride = y_stride/2;
+   vec3 chroma[4] = vec3[](vec3(0.0), vec3(0.0), vec3(0.0), vec3(0.0));
+   for(int row = 0; row < 2; row++)
+   {
+      int src_y = size.y - 1 - (y0 + row); //flip: GL rows start at the bottom
+      uint words[2] = uint[](0u, 0u);
+      for(int i = 0; i < 8; i++)
+      {
+         vec3 c = texelFetch(rgb_tex, ivec2(min(x0 + i, size.x - 1), src_y), level).rgb;
+         words[i/4] |= to_byte(luma(c)) << (8*(i%4));
+         chroma[i/2] += 0.25*c;
+      }
+      int word = ((y0 + row)*y_stride + x0)/4;
+      planes[word] = words[0];
+      planes[word + 1] = words[1];
+   }
+
+   uint u = 0u, v = 0u;
+   for(int j = 0; j < 4; j++)
+   {
+      u |= to_byte(cb(chroma[j])) << (8*j);
+      v |= to_byte(cr(chroma[j])) << (8*j);
+   }
+   int u_offset = y_stride*size.y;
+   int v_offset = u_offset + c_stride*(size.y/2);
+   int c_word = (y0/2)*c_stride + x0/2;
+   planes[(u_offset + c_word)/4] = u;
+   planes[(v_offset + c_word)/4] = v;
+}
+)";
+
+   float render_thread_ms = 0.0f; //smoothed time spent in EncodeBuffer/EncodeTexture
+   thread_local float frame_mux_ms = 0.0f; //encoder threads: time in write_frame for the current frame
+
+   //Capture clock and throughput. FPS is measured over windows of fps_window_sec.
+   typedef std::chrono::high_resolution_clock clock;
+   int framerate = 60;
+   int frames_captured = 0;       //frames passed to EncodeBuffer/EncodeTexture since Start
+   clock::time_point fps_window_start;
+   int fps_window_frames = 0;
+   float capture_fps = 0.0f;
+   const float fps_window_sec = 0.5f;
 
 static void close_stream(AVFormatContext* oc, OutputStream* ost);
-void encode_frame();
-void read_frame_to_encode();
+static AVFrame* alloc_picture(enum AVPixelFormat pix_fmt, int width, int height);
+void encode_frame(Output& o, const ReadbackBuffer& b);
+void read_frame_to_encode(GLint texture = -1, int level = 0);
+static void encoder_thread(Output* o);
+static int open_output(Output& o, const char* filename, int width, int height, int level, const Options& options);
+static int open_raw_output(Output& o, const char* filename, const Options& options);
+static void open_stats_file(Output& o, const char* filename);
+static void close_output(Output& o);
+static void free_output(Output& o);
+static void create_buffer(Output& o, int index);
+static void delete_buffer(Output& o, int index);
+static void delete_buffers(Output& o);
+static void flush_encoder(AVFormatContext* oc, OutputStream* ost);
+static bool init_gpu_conversion();
+static void create_capture_target(int width, int height, int levels);
+static void delete_capture_target();
+static void copy_to_capture(GLint texture, int level, bool mipmaps);
+static void convert_on_gpu(GLuint buffer, GLint texture, int level, int width, int height);
+static void read_rgb(GLuint buffer, GLint texture, int level, int width, int height);
 static void add_stream(OutputStream* ost, AVFormatContext* oc, const AVCodec** codec,
-   enum AVCodecID codec_id, int w, int h, int framerate, int64_t bitrate);
+   enum AVCodecID codec_id, const char* encoder_name, int w, int h, const Options& options);
+static const char* find_video_codec(const AVOutputFormat* format, Options::Codec codec, enum AVCodecID* codec_id);
+static void log_encoder_settings(const AVCodecContext* c);
 static void open_video(AVFormatContext* oc, const AVCodec* codec, OutputStream* ost, AVDictionary* opt_arg);
 static void open_audio(AVFormatContext* oc, const AVCodec* codec, OutputStream* ost, AVDictionary* opt_arg);
 static int write_video_frame(AVFormatContext* oc, OutputStream* ost);
 static int write_audio_frame(AVFormatContext* oc, OutputStream* ost);
+static int output_packet(AVFormatContext* oc, OutputStream* ost, AVPacket* pkt);
 
 bool Recording() {return recording;}
+float RenderThreadMs() {return render_thread_ms;}
+double FrameTime() {return double(frames_captured) / framerate;}
+float CaptureFps() {return capture_fps;}
+int Outputs() {return int(outputs.size());}
+
+CaptureStats Stats(int output)
+{
+   CaptureStats stats = {};
+   if (output < 0 || output >= int(outputs.size())) return stats;
+   const Output& o = *outputs[output];
+   stats.wait_ms = o.wait_ms;
+   stats.convert_ms = o.convert_ms;
+   stats.encode_ms = o.encode_ms;
+   stats.mux_ms = o.mux_ms;
+   stats.dropped = o.dropped_frames;
+   stats.half_res = o.half_res_frames;
+   stats.latency_ms = o.latency_ms;
+   if (o.raw != nullptr)
+   {
+      stats.write_mb_s = o.raw->MBPerSec();
+   }
+   if (o.replay != nullptr)
+   {
+      stats.replay_sec = float(o.replay->duration * av_q2d(o.replay->time_base));
+      stats.replay_bytes = o.replay->bytes;
+   }
+   return stats;
+}
+int QueuedFrames() {return outputs.empty() ? 0 : int(outputs[0]->encode_queue.Size());}
+int ReadbackBuffers() {return outputs.empty() ? 0 : outputs[0]->num_buffers;}
+
+Options LowLatencyOptions()
+{
+   Options options;
+   options.preset = "ultrafast";
+   options.tune = "zerolatency";
+   options.max_b_frames = 0;
+   options.threading = Options::SLICE_THREADS;
+   return options;
+}
+
+Options StreamingOptions(const char* container)
+{
+   Options options = LowLatencyOptions();
+   options.container = container;
+   options.live = true;
+   options.frame_timestamps = true;
+   options.gop_size = 30; //a player joining the stream waits at most half a second for a keyframe
+   return options;
+}
 
 int Start(const char* filename, int width, int height, int framerate, int64_t bitrate)
+{
+   Options options;
+   options.framerate = framerate;
+   options.bitrate = bitrate;
+   options.crf = -1;
+   return Start(filename, width, height, options);
+}
+
+int Start(const char* filename, int width, int height, const Options& options, const std::vector<Preview>& previews)
 {
    if(recording == true) return 2; //stop recording first
+   framerate = options.framerate;
 
    //make dimensions even
    width = 2 * (width / 2);
    height = 2 * (height / 2);
 
-   if (pixel_buffers[0] != -1)
+   glPixelStorei(GL_PACK_ALIGNMENT, 4);      // 4-byte pixel alignment
+   gpu_conversion = (ConvertOnGpu == true && init_gpu_conversion());
+   persistent_mapping = (GLEW_ARB_buffer_storage == GL_TRUE);
+
+   outputs.push_back(std::unique_ptr<Output>(new Output()));
+   if (open_output(*outputs[0], filename, width, height, 0, options) != 0)
    {
-      glDeleteBuffers(num_buffers, pixel_buffers);
-      for (int i = 0; i < num_buffers; i++)
+      delete_buffers(*outputs[0]);
+      outputs.clear();
+      return 1;
+   }
+   for (const Preview& preview : previews)
+   {
+      if (int(outputs.size()) == max_outputs)
+      {
+         printf("At most %d previews, '%s' skipped\n", max_outputs - 1, preview.filename.c_str());
+         break;
+      }
+      const int level = std::max(preview.level, 1);
+      const int preview_width = (width >> level) & ~1;
+      const int preview_height = (height >> level) & ~1;
+      if (preview_width < 16 || preview_height < 16)
       {
-         pixel_buffers[i] = -1;
+         printf("Preview '%s' at level %d is too small, skipped\n", preview.filename.c_str(), level);
+         continue;
+      }
+      //Every captured frame goes to every output, so the clocks match
+      Options preview_options = preview.options;
+      preview_options.framerate = framerate;
+      outputs.push_back(std::unique_ptr<Output>(new Output()));
+      if (open_output(*outputs.back(), preview.filename.c_str(), preview_width, preview_height, level, preview_options) != 0)
+      {
+         printf("Preview '%s' could not be opened, skipped\n", preview.filename.c_str());
+         delete_buffers(*outputs.back());
+         outputs.pop_back();
       }
    }
 
-   if (pixel_buffers[0] == -1)//create buffers if they don't exist
+   //One mip level per preview halving, plus one below each output that may drop to half resolution
+   bool needs_capture = (gpu_conversion == true || outputs.size() > 1);
+   capture_levels = 1;
+   for (const auto& o : outputs)
+   {
+      const bool half_res_possible = (o->backpressure == Options::LOWER_RESOLUTION);
+      capture_levels = std::max(capture_levels, o->level + (half_res_possible ? 2 : 1));
+      needs_capture = needs_capture || half_res_possible;
+   }
+   capture_width = width;
+   capture_height = height;
+   if (needs_capture == true)
    {
-      glPixelStorei(GL_UNPACK_ALIGNMENT, 4);      // 4-byte pixel alignment
-      glGenBuffers(num_buffers, pixel_buffers);
-      for (int i = 0; i < num_buffers; i++)
+      create_capture_target(width, height, capture_levels);
+   }
+   for (auto& o : outputs)
+   {
+      for (int i = 0; i < initial_buffers; i++)
       {
-         const int size = 4 * width * height;
-         glBindBuffer(GL_PIXEL_PACK_BUFFER, pixel_buffers[i]);
-         glBufferData(GL_PIXEL_PACK_BUFFER, size, nullptr, GL_STREAM_READ);
+         create_buffer(*o, i);
       }
-      glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+   }
+
+   recording = true;
+   render_thread_ms = 0.0f;
+   frames_captured = 0;
+   fps_window_frames = 0;
+   capture_fps = 0.0f;
+   fps_window_start = clock::now();
+   for (auto& o : outputs)
+   {
+      o->encoder_running = true;
+      o->encoder = std::thread(encoder_thread, o.get());
+   }
+   return 0;
+}
+
+//Bytes per row of a Y plane written by the conversion shader. Chroma rows are half.
+static int plane_stride(int width)
+{
+   return 8 * ((width + 7) / 8);
+}
+
+static int open_output(Output& o, const char* filename, int width, int height, int level, const Options& options)
+{
+   o.filename = filename;
+   o.level = level;
+   o.width = width;
+   o.height = height;
+   o.backpressure = options.backpressure;
+   if (o.backpressure == Options::LOWER_RESOLUTION && (width % 4 != 0 || height % 4 != 0))
+   {
+      printf("Half resolution capture of '%s' needs a size divisible by 4, blocking instead\n", filename);
+      o.backpressure = Options::BLOCK;
+   }
+
+   //create buffers for this frame size
+   if (gpu_conversion == true)
+   {
+      const int y_stride = plane_stride(width);
+      o.buffer_size = y_stride * height + 2 * (y_stride / 2) * (height / 2);
+   }
+   else
+   {
+      o.buffer_size = 4 * width * height;
+   }
+   if (options.raw == true)
+   {
+      return open_raw_output(o, filename, options);
    }
 
    int ret = 0;
    /* Initialize libavcodec, and register all codecs and formats. */
    //av_register_all();
 
+   //URLs (udp://, rtp://, unix://, ...) need the network layer
+   static bool network_initialized = false;
+   if (network_initialized == false && strstr(filename, "://") != nullptr)
+   {
+      avformat_network_init();
+      network_initialized = true;
+   }
+
    /* allocate the output media context */
-   avformat_alloc_output_context2(&oc, NULL, NULL, filename);
-   if (!oc) {
+   const char* container = (options.container != nullptr && options.container[0] != '\0') ? options.container : NULL;
+   avformat_alloc_output_context2(&o.oc, NULL, container, filename);
+   if (!o.oc) {
       printf("Could not deduce output format from file extension: using MPEG.\n");
-      avformat_alloc_output_context2(&oc, NULL, "mpeg", filename);
+      avformat_alloc_output_context2(&o.oc, NULL, "mpeg", filename);
    }
-   if (!oc)
+   if (!o.oc)
       return 1;
-   fmt = oc->oformat;
+   o.fmt = o.oc->oformat;
    /* Add the audio and video streams using the default format codecs
    * and initialize the codecs. */
-   if (fmt->video_codec != AV_CODEC_ID_NONE) {
-      add_stream(&video_st, oc, &video_codec, fmt->video_codec, width, height, framerate, bitrate);
-      have_video = 1;
-      encode_video = 1;
+   enum AVCodecID video_codec_id = o.fmt->video_codec;
+   const char* encoder_name = find_video_codec(o.fmt, options.codec, &video_codec_id);
+   if (video_codec_id != AV_CODEC_ID_NONE) {
+      add_stream(&o.video_st, o.oc, &o.video_codec, video_codec_id, encoder_name, width, height, options);
+      o.have_video = 1;
+      o.encode_video = 1;
    }
 
    //No audio for now
@@ -129,182 +506,811 @@ int Start(const char* filename, int width, int height, int framerate, int64_t bi
 
    /* Now that all the parameters are set, we can open the audio and
    * video codecs and allocate the necessary encode buffers. */
-   if (have_video)
-      open_video(oc, video_codec, &video_st, opt);
-   if (have_audio)
-      open_audio(oc, audio_codec, &audio_st, opt);
-   av_dump_format(oc, 0, filename, 1);
+   if (o.have_video) {
+      open_video(o.oc, o.video_codec, &o.video_st, opt);
+      log_encoder_settings(o.video_st.enc);
+   }
+   if (o.have_audio)
+      open_audio(o.oc, o.audio_codec, &o.audio_st, opt);
+   av_dump_format(o.oc, 0, filename, 1);
+   if (level == 0 && options.replay_seconds > 0.0 && o.have_video)
+   {
+      //Nothing is written until SaveReplay. The container of filename still decides the codec setup
+      //(e.g. global headers for .mp4).
+      o.replay.reset(new ReplayRing());
+      ReplayRing& ring = *o.replay;
+      ring.time_base = o.video_st.enc->time_base;
+      ring.codecpar = avcodec_parameters_alloc();
+      avcodec_parameters_from_context(ring.codecpar, o.video_st.enc);
+      ring.max_duration = int64_t(options.replay_seconds / av_q2d(ring.time_base));
+      ring.max_bytes = options.replay_memory;
+      o.video_st.replay = o.replay.get();
+      o.video_st.unlimited = true;
+      return 0;
+   }
    /* open the output file, if needed */
-   if (!(fmt->flags & AVFMT_NOFILE)) {
-      ret = avio_open(&oc->pb, filename, AVIO_FLAG_WRITE);
+   if (!(o.fmt->flags & AVFMT_NOFILE)) {
+      ret = avio_open(&o.oc->pb, filename, AVIO_FLAG_WRITE);
       if (ret < 0) {
          char err_buf[AV_ERROR_MAX_STRING_SIZE] = { 0 };
          av_make_error_string(err_buf, AV_ERROR_MAX_STRING_SIZE, ret);
          fprintf(stderr, "Could not open '%s': %s\n", filename,
             err_buf);
+         free_output(o);
          return 1;
       }
    }
+   AVDictionary* format_options = NULL;
+   av_dict_copy(&format_options, opt, 0);
+   if (options.live == true)
+   {
+      //Hand each packet to the protocol as soon as it is muxed instead of buffering
+      o.oc->flags |= AVFMT_FLAG_FLUSH_PACKETS;
+      o.oc->max_interleave_delta = 0;
+      o.oc->max_delay = 0;
+      //mp4 can only be played while it is written when fragmented
+      if (strcmp(o.fmt->name, "mp4") == 0 || strcmp(o.fmt->name, "mov") == 0)
+      {
+         av_dict_set(&format_options, "movflags", "frag_keyframe+empty_moov+default_base_moof", 0);
+      }
+      o.video_st.unlimited = true;
+   }
+   o.frame_timestamps = options.frame_timestamps;
    /* Write the stream header, if any. */
-   ret = avformat_write_header(oc, &opt);
+   ret = avformat_write_header(o.oc, &format_options);
+   av_dict_free(&format_options);
    if (ret < 0) {
       char err_buf[AV_ERROR_MAX_STRING_SIZE] = { 0 };
       av_make_error_string(err_buf, AV_ERROR_MAX_STRING_SIZE, ret);
       fprintf(stderr, "Error occurred when opening output file: %s\n",
          err_buf);
+      free_output(o);
       return 1;
    }
-   recording = true;
+   if (options.stats_csv == true)
+   {
+      open_stats_file(o, filename);
+   }
    return 0;
 }
 
+//Raw capture writes YUV420P frames as they come from the conversion. Y4M is the simplest container
+//ffmpeg and most tools read: a text header, then "FRAME\n" and the planes, rows tightly packed.
+static int open_raw_output(Output& o, const char* filename, const Options& options)
+{
+   o.raw.reset(new RawWriter());
+   if (o.raw->Open(filename, options.raw_preallocate, options.raw_valid_data) == false)
+   {
+      o.raw.reset();
+      return 1;
+   }
+   //The conversion averages 2x2 blocks, so chroma is sited at the center (420jpeg), in limited range
+   char header[128];
+   const int header_size = snprintf(header, sizeof(header), "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg XCOLORRANGE=LIMITED\n",
+      o.width, o.height, options.framerate);
+   o.raw->Write(header, header_size);
+   o.video_st.frame = alloc_picture(AV_PIX_FMT_YUV420P, o.width, o.height);
+   o.encode_video = 1;
+   printf("%s: raw capture, %.1f MB/frame, %s, %s\n", filename, o.width * o.height * 1.5 / 1048576.0,
+      o.raw->Unbuffered() ? "unbuffered" : "buffered (volume refused unbuffered I/O)",
+      o.raw->AsyncExtend() ? "preallocated with valid data" : "preallocated");
+   if (options.stats_csv == true)
+   {
+      open_stats_file(o, filename);
+   }
+   return 0;
+}
+
+static void open_stats_file(Output& o, const char* filename)
+{
+   const std::string stats_filename = std::string(filename) + ".csv";
+   o.stats_file = fopen(stats_filename.c_str(), "w");
+   if (o.stats_file == nullptr)
+   {
+      fprintf(stderr, "Could not open '%s' for capture stats\n", stats_filename.c_str());
+   }
+   else
+   {
+      //encode_ms is the file write for raw captures
+      fprintf(o.stats_file, "frame,wait_ms,queued,half_res,dropped_before,convert_ms,encode_ms,mux_ms,latency_ms\n");
+   }
+}
+
+//Encoder thread: append the converted frame to the raw file. Returns false once writing has failed.
+static bool write_raw_frame(Output& o)
+{
+   static const char frame_header[] = "FRAME\n";
+   bool ok = o.raw->Write(frame_header, sizeof(frame_header) - 1);
+   const AVFrame* frame = o.video_st.frame;
+   for (int i = 0; i < 3 && ok; i++)
+   {
+      const int w = (i == 0) ? o.width : o.width / 2;
+      const int h = (i == 0) ? o.height : o.height / 2;
+      for (int y = 0; y < h && ok; y++)
+      {
+         ok = o.raw->Write(frame->data[i] + y * frame->linesize[i], w);
+      }
+   }
+   return ok;
+}
+
+static void close_output(Output& o)
+{
+   if (o.raw != nullptr)
+   {
+      if (o.stats_file != nullptr)
+      {
+         fclose(o.stats_file);
+         o.stats_file = nullptr;
+      }
+      const bool ok = o.raw->Close();
+      printf("%s: captured %d frames raw, %d dropped, %.1f MB at %.0f MB/s sustained, %.0f ms waiting for the disk%s\n",
+         o.filename.c_str(), frames_captured, int(o.dropped_frames), o.raw->BytesWritten() / 1048576.0, o.raw->MBPerSec(),
+         o.raw->WaitMs(), ok ? "" : ", WRITE FAILED");
+      o.raw.reset();
+      av_frame_free(&o.video_st.frame);
+      return;
+   }
+   //Write packets the encoder is still holding back (lookahead, B-frames)
+   if (o.have_video)
+      flush_encoder(o.oc, &o.video_st);
+
+   if (o.replay == nullptr)
+      av_write_trailer(o.oc);
+   if (o.stats_file != nullptr)
+   {
+      fclose(o.stats_file);
+      o.stats_file = nullptr;
+   }
+   printf("%s: captured %d frames, %d dropped, %d at half resolution\n", o.filename.c_str(), frames_captured,
+      int(o.dropped_frames), o.half_res_frames);
+   if (o.replay != nullptr)
+   {
+      printf("%s: replay ring held %.1f s in %.1f MB at the end, %.1f MB at most\n", o.filename.c_str(),
+         o.replay->duration * av_q2d(o.replay->time_base), o.replay->bytes / 1048576.0, o.replay->peak_bytes / 1048576.0);
+      o.video_st.replay = nullptr;
+      o.replay.reset();
+   }
+   free_output(o);
+}
+
+//Frees what open_output allocated: codec contexts and frames, the opened file and the format context.
+//Writes nothing, so it also cleans up after open_output fails.
+static void free_output(Output& o)
+{
+   /* Close each codec. */
+   if (o.have_video)
+      close_stream(o.oc, &o.video_st);
+   if (o.have_audio)
+      close_stream(o.oc, &o.audio_st);
+   o.have_video = o.have_audio = 0;
+   o.encode_video = o.encode_audio = 0;
+   o.video_st.replay = nullptr;
+   o.replay.reset();
+   if (o.oc != nullptr)
+   {
+      if (!(o.fmt->flags & AVFMT_NOFILE) && o.oc->pb != nullptr)
+         /* Close the output file. */
+         avio_closep(&o.oc->pb);
+      /* free the stream */
+      avformat_free_context(o.oc);
+   }
+   o.oc = 0;
+   o.fmt = 0;
+}
+
+//Comparable between processes on the same machine, unlike clock
+static int64_t wall_clock_us()
+{
+   return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+static void update_frame_stats(clock::time_point start)
+{
+   auto stop = clock::now();
+   const float ms = std::chrono::duration<float, std::milli>(stop - start).count();
+   render_thread_ms = 0.95f * render_thread_ms + 0.05f * ms;
+
+   frames_captured++;
+   fps_window_frames++;
+   const float window_sec = std::chrono::duration<float>(stop - fps_window_start).count();
+   if (window_sec >= fps_window_sec)
+   {
+      capture_fps = fps_window_frames / window_sec;
+      fps_window_frames = 0;
+      fps_window_start = stop;
+   }
+}
+
 void EncodeBuffer(GLint buffer)
 {
+   auto start = clock::now();
    glFlush();
    glReadBuffer(buffer);
    read_frame_to_encode();
-   encode_frame();
+   update_frame_stats(start);
 }
 
 void EncodeTexture(GLint texture, int level)
 {
+   auto start = clock::now();
    glFlush();
-   
-   //Ping-pong buffers
-   buffer_index = (buffer_index + 1) % num_buffers;
-   read_index = (buffer_index + (num_buffers - 1)) % num_buffers;
+   read_frame_to_encode(texture, level);
+   update_frame_stats(start);
+}
 
-   if (rgb[buffer_index] != nullptr)
+static void create_buffer(Output& o, int index)
+{
+   ReadbackBuffer& b = o.buffers[index];
+   glCreateBuffers(1, &b.pbo);
+   if (persistent_mapping == true)
    {
-      glUnmapNamedBuffer(pixel_buffers[buffer_index]);
-      rgb[buffer_index] = nullptr;
+      //Coherent: once the fence signals the readback is visible through the pointer, no unmap needed
+      const GLbitfield flags = GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+      glNamedBufferStorage(b.pbo, o.buffer_size, nullptr, flags);
+      b.rgb = (GLubyte*)glMapNamedBufferRange(b.pbo, 0, o.buffer_size, flags);
    }
+   else
+   {
+      glNamedBufferData(b.pbo, o.buffer_size, nullptr, GL_STREAM_READ);
+      b.rgb = nullptr;
+   }
+   b.fence = 0;
+   o.free_buffers.push_back(index);
+   o.num_buffers++;
+}
 
-   //start async transfer to current buffer
-   glBindBuffer(GL_PIXEL_PACK_BUFFER, pixel_buffers[buffer_index]);
-   const int size = video_st.enc->width* video_st.enc->height*4;
-   const int offset = 0;
-   glGetTextureSubImage(texture, level, offset, offset, offset, video_st.enc->width, video_st.enc->height, 1, GL_BGRA, GL_UNSIGNED_BYTE, size, nullptr);
-   //glReadPixels(0, 0, video_st.enc->width, video_st.enc->height, GL_BGRA, GL_UNSIGNED_BYTE, 0);
+static void delete_buffer(Output& o, int index)
+{
+   ReadbackBuffer& b = o.buffers[index];
+   if (b.fence != 0)
+   {
+      glDeleteSync(b.fence);
+   }
+   if (b.rgb != nullptr)
+   {
+      glUnmapNamedBuffer(b.pbo);
+   }
+   glDeleteBuffers(1, &b.pbo);
+   b = ReadbackBuffer();
+   o.num_buffers--;
+}
 
-   //Read back from last buffer
-   rgb[read_index] = (GLubyte*)glMapNamedBuffer(pixel_buffers[read_index], GL_READ_ONLY);
-   if (rgb[read_index] == nullptr)
+static void delete_buffers(Output& o)
+{
+   for (int i = 0; i < max_buffers; i++)
    {
-      glUnmapNamedBuffer(pixel_buffers[read_index]);
+      if (o.buffers[i].pbo != 0)
+      {
+         delete_buffer(o, i);
+      }
    }
+   o.free_buffers.clear();
+}
 
-   glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+//Make buffers the encoder thread has finished with available again. Returns the number reclaimed.
+static int reclaim_buffers(Output& o)
+{
+   int count = 0;
+   int index;
+   while (o.done_queue.Pop(index))
+   {
+      if (persistent_mapping == false)
+      {
+         glUnmapNamedBuffer(o.buffers[index].pbo);
+         o.buffers[index].rgb = nullptr;
+      }
+      o.free_buffers.push_back(index);
+      count++;
+   }
+   return count;
+}
 
-   encode_frame();
+//Hand readbacks whose fences have signaled to the encoder thread, in the order they were issued.
+//With wait_for_oldest the oldest readback is waited for if necessary.
+static void queue_finished_readbacks(Output& o, bool wait_for_oldest)
+{
+   while (o.reading.empty() == false)
+   {
+      const int index = o.reading.front();
+      ReadbackBuffer& b = o.buffers[index];
+      const GLuint64 timeout_ns = wait_for_oldest ? 1000000000 : 0;
+      const GLenum status = glClientWaitSync(b.fence, wait_for_oldest ? GL_SYNC_FLUSH_COMMANDS_BIT : 0, timeout_ns);
+      if (status == GL_TIMEOUT_EXPIRED) break;
+      wait_for_oldest = false;
+
+      o.reading.pop_front();
+      glDeleteSync(b.fence);
+      b.fence = 0;
+
+      if (persistent_mapping == false)
+      {
+         //Doesn't stall: the data is already in the buffer
+         b.rgb = (GLubyte*)glMapNamedBuffer(b.pbo, GL_READ_ONLY);
+      }
+      if (b.rgb == nullptr || status == GL_WAIT_FAILED)
+      {
+         if (persistent_mapping == false)
+         {
+            glUnmapNamedBuffer(b.pbo);
+         }
+         o.free_buffers.push_back(index);
+         continue;
+      }
+      //Can't fail: each buffer is in the queue at most once
+      o.encode_queue.Push(index);
+      o.wake.notify_one();
+   }
 }
 
-void Stop()
+//Get a buffer for the next readback. The ring grows when readbacks or encoding take longer than it
+//can cover, and shrinks again when buffers sit unused. Returns -1 when none is free and can_wait is false.
+static int acquire_buffer(Output& o, bool can_wait)
 {
-   for (int i = 0; i < num_buffers; i++)
+   if (o.free_buffers.empty() && o.num_buffers < max_buffers)
    {
-      if (rgb[i] != nullptr)
+      for (int i = 0; i < max_buffers; i++)
       {
-         glUnmapNamedBuffer(pixel_buffers[i]);
-         rgb[i] = nullptr;
+         if (o.buffers[i].pbo == 0)
+         {
+            create_buffer(o, i);
+            break;
+         }
       }
    }
-   buffer_index = 0;
-   read_index = num_buffers - 1;
 
-   av_write_trailer(oc);
-   /* Close each codec. */
-   if (have_video)
-      close_stream(oc, &video_st);
-   if (have_audio)
-      close_stream(oc, &audio_st);
-   if (!(fmt->flags & AVFMT_NOFILE))
-      /* Close the output file. */
-      avio_closep(&oc->pb);
-   /* free the stream */
-   avformat_free_context(oc);
+   //The ring is as deep as it gets: wait for the GPU or the encoder thread
+   if (o.free_buffers.empty() && can_wait == false) return -1;
+   auto wait_start = clock::now();
+   while (o.free_buffers.empty())
+   {
+      if (o.reading.empty() == false)
+      {
+         queue_finished_readbacks(o, true);
+      }
+      if (reclaim_buffers(o) == 0 && o.free_buffers.empty())
+      {
+         std::this_thread::yield();
+      }
+   }
+   o.buffers[o.free_buffers.back()].wait_ms = std::chrono::duration<float, std::milli>(clock::now() - wait_start).count();
+
+   const int index = o.free_buffers.back();
+   o.free_buffers.pop_back();
 
-   video_st = { 0 };
-   audio_st = { 0 };
-   fmt = 0;
-   oc = 0;
-   audio_codec = 0;
-   video_codec = 0;
-   have_video = 0;
-   have_audio = 0;
-   encode_video = 0;
-   encode_audio = 0;
+   o.peak_buffers_in_use = std::max(o.peak_buffers_in_use, o.num_buffers - int(o.free_buffers.size()));
+   if (++o.frames_since_resize >= resize_interval)
+   {
+      //Keep one spare buffer above the peak
+      if (o.peak_buffers_in_use + 1 < o.num_buffers && o.num_buffers > min_buffers && o.free_buffers.empty() == false)
+      {
+         delete_buffer(o, o.free_buffers.back());
+         o.free_buffers.pop_back();
+      }
+      o.frames_since_resize = 0;
+      o.peak_buffers_in_use = 0;
+   }
+   return index;
+}
+
+void Stop()
+{
+   //Wait for the remaining readbacks, then let the encoder threads drain their queues
+   for (auto& o : outputs)
+   {
+      while (o->reading.empty() == false)
+      {
+         queue_finished_readbacks(*o, true);
+      }
+      o->encoder_running = false;
+      o->wake.notify_one();
+   }
+   for (auto& o : outputs)
+   {
+      if (o->encoder.joinable())
+      {
+         o->encoder.join();
+      }
+      reclaim_buffers(*o);
+      delete_buffers(*o);
+   }
+   delete_capture_target();
+   gpu_conversion = false;
+
+   for (auto& o : outputs)
+   {
+      close_output(*o);
+   }
+   outputs.clear();
+   //Replays hold their own packet references, but the files should be complete when Stop returns
+   for (std::thread& writer : replay_writers)
+   {
+      writer.join();
+   }
+   replay_writers.clear();
    opt = 0;
    recording = false;
 }
 
-static void frame_yuv_from_rgb(uint8_t* rgb)
+//Copy planes written by the conversion shader into the encoder's frame. Half resolution planes are
+//scaled back up to the frame size.
+static void frame_yuv_from_planes(Output& o, const uint8_t* planes, bool half_res)
+{
+   const int w = o.width;
+   const int h = o.height;
+   const int pw = half_res ? w / 2 : w;
+   const int ph = half_res ? h / 2 : h;
+   const int y_stride = plane_stride(pw);
+   const int c_stride = y_stride / 2;
+   const uint8_t* y = planes;
+   const uint8_t* u = y + y_stride * ph;
+   const uint8_t* v = u + c_stride * (ph / 2);
+
+   AVFrame* frame = o.video_st.frame;
+   if (half_res == true)
+   {
+      UpscalePlane2x(y, y_stride, pw, ph, frame->data[0], frame->linesize[0]);
+      UpscalePlane2x(u, c_stride, pw / 2, ph / 2, frame->data[1], frame->linesize[1]);
+      UpscalePlane2x(v, c_stride, pw / 2, ph / 2, frame->data[2], frame->linesize[2]);
+      return;
+   }
+   av_image_copy_plane(frame->data[0], frame->linesize[0], y, y_stride, w, h);
+   av_image_copy_plane(frame->data[1], frame->linesize[1], u, c_stride, w / 2, h / 2);
+   av_image_copy_plane(frame->data[2], frame->linesize[2], v, c_stride, w / 2, h / 2);
+}
+
+static void frame_yuv_from_rgb(Output& o, const uint8_t* rgb, bool half_res)
+{
+   const int w = o.width;
+   const int h = o.height;
+   if (half_res == false)
+   {
+      //negative stride from the last row flips the image
+      const uint8_t* src = rgb + 4 * w * (h - 1);
+      BgraToYuv420(src, -4 * w, w, h, o.video_st.frame->data, o.video_st.frame->linesize);
+      return;
+   }
+
+   const int hw = w / 2;
+   const int hh = h / 2;
+   o.half_planes.resize(size_t(hw) * hh * 3 / 2);
+   uint8_t* const planes[3] = { &o.half_planes[0], &o.half_planes[hw * hh], &o.half_planes[hw * hh + hw * hh / 4] };
+   const int strides[3] = { hw, hw / 2, hw / 2 };
+   BgraToYuv420(rgb + 4 * hw * (hh - 1), -4 * hw, hw, hh, planes, strides);
+
+   AVFrame* frame = o.video_st.frame;
+   for (int i = 0; i < 3; i++)
+   {
+      const int div = (i == 0) ? 1 : 2;
+      UpscalePlane2x(planes[i], strides[i], hw / div, hh / div, frame->data[i], frame->linesize[i]);
+   }
+}
+
+static float elapsed_ms(clock::time_point& start)
 {
-   if (rgb == nullptr) return;
-   const int in_linesize[1] = { -4 * video_st.enc->width }; //negative for flip
-   video_st.sws_ctx = sws_getCachedContext(video_st.sws_ctx,
-      video_st.enc->width, video_st.enc->height, AV_PIX_FMT_RGB32,
-      video_st.enc->width, video_st.enc->height, AV_PIX_FMT_YUV420P,
-      0, NULL, NULL, NULL);
+   const clock::time_point now = clock::now();
+   const float ms = std::chrono::duration<float, std::milli>(now - start).count();
+   start = now;
+   return ms;
+}
 
-   //flip image
-   uint8_t* src = rgb + 4 * video_st.enc->width * (video_st.enc->height - 1);
+static void smooth(std::atomic<float>& average, float ms)
+{
+   average = 0.95f * average + 0.05f * ms;
+}
 
-   sws_scale(video_st.sws_ctx, (const uint8_t* const*)&src, in_linesize, 0,
-      video_st.enc->height, video_st.frame->data, video_st.frame->linesize);
+//Encoders that support it (libx264 and libx265 in FFmpeg 4.4 and later) write this side data into the
+//bitstream as a user data SEI message, so it reaches the client with the frame
+static void attach_timestamp(AVFrame* frame, int64_t capture_us)
+{
+#if LIBAVUTIL_VERSION_INT >= AV_VERSION_INT(56, 70, 100)
+   av_frame_remove_side_data(frame, AV_FRAME_DATA_SEI_UNREGISTERED); //the frame is reused
+   AVFrameSideData* side_data = av_frame_new_side_data(frame, AV_FRAME_DATA_SEI_UNREGISTERED, sizeof(timestamp_uuid) + 8);
+   if (side_data != nullptr)
+   {
+      memcpy(side_data->data, timestamp_uuid, sizeof(timestamp_uuid));
+      for (int i = 0; i < 8; i++)
+      {
+         side_data->data[sizeof(timestamp_uuid) + i] = uint8_t(capture_us >> (8 * i));
+      }
+   }
+#endif
 }
 
 
-void encode_frame()
+//Runs on the output's encoder thread
+void encode_frame(Output& o, const ReadbackBuffer& b)
 {
-   if (rgb[read_index] == nullptr) return;
-   frame_yuv_from_rgb(rgb[read_index]);
+   if (o.encode_video == 0)
+   {
+      //Nothing is written once encoding has stopped
+      o.dropped_frames++;
+      o.dropped_since_row++;
+      return;
+   }
 
-   if (encode_video || encode_audio)
+   auto start = clock::now();
+   //The encoder may still hold a reference to the previous frame, so get a writable one before
+   //converting into it
+   if (av_frame_make_writable(o.video_st.frame) < 0)
+   {
+      fprintf(stderr, "Could not make the video frame writable\n");
+   }
+   if (gpu_conversion == true)
+   {
+      frame_yuv_from_planes(o, b.rgb, b.half_res);
+   }
+   else
+   {
+      frame_yuv_from_rgb(o, b.rgb, b.half_res);
+   }
+   const float frame_convert_ms = elapsed_ms(start);
+   if (o.frame_timestamps == true)
+   {
+      attach_timestamp(o.video_st.frame, b.capture_us);
+   }
+
+   frame_mux_ms = 0.0f;
+   if (o.raw != nullptr)
+   {
+      o.encode_video = write_raw_frame(o);
+   }
+   else if (o.encode_video || o.encode_audio)
    {
       /* select the stream to encode */
-      if (encode_video &&
-         (!encode_audio || av_compare_ts(video_st.next_pts, video_st.enc->time_base,
-            audio_st.next_pts, audio_st.enc->time_base) <= 0)) {
-         encode_video = !write_video_frame(oc, &video_st);
+      if (o.encode_video &&
+         (!o.encode_audio || av_compare_ts(o.video_st.next_pts, o.video_st.enc->time_base,
+            o.audio_st.next_pts, o.audio_st.enc->time_base) <= 0)) {
+         o.video_st.next_pts = b.frame;
+         o.encode_video = !write_video_frame(o.oc, &o.video_st);
       }
       else {
-         encode_audio = !write_audio_frame(oc, &audio_st);
+         o.encode_audio = !write_audio_frame(o.oc, &o.audio_st);
       }
    }
+   const float frame_encode_ms = elapsed_ms(start) - frame_mux_ms;
+   //Capture to muxed: the sender's share of glass-to-glass latency. With B-frames or lookahead the frame's
+   //packet comes out later than this.
+   const float frame_latency_ms = (wall_clock_us() - b.capture_us) / 1000.0f;
 
-   if (encode_video == 0)
+   if (o.encode_video == 0)
    {
-      printf("error");
+      if (o.raw != nullptr)
+      {
+         fprintf(stderr, "%s could not be written at frame %d, later frames are dropped\n", o.filename.c_str(), int(b.frame));
+      }
+      else
+      {
+         fprintf(stderr, "%s reached the %g s limit at frame %d, later frames are dropped\n",
+            o.filename.c_str(), STREAM_DURATION, int(b.frame));
+      }
+      o.dropped_frames++;
+      o.dropped_since_row++;
+   }
+
+   smooth(o.convert_ms, frame_convert_ms);
+   smooth(o.encode_ms, frame_encode_ms);
+   smooth(o.mux_ms, frame_mux_ms);
+   smooth(o.latency_ms, frame_latency_ms);
+   if (o.stats_file != nullptr)
+   {
+      fprintf(o.stats_file, "%d,%.3f,%d,%d,%d,%.3f,%.3f,%.3f,%.3f\n", int(b.frame), b.wait_ms, b.queued, b.half_res ? 1 : 0,
+         o.dropped_since_row.exchange(0), frame_convert_ms, frame_encode_ms, frame_mux_ms, frame_latency_ms);
    }
 }
 
-void read_frame_to_encode()
+//Reads the current read buffer, or texture if it isn't -1, once for all outputs. With previews or half
+//resolution frames the source is copied to capture_tex, whose mip levels give the smaller sizes, so
+//the framebuffer is only read once however many files are written.
+void read_frame_to_encode(GLint texture, int level)
 {
-   //Ping-pong buffers
-   buffer_index = (buffer_index + 1) % num_buffers;
-   read_index = (buffer_index + (num_buffers - 1)) % num_buffers;
+   int indices[max_outputs];
+   const int count = int(outputs.size());
+   bool copy = (outputs.size() > 1 || (gpu_conversion == true && texture == -1));
+   bool mipmaps = false;
+   for (int i = 0; i < count; i++)
+   {
+      Output& o = *outputs[i];
+      reclaim_buffers(o);
+      queue_finished_readbacks(o, false);
 
-   if (rgb[buffer_index] != nullptr)
+      if (o.backpressure == Options::LOWER_RESOLUTION)
+      {
+         //Switch when the ring is nearly full, and back once it has drained to half
+         const int in_use = o.num_buffers - int(o.free_buffers.size());
+         if (in_use >= max_buffers - 1) o.half_res_mode = true;
+         else if (in_use <= max_buffers / 2) o.half_res_mode = false;
+      }
+
+      indices[i] = acquire_buffer(o, o.backpressure != Options::DROP_NEWEST);
+      if (indices[i] == -1)
+      {
+         o.dropped_frames++;
+         o.dropped_since_row++;
+         continue;
+      }
+      copy = copy || o.half_res_mode;
+      mipmaps = mipmaps || o.level > 0 || o.half_res_mode;
+   }
+
+   if (copy == true)
    {
-      glUnmapNamedBuffer(pixel_buffers[buffer_index]);
-      rgb[buffer_index] = nullptr;
+      copy_to_capture(texture, level, mipmaps);
+      texture = capture_tex;
+      level = 0;
    }
 
-   //start async transfer to current buffer
-   glBindBuffer(GL_PIXEL_PACK_BUFFER, pixel_buffers[buffer_index]);
-   glReadPixels(0, 0, video_st.enc->width, video_st.enc->height, GL_BGRA, GL_UNSIGNED_BYTE, 0);
+   for (int i = 0; i < count; i++)
+   {
+      if (indices[i] == -1) continue;
+      Output& o = *outputs[i];
+      ReadbackBuffer& b = o.buffers[indices[i]];
+      b.frame = frames_captured;
+      b.queued = int(o.encode_queue.Size());
+      b.half_res = o.half_res_mode;
+      b.capture_us = wall_clock_us();
+      o.wait_ms = 0.95f * o.wait_ms + 0.05f * b.wait_ms;
+
+      int read_level = level + o.level;
+      int w = o.width;
+      int h = o.height;
+      if (b.half_res == true)
+      {
+         o.half_res_frames++;
+         read_level++;
+         w /= 2;
+         h /= 2;
+      }
+
+      if (gpu_conversion == true)
+      {
+         convert_on_gpu(b.pbo, texture, read_level, w, h);
+      }
+      else
+      {
+         read_rgb(b.pbo, texture, read_level, w, h);
+      }
+      b.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+      o.reading.push_back(indices[i]);
+   }
+}
 
-   //Read back from last buffer
-   rgb[read_index] = (GLubyte*)glMapNamedBuffer(pixel_buffers[read_index], GL_READ_ONLY);
-   if (rgb[read_index] == nullptr)
+static bool init_gpu_conversion()
+{
+   if (yuv_program == -1)
+   {
+      yuv_program = glCreateShaderProgramv(GL_COMPUTE_SHADER, 1, &yuv_compute_shader);
+      GLint linked = GL_FALSE;
+      glGetProgramiv(yuv_program, GL_LINK_STATUS, &linked);
+      if (!linked)
+      {
+         GLint log_size = 0;
+         glGetProgramiv(yuv_program, GL_INFO_LOG_LENGTH, &log_size);
+         std::vector<char> log(log_size + 1, '\0');
+         glGetProgramInfoLog(yuv_program, log_size, NULL, log.data());
+         fprintf(stderr, "GPU YUV conversion unavailable, converting on the CPU:\n%s\n", log.data());
+         glDeleteProgram(yuv_program);
+         yuv_program = -1;
+         ConvertOnGpu = false; //don't retry every recording
+         return false;
+      }
+   }
+   return true;
+}
+
+static void create_capture_target(int width, int height, int levels)
+{
+   glCreateTextures(GL_TEXTURE_2D, 1, &capture_tex);
+   glTextureStorage2D(capture_tex, levels, GL_RGBA8, width, height);
+   glTextureParameteri(capture_tex, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+   glTextureParameteri(capture_tex, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+   glCreateFramebuffers(1, &capture_fbo);
+   glNamedFramebufferTexture(capture_fbo, GL_COLOR_ATTACHMENT0, capture_tex, 0);
+   glCreateFramebuffers(1, &source_fbo);
+}
+
+static void delete_capture_target()
+{
+   if (capture_fbo != -1)
+   {
+      glDeleteFramebuffers(1, &capture_fbo);
+      glDeleteFramebuffers(1, &source_fbo);
+      glDeleteTextures(1, &capture_tex);
+      capture_fbo = -1;
+      source_fbo = -1;
+      capture_tex = -1;
+   }
+}
+
+//Copy the current read buffer, or texture if it isn't -1, into level 0 of capture_tex. The mip levels
+//are 2x2 box filtered versions for previews and half resolution readbacks.
+static void copy_to_capture(GLint texture, int level, bool mipmaps)
+{
+   GLint read_fbo = 0;
+   if (texture == -1)
+   {
+      glGetIntegerv(GL_READ_FRAMEBUFFER_BINDING, &read_fbo);
+   }
+   else
    {
-      glUnmapNamedBuffer(pixel_buffers[read_index]);
+      glNamedFramebufferTexture(source_fbo, GL_COLOR_ATTACHMENT0, texture, level);
+      glNamedFramebufferReadBuffer(source_fbo, GL_COLOR_ATTACHMENT0);
+      read_fbo = source_fbo;
    }
+   const int w = capture_width;
+   const int h = capture_height;
+   glBlitNamedFramebuffer(read_fbo, capture_fbo, 0, 0, w, h, 0, 0, w, h, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+   if (mipmaps == true && capture_levels > 1)
+   {
+      glGenerateTextureMipmap(capture_tex);
+   }
+}
 
+//Convert level of texture into YUV420P planes in buffer. The texture can't be the default framebuffer.
+static void convert_on_gpu(GLuint buffer, GLint texture, int level, int width, int height)
+{
+   GLint current_program = 0;
+   glGetIntegerv(GL_CURRENT_PROGRAM, &current_program);
+
+   glUseProgram(yuv_program);
+   glProgramUniform2i(yuv_program, 0, width, height);
+   glProgramUniform1i(yuv_program, 1, level);
+   glBindTextureUnit(yuv_texture_unit, texture);
+   glBindBufferBase(GL_SHADER_STORAGE_BUFFER, yuv_buffer_binding, buffer);
+   const int blocks_x = (width + 7) / 8;
+   const int blocks_y = height / 2;
+   glDispatchCompute((blocks_x + 7) / 8, (blocks_y + 7) / 8, 1);
+   //Make the shader writes visible to glMapBuffer and to persistently mapped pointers
+   glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT | GL_CLIENT_MAPPED_BUFFER_BARRIER_BIT);
+
+   glBindBufferBase(GL_SHADER_STORAGE_BUFFER, yuv_buffer_binding, 0);
+   glBindTextureUnit(yuv_texture_unit, 0);
+   glUseProgram(current_program);
+}
+
+//Read the current read buffer, or level of texture if it isn't -1, as BGRA into buffer
+static void read_rgb(GLuint buffer, GLint texture, int level, int width, int height)
+{
+   //start async transfer to current buffer
+   glBindBuffer(GL_PIXEL_PACK_BUFFER, buffer);
+   if (texture == -1)
+   {
+      glReadPixels(0, 0, width, height, GL_BGRA, GL_UNSIGNED_BYTE, 0);
+   }
+   else
+   {
+      const int size = width * height * 4;
+      const int offset = 0;
+      glGetTextureSubImage(texture, level, offset, offset, offset, width, height, 1, GL_BGRA, GL_UNSIGNED_BYTE, size, nullptr);
+   }
    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
 }
 
+static void encoder_thread(Output* o)
+{
+   for (;;)
+   {
+      //Read the flag before popping so a frame queued just before Stop() isn't missed
+      const bool running = o->encoder_running;
+      int index;
+      if (o->encode_queue.Pop(index))
+      {
+         encode_frame(*o, o->buffers[index]);
+         o->done_queue.Push(index);
+      }
+      else if (running == false)
+      {
+         break; //queue is drained
+      }
+      else
+      {
+         //The timeout covers a notify that arrives between Pop and wait
+         std::unique_lock<std::mutex> lock(o->wake_mutex);
+         o->wake.wait_for(lock, std::chrono::milliseconds(5));
+      }
+   }
+}
+
 static void log_packet(const AVFormatContext *fmt_ctx, const AVPacket *pkt)
 {
    AVRational *time_base = &fmt_ctx->streams[pkt->stream_index]->time_base;
@@ -337,18 +1343,363 @@ static int write_frame(AVFormatContext *fmt_ctx, const AVRational *time_base, AV
    pkt->stream_index = st->index;
    /* Write the compressed frame to the media file. */
    if(enable_logging) log_packet(fmt_ctx, pkt);
-   return av_interleaved_write_frame(fmt_ctx, pkt);
+   auto start = clock::now();
+   const int ret = av_interleaved_write_frame(fmt_ctx, pkt);
+   frame_mux_ms += std::chrono::duration<float, std::milli>(clock::now() - start).count();
+   return ret;
+}
+
+//Encoder thread: keep the packet, then drop whole GOPs from the front while the rest still covers the
+//replay length, or while the ring is over its memory budget. The newest GOP is always kept.
+static void replay_push(ReplayRing& ring, AVPacket* pkt)
+{
+   AVPacket* packet = av_packet_alloc();
+   av_packet_move_ref(packet, pkt);
+
+   std::lock_guard<std::mutex> lock(ring.mutex);
+   if (ring.packets.empty() && (packet->flags & AV_PKT_FLAG_KEY) == 0)
+   {
+      av_packet_free(&packet); //a replay has to start at a keyframe
+      return;
+   }
+   ring.packets.push_back(packet);
+   ring.bytes += packet->size;
+   for (;;)
+   {
+      size_t next_key = 1;
+      while (next_key < ring.packets.size() && (ring.packets[next_key]->flags & AV_PKT_FLAG_KEY) == 0)
+      {
+         next_key++;
+      }
+      if (next_key == ring.packets.size()) break;
+      const bool long_enough = (packet->dts - ring.packets[next_key]->dts >= ring.max_duration);
+      if (long_enough == false && ring.bytes <= ring.max_bytes) break;
+      for (size_t i = 0; i < next_key; i++)
+      {
+         ring.bytes -= ring.packets.front()->size;
+         av_packet_free(&ring.packets.front());
+         ring.packets.pop_front();
+      }
+   }
+   ring.duration = packet->dts - ring.packets.front()->dts + 1;
+   ring.peak_bytes = std::max(ring.peak_bytes, int64_t(ring.bytes));
+}
+
+static int output_packet(AVFormatContext* oc, OutputStream* ost, AVPacket* pkt)
+{
+   if (ost->replay != nullptr)
+   {
+      replay_push(*ost->replay, pkt);
+      return 0;
+   }
+   return write_frame(oc, &ost->enc->time_base, ost->st, pkt);
+}
+
+//Background thread started by SaveReplay. Owns packets and codecpar.
+static void write_replay(std::string filename, AVCodecParameters* codecpar, AVRational time_base, std::vector<AVPacket*> packets)
+{
+   AVFormatContext* oc = 0;
+   avformat_alloc_output_context2(&oc, NULL, NULL, filename.c_str());
+   int ret = AVERROR(EINVAL);
+   double seconds = 0.0;
+   if (oc != 0)
+   {
+      AVStream* st = avformat_new_stream(oc, NULL);
+      avcodec_parameters_copy(st->codecpar, codecpar);
+      st->codecpar->codec_tag = 0; //let the muxer choose
+      st->time_base = time_base;
+      ret = 0;
+      if (!(oc->oformat->flags & AVFMT_NOFILE))
+         ret = avio_open(&oc->pb, filename.c_str(), AVIO_FLAG_WRITE);
+      if (ret >= 0)
+         ret = avformat_write_header(oc, NULL);
+      if (ret >= 0)
+      {
+         //The clip starts at 0
+         const int64_t start = packets.front()->dts;
+         seconds = (packets.back()->dts - start + 1) * av_q2d(time_base);
+         for (AVPacket* pkt : packets)
+         {
+            pkt->pts -= start;
+            pkt->dts -= start;
+            av_packet_rescale_ts(pkt, time_base, st->time_base);
+            pkt->stream_index = st->index;
+            if (ret >= 0)
+               ret = av_interleaved_write_frame(oc, pkt);
+         }
+         if (ret >= 0)
+            ret = av_write_trailer(oc);
+      }
+      if (!(oc->oformat->flags & AVFMT_NOFILE))
+         avio_closep(&oc->pb);
+      avformat_free_context(oc);
+   }
+   for (AVPacket* pkt : packets)
+   {
+      av_packet_free(&pkt);
+   }
+   avcodec_parameters_free(&codecpar);
+
+   if (ret < 0) {
+      char err_buf[AV_ERROR_MAX_STRING_SIZE] = { 0 };
+      av_make_error_string(err_buf, AV_ERROR_MAX_STRING_SIZE, ret);
+      fprintf(stderr, "Could not write replay '%s': %s\n", filename.c_str(), err_buf);
+   }
+   else {
+      printf("Saved %.1f s replay to '%s'\n", seconds, filename.c_str());
+   }
+}
+
+bool SaveReplay(const char* filename)
+{
+   if (outputs.empty() || outputs[0]->replay == nullptr) return false;
+   ReplayRing& ring = *outputs[0]->replay;
+
+   //References, not copies: the packet data is shared with the ring
+   std::vector<AVPacket*> packets;
+   {
+      std::lock_guard<std::mutex> lock(ring.mutex);
+      packets.reserve(ring.packets.size());
+      for (const AVPacket* pkt : ring.packets)
+      {
+         packets.push_back(av_packet_clone(pkt));
+      }
+   }
+   if (packets.empty()) return false;
+
+   AVCodecParameters* codecpar = avcodec_parameters_alloc();
+   avcodec_parameters_copy(codecpar, ring.codecpar);
+   replay_writers.push_back(std::thread(write_replay, std::string(filename), codecpar, ring.time_base, packets));
+   return true;
+}
+
+//Look for the capture timestamp SEI in an Annex B packet (MPEG-TS and raw H.264/H.265 streams)
+static bool find_timestamp(const uint8_t* data, int size, bool hevc, int64_t* capture_us)
+{
+   for (int i = 0; i + 3 < size; i++)
+   {
+      if (data[i] != 0 || data[i + 1] != 0 || data[i + 2] != 1) continue;
+      const int nal = i + 3;
+      const int nal_type = hevc ? (data[nal] >> 1) & 0x3f : data[nal] & 0x1f;
+      if (nal_type != (hevc ? 39 : 6)) continue; //prefix SEI
+
+      //Remove emulation prevention bytes from the part that can hold our message
+      uint8_t rbsp[64];
+      int length = 0;
+      int zeros = 0;
+      for (int j = nal + (hevc ? 2 : 1); j < size && length < int(sizeof(rbsp)); j++)
+      {
+         if (zeros >= 2 && data[j] == 3)
+         {
+            zeros = 0;
+            continue;
+         }
+         zeros = (data[j] == 0) ? zeros + 1 : 0;
+         rbsp[length++] = data[j];
+      }
+
+      //First SEI message of the NAL unit. x264 puts its own messages in separate NAL units.
+      int pos = 0;
+      int payload_type = 0, payload_size = 0;
+      while (pos < length && rbsp[pos] == 0xff) payload_type += rbsp[pos++];
+      if (pos < length) payload_type += rbsp[pos++];
+      while (pos < length && rbsp[pos] == 0xff) payload_size += rbsp[pos++];
+      if (pos < length) payload_size += rbsp[pos++];
+      const int message_size = int(sizeof(timestamp_uuid)) + 8;
+      if (payload_type != 5 || payload_size < message_size || pos + message_size > length) continue;
+      if (memcmp(&rbsp[pos], timestamp_uuid, sizeof(timestamp_uuid)) != 0) continue;
+
+      int64_t us = 0;
+      for (int k = 0; k < 8; k++)
+      {
+         us |= int64_t(rbsp[pos + sizeof(timestamp_uuid) + k]) << (8 * k);
+      }
+      *capture_us = us;
+      return true;
+   }
+   return false;
+}
+
+static int probe_interrupt(void*)
+{
+   return probe_running ? 0 : 1;
+}
+
+static void probe_thread(std::string url)
+{
+   AVFormatContext* ic = avformat_alloc_context();
+   ic->interrupt_callback.callback = probe_interrupt;
+   AVDictionary* input_options = NULL;
+   av_dict_set(&input_options, "fflags", "nobuffer", 0);
+   av_dict_set(&input_options, "probesize", "32768", 0);
+   int ret = avformat_open_input(&ic, url.c_str(), NULL, &input_options);
+   av_dict_free(&input_options);
+   if (ret < 0) {
+      char err_buf[AV_ERROR_MAX_STRING_SIZE] = { 0 };
+      av_make_error_string(err_buf, AV_ERROR_MAX_STRING_SIZE, ret);
+      fprintf(stderr, "Latency probe could not open '%s': %s\n", url.c_str(), err_buf);
+      probe_running = false;
+      return;
+   }
+
+   AVPacket* pkt = av_packet_alloc();
+   while (probe_running == true && av_read_frame(ic, pkt) >= 0)
+   {
+      const AVCodecID codec_id = ic->streams[pkt->stream_index]->codecpar->codec_id;
+      int64_t capture_us = 0;
+      if ((codec_id == AV_CODEC_ID_H264 || codec_id == AV_CODEC_ID_HEVC) &&
+         find_timestamp(pkt->data, pkt->size, codec_id == AV_CODEC_ID_HEVC, &capture_us))
+      {
+         const float ms = (wall_clock_us() - capture_us) / 1000.0f;
+         probe_latency_ms = (probe_frames == 0) ? ms : 0.95f * probe_latency_ms + 0.05f * ms;
+         probe_frames++;
+      }
+      av_packet_unref(pkt);
+   }
+   av_packet_free(&pkt);
+   avformat_close_input(&ic);
+}
+
+bool StartLatencyProbe(const char* url)
+{
+   if (probe_running == true) return false;
+   if (probe.joinable()) probe.join(); //ended by itself, e.g. the stream couldn't be opened
+   avformat_network_init();
+   probe_latency_ms = 0.0f;
+   probe_frames = 0;
+   probe_running = true;
+   probe = std::thread(probe_thread, std::string(url));
+   return true;
+}
+
+void StopLatencyProbe()
+{
+   probe_running = false;
+   if (probe.joinable()) probe.join();
+}
+
+float ProbeLatencyMs() {return probe_latency_ms;}
+int ProbeFrames() {return probe_frames;}
+
+//Y4M stream header: size, frame rate and a 4:2:0 chroma format. Interlacing and aspect are ignored.
+static bool read_y4m_header(FILE* file, int& width, int& height, AVRational& rate)
+{
+   char line[1024];
+   if (fgets(line, sizeof(line), file) == nullptr || strncmp(line, "YUV4MPEG2 ", 10) != 0) return false;
+   width = 0;
+   height = 0;
+   rate = av_make_q(0, 1);
+   for (char* token = strtok(line + 10, " \n"); token != nullptr; token = strtok(nullptr, " \n"))
+   {
+      switch (token[0])
+      {
+      case 'W': width = atoi(token + 1); break;
+      case 'H': height = atoi(token + 1); break;
+      case 'F': sscanf(token + 1, "%d:%d", &rate.num, &rate.den); break;
+      case 'C': if (strncmp(token + 1, "420", 3) != 0) return false; break;
+      }
+   }
+   return width > 0 && height > 0 && width % 2 == 0 && height % 2 == 0 && rate.num > 0 && rate.den > 0;
+}
+
+int Transcode(const char* input, const char* filename, const Options& options)
+{
+   if (recording == true) return 2; //shares the recorder's state
+   FILE* file = fopen(input, "rb");
+   if (file == nullptr)
+   {
+      fprintf(stderr, "Could not open '%s'\n", input);
+      return 1;
+   }
+   setvbuf(file, nullptr, _IOFBF, 8 << 20); //few large reads
+   int width, height;
+   AVRational rate;
+   if (read_y4m_header(file, width, height, rate) == false)
+   {
+      fprintf(stderr, "'%s' is not a Y4M file with 4:2:0 chroma and an even size\n", input);
+      fclose(file);
+      return 1;
+   }
+
+   Options transcode_options = options;
+   transcode_options.framerate = int(av_q2d(rate) + 0.5);
+   transcode_options.raw = false;
+   transcode_options.replay_seconds = 0.0;
+   gpu_conversion = false;
+   Output o;
+   if (open_output(o, filename, width, height, 0, transcode_options) != 0)
+   {
+      fclose(file);
+      return 1;
+   }
+   o.video_st.unlimited = true; //the capture was as long as it was
+
+   //Frames go to the encoder in the order they were captured, through the same path as a recording
+   const clock::time_point start = clock::now();
+   int frames = 0;
+   char line[256];
+   while (o.encode_video && fgets(line, sizeof(line), file) != nullptr && strncmp(line, "FRAME", 5) == 0)
+   {
+      if (av_frame_make_writable(o.video_st.frame) < 0) break;
+      AVFrame* frame = o.video_st.frame;
+      bool complete = true;
+      for (int i = 0; i < 3 && complete; i++)
+      {
+         const int w = (i == 0) ? width : width / 2;
+         const int h = (i == 0) ? height : height / 2;
+         for (int y = 0; y < h && complete; y++)
+         {
+            complete = (fread(frame->data[i] + y * frame->linesize[i], 1, w, file) == size_t(w));
+         }
+      }
+      if (complete == false) break; //the capture was cut short
+      o.video_st.next_pts = frames++;
+      o.encode_video = !write_video_frame(o.oc, &o.video_st);
+      if (frames % 600 == 0)
+      {
+         printf("%s: %d frames\n", filename, frames);
+      }
+   }
+   fclose(file);
+
+   frames_captured = frames; //close_output reports it
+   close_output(o);
+   const float seconds = std::chrono::duration<float>(clock::now() - start).count();
+   printf("%s: transcoded %d frames in %.1f s (%.1f frames/s, %.0f MB/s read)\n", filename, frames, seconds,
+      frames / seconds, frames * width * height * 1.5 / 1048576.0 / seconds);
+   return 0;
+}
+
+
+//Encoder name and id for the requested codec. Falls back to the container's default codec
+//when the container can't hold the requested one (e.g. FFV1 in .mp4).
+static const char* find_video_codec(const AVOutputFormat* format, Options::Codec codec, enum AVCodecID* codec_id)
+{
+   *codec_id = format->video_codec;
+   if (codec == Options::FORMAT_DEFAULT) return nullptr;
+
+   const char* names[] = { nullptr, "libx264", "libx265", "mpeg4", "ffv1" };
+   const enum AVCodecID ids[] = { format->video_codec, AV_CODEC_ID_H264, AV_CODEC_ID_HEVC, AV_CODEC_ID_MPEG4, AV_CODEC_ID_FFV1 };
+   if (avformat_query_codec(format, ids[codec], FF_COMPLIANCE_NORMAL) != 1) {
+      fprintf(stderr, "%s can't store %s, using %s\n", format->name,
+         avcodec_get_name(ids[codec]), avcodec_get_name(format->video_codec));
+      return nullptr;
+   }
+   *codec_id = ids[codec];
+   return names[codec];
 }
 
 /* Add an output stream. */
 static void add_stream(OutputStream *ost, AVFormatContext *oc,
    const AVCodec **codec,
-   enum AVCodecID codec_id, int w, int h, int framerate, int64_t bitrate)
+   enum AVCodecID codec_id, const char* encoder_name, int w, int h, const Options& options)
 {
    AVCodecContext *c;
    int i;
-   /* find the encoder */
-   *codec = avcodec_find_encoder(codec_id);
+   /* find the encoder, by name first since there may be several for one codec */
+   *codec = (encoder_name != nullptr) ? avcodec_find_encoder_by_name(encoder_name) : nullptr;
+   if (!(*codec))
+      *codec = avcodec_find_encoder(codec_id);
    if (!(*codec)) {
       fprintf(stderr, "Could not find encoder for '%s'\n",
          avcodec_get_name(codec_id));
@@ -393,7 +1744,7 @@ static void add_stream(OutputStream *ost, AVFormatContext *oc,
       break;
    case AVMEDIA_TYPE_VIDEO:
       c->codec_id = codec_id;
-      c->bit_rate = bitrate;
+      c->bit_rate = options.bitrate;
       /* Resolution must be a multiple of two. */
       c->width = w;
       c->height = h;
@@ -402,10 +1753,25 @@ static void add_stream(OutputStream *ost, AVFormatContext *oc,
       * of which frame timestamps are represented. For fixed-fps content,
       * timebase should be 1/framerate and timestamp increments should be
       * identical to 1. */
-      ost->st->time_base = av_make_q(1, framerate);
+      ost->st->time_base = av_make_q(1, options.framerate);
       c->time_base = ost->st->time_base;
-      c->gop_size = 12; /* emit one intra frame every twelve frames at most */
+      c->framerate = av_make_q(options.framerate, 1);
+      c->gop_size = (options.gop_size > 0) ? options.gop_size : options.framerate;
       c->pix_fmt = STREAM_PIX_FMT;
+      c->thread_count = options.threads;
+      c->thread_type = (options.threading == Options::SLICE_THREADS) ? FF_THREAD_SLICE : FF_THREAD_FRAME;
+      if (options.max_b_frames >= 0)
+         c->max_b_frames = options.max_b_frames;
+      if (c->codec_id == AV_CODEC_ID_H264 || c->codec_id == AV_CODEC_ID_HEVC) {
+         //Private options of libx264/libx265. Other H.264/HEVC encoders just don't have them.
+         av_opt_set(c->priv_data, "preset", options.preset, 0);
+         if (options.tune[0] != '\0')
+            av_opt_set(c->priv_data, "tune", options.tune, 0);
+         if (options.crf >= 0) {
+            av_opt_set_int(c->priv_data, "crf", options.crf, 0);
+            c->bit_rate = 0;
+         }
+      }
       if (c->codec_id == AV_CODEC_ID_MPEG2VIDEO) {
          /* just for testing, we also add B-frames */
          c->max_b_frames = 2;
@@ -416,12 +1782,6 @@ static void add_stream(OutputStream *ost, AVFormatContext *oc,
          * the motion of the chroma plane does not match the luma plane. */
          c->mb_decision = 2;
       }
-      if (w > 1920 && h > 1080)
-      {
-         c->max_b_frames = 0;
-         c->delay = 0;
-         c->thread_count = 1; // more than one threads seem to increase delay
-      }
       break;
    default:
       break;
@@ -671,6 +2031,41 @@ static void open_video(AVFormatContext *oc, const AVCodec *codec, OutputStream *
    }
 }
 
+//Prints what the opened encoder will actually do, after codec defaults and presets are applied
+static void log_encoder_settings(const AVCodecContext* c)
+{
+   char rate[64];
+   int64_t crf = -1;
+   if (c->codec_id == AV_CODEC_ID_FFV1)
+      snprintf(rate, sizeof(rate), "lossless");
+   else if (c->bit_rate == 0 && c->priv_data && av_opt_get_int(c->priv_data, "crf", 0, &crf) >= 0 && crf >= 0)
+      snprintf(rate, sizeof(rate), "crf %d", int(crf));
+   else
+      snprintf(rate, sizeof(rate), "%.1f Mbit/s", c->bit_rate / 1.0e6);
+
+   uint8_t* preset = nullptr;
+   uint8_t* tune = nullptr;
+   if (c->priv_data) {
+      av_opt_get(c->priv_data, "preset", 0, &preset);
+      av_opt_get(c->priv_data, "tune", 0, &tune);
+   }
+
+   const char* threading = (c->active_thread_type == FF_THREAD_SLICE) ? "slice" :
+      (c->active_thread_type == FF_THREAD_FRAME) ? "frame" : "encoder's own";
+   char threads[16];
+   if (c->thread_count > 0)
+      snprintf(threads, sizeof(threads), "%d", c->thread_count);
+   else
+      snprintf(threads, sizeof(threads), "auto");
+
+   printf("Encoder %s: %dx%d at %d fps, %s, preset %s, tune %s, gop %d, max B-frames %d, %s %s threads\n",
+      c->codec->name, c->width, c->height, c->time_base.den / std::max(c->time_base.num, 1), rate,
+      (preset && preset[0]) ? (const char*)preset : "-", (tune && tune[0]) ? (const char*)tune : "-",
+      c->gop_size, c->max_b_frames, threads, threading);
+   av_free(preset);
+   av_free(tune);
+}
+
 /* Prepare a dummy image. */
 static void fill_yuv_image(AVFrame *pict, int frame_index,
    int width, int height)
@@ -694,7 +2089,7 @@ static AVFrame *get_video_frame(OutputStream *ost)
 {
    AVCodecContext *c = ost->enc;
    /* check if we want to generate more frames */
-   if (av_compare_ts(ost->next_pts, c->time_base,
+   if (!ost->unlimited && av_compare_ts(ost->next_pts, c->time_base,
       STREAM_DURATION, av_make_q(1, 1)) >= 0)
       return NULL;
    /* when we pass a frame to the encoder, it may keep a reference to it
@@ -753,7 +2148,7 @@ static int write_video_frame(AVFormatContext *oc, OutputStream *ost)
    do {
        receive_ret = avcodec_receive_packet(c, &pkt);
        if (receive_ret == 0) {
-           ret = write_frame(oc, &c->time_base, ost->st, &pkt);
+           ret = output_packet(oc, ost, &pkt);
        }
 
    } while (receive_ret == 0);
@@ -766,7 +2161,7 @@ static int write_video_frame(AVFormatContext *oc, OutputStream *ost)
       //exit(1);
    }
    if (got_packet) {
-      ret = write_frame(oc, &c->time_base, ost->st, &pkt);
+      ret = output_packet(oc, ost, &pkt);
    }
    else {
       ret = 0;
@@ -779,6 +2174,17 @@ static int write_video_frame(AVFormatContext *oc, OutputStream *ost)
    }
    return (frame || got_packet) ? 0 : 1;
 }
+static void flush_encoder(AVFormatContext *oc, OutputStream *ost)
+{
+   AVCodecContext *c = ost->enc;
+   AVPacket pkt = { 0 };
+   av_init_packet(&pkt);
+   avcodec_send_frame(c, NULL); //enter draining mode
+   while (avcodec_receive_packet(c, &pkt) == 0) {
+      output_packet(oc, ost, &pkt);
+   }
+}
+
 static void close_stream(AVFormatContext *oc, OutputStream *ost)
 {
    avcodec_free_context(&ost->enc);
@@ -835,7 +2241,11 @@ int main_test()
    /* Add the audio and video streams using the default format codecs
    * and initialize the codecs. */
    if (fmt->video_codec != AV_CODEC_ID_NONE) {
-      add_stream(&video_st, oc, &video_codec, fmt->video_codec, 256, 256, 25, 4000000);
+      Options test_options;
+      test_options.codec = Options::FORMAT_DEFAULT;
+      test_options.framerate = 25;
+      test_options.crf = -1;
+      add_stream(&video_st, oc, &video_codec, fmt->video_codec, nullptr, 256, 256, test_options);
       have_video = 1;
       encode_video = 1;
    }
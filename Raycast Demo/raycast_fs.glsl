@@ -2,7 +2,11 @@
 layout(binding = 0) uniform sampler2D backface_tex; 
 layout(location = 1) uniform float time;
 layout(location = 2) uniform int pass;
+#ifdef MODE
+const int mode = MODE;
+#else
 layout(location = 3) uniform int mode = 1;
+#endif
 layout(location = 4) uniform vec4 slider = vec4(1.0);
 
 layout(std140, binding = 0) uniform SceneUniforms
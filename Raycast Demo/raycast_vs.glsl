@@ -2,7 +2,12 @@
 layout(location = 0) uniform mat4 M;
 layout(location = 1) uniform float time;
 layout(location = 2) uniform int pass = 0;
+//MODE may be compiled in as a #define (see ShaderVariants), which removes the branches on mode.
+#ifdef MODE
+const int mode = MODE;
+#else
 layout(location = 3) uniform int mode = 1;
+#endif
 
 //Enum for modes
 const int OUTSIDE_LOOKING_IN = 0;